@@ -0,0 +1,1086 @@
+/**
+ * @file aesd-char-core.c
+ * @brief Ring, read, write and seek logic of the AESD char driver
+ *
+ * Everything here is independent of the character device plumbing in
+ * main.c, and builds both in the kernel and, against aesd-user-shim.h, as an
+ * ordinary user space library for benchmarks and fuzzing.
+ */
+
+#ifdef __KERNEL__
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/sched/signal.h>
+#include <linux/srcu.h>
+#include <linux/uio.h>
+#include <linux/ktime.h>
+#include <linux/string.h>
+#include <linux/jhash.h>
+#endif
+
+#include "aesdchar.h"
+#include "aesd_ioctl.h"
+
+unsigned long aesd_max_retained = 4 << 20;
+module_param(aesd_max_retained, ulong, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(aesd_max_retained, "Byte budget for retained entries per device, oldest entries are evicted beyond it and larger commands fail with ENOSPC");
+unsigned long aesd_max_pending = 1 << 20;
+module_param(aesd_max_pending, ulong, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(aesd_max_pending, "Byte budget for an unterminated command per device, writes beyond it fail with ENOSPC");
+unsigned long aesd_store_bytes;
+module_param(aesd_store_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_store_bytes, "Size of a contiguous byte store per device holding all entry data, 0 to allocate each entry separately");
+bool aesd_dedup;
+module_param(aesd_dedup, bool, S_IRUGO);
+MODULE_PARM_DESC(aesd_dedup, "Share one buffer between retained entries with identical contents, ignored with aesd_store_bytes");
+
+struct kmem_cache *aesd_ring_cachep;
+struct kmem_cache *aesd_cmd_cachep;
+
+int aesd_core_init(void)
+{
+    aesd_ring_cachep = kmem_cache_create("aesd_ring", sizeof(struct aesd_ring), 0,
+            SLAB_HWCACHE_ALIGN, NULL);
+    if (!aesd_ring_cachep) {
+        return -ENOMEM;
+    }
+    aesd_cmd_cachep = KMEM_CACHE(aesd_cmd_str, 0);
+    if (!aesd_cmd_cachep) {
+        kmem_cache_destroy(aesd_ring_cachep);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void aesd_core_exit(void)
+{
+    kmem_cache_destroy(aesd_cmd_cachep);
+    kmem_cache_destroy(aesd_ring_cachep);
+}
+
+/**
+ * Mirror a newly committed entry of @size bytes into the mmap() data window.
+ * @history_start is the base of the ring published with the entry.
+ * Must be called with dev->lock held.
+ */
+void aesd_history_append(struct aesd_dev *dev, const char *buf, size_t size, u64 history_start)
+{
+    struct aesd_history *history = &dev->history;
+    struct aesd_mmap_header *header = history->header;
+    u64 tail = header->tail + size;
+    size_t pos, chunk;
+
+    if (size > history->capacity) {
+        buf += size - history->capacity;
+        size = history->capacity;
+    }
+
+    WRITE_ONCE(header->seq, header->seq + 1);
+    smp_wmb();
+
+    if (tail - header->head > history->capacity) {
+        WRITE_ONCE(header->head, tail - history->capacity);
+    }
+    pos = (tail - size) % history->capacity;
+    chunk = min(size, history->capacity - pos);
+    memcpy(history->data + pos, buf, chunk);
+    memcpy(history->data, buf + chunk, size - chunk);
+    WRITE_ONCE(header->tail, tail);
+    WRITE_ONCE(header->history_start, history_start);
+
+    smp_wmb();
+    WRITE_ONCE(header->seq, header->seq + 1);
+}
+
+/**
+ * Update the history start in the mmap() header after entries were evicted
+ * without a new commit. Must be called with dev->lock held.
+ */
+void aesd_history_set_start(struct aesd_dev *dev, u64 history_start)
+{
+    struct aesd_mmap_header *header = dev->history.header;
+
+    WRITE_ONCE(header->seq, header->seq + 1);
+    smp_wmb();
+    WRITE_ONCE(header->history_start, history_start);
+    smp_wmb();
+    WRITE_ONCE(header->seq, header->seq + 1);
+}
+
+/**
+ * Stamp the @nr entries of a batch with the commit time @mono_ns.  The
+ * realtime stamp is clamped to that of the newest retained entry, so both
+ * clocks stay sorted in ring order for aesd_seek_time() even if the realtime
+ * clock is stepped back.  Must be called with dev->lock held.
+ */
+static void aesd_entries_stamp(struct aesd_dev *dev, struct aesd_buffer_entry *entries,
+        unsigned int nr, u64 mono_ns)
+{
+    struct aesd_ring *ring = rcu_dereference_protected(dev->ring, lockdep_is_held(&dev->lock));
+    struct aesd_circular_buffer *c_buf = &ring->circular_buffer;
+    u64 real_ns = ktime_get_real_ns();
+    unsigned int i;
+
+    if (aesd_circular_buffer_count(c_buf)) {
+        real_ns = max(real_ns, c_buf->entry[(c_buf->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1) %
+                AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].real_ns);
+    }
+    for (i = 0; i < nr; i++) {
+        entries[i].mono_ns = mono_ns;
+        entries[i].real_ns = real_ns;
+    }
+}
+
+/**
+ * Logical store offset of the oldest entry of @ring, or the store tail when
+ * @ring is empty.  Live data never spans more than the store capacity and
+ * entries are never empty, which makes the offset unique.
+ */
+static u64 aesd_store_head(struct aesd_dev *dev, struct aesd_ring *ring)
+{
+    struct aesd_store *store = &dev->store;
+    struct aesd_circular_buffer *c_buf = &ring->circular_buffer;
+    size_t phys;
+
+    if (!aesd_circular_buffer_count(c_buf)) {
+        return store->tail;
+    }
+    phys = c_buf->entry[c_buf->out_offs].buffptr - store->data;
+    return store->tail - 1 - (store->tail - 1 - phys) % store->capacity;
+}
+
+static inline struct aesd_payload *aesd_payload_of(const char *buffptr)
+{
+    return (struct aesd_payload *)(buffptr - offsetof(struct aesd_payload, data));
+}
+
+/**
+ * Allocate a buffer for an entry of @size bytes, in dedup mode the data of a
+ * payload that is not in the dedup table yet
+ */
+static char *aesd_entry_alloc(struct aesd_dev *dev, size_t size)
+{
+    struct aesd_payload *payload;
+
+    if (!dev->dedup) {
+        return kmalloc(size, GFP_KERNEL);
+    }
+    payload = kmalloc(sizeof(*payload) + size, GFP_KERNEL);
+    if (!payload) {
+        return NULL;
+    }
+    payload->refs = 0;
+    payload->size = size;
+    return payload->data;
+}
+
+/**
+ * Free an entry buffer from aesd_entry_alloc() that was never committed
+ */
+static void aesd_entry_free(struct aesd_dev *dev, const char *buffptr)
+{
+    if (dev->dedup && buffptr) {
+        kfree(aesd_payload_of(buffptr));
+    } else {
+        kfree(buffptr);
+    }
+}
+
+/**
+ * Point each of the @nr new entries of @entries that is identical to an
+ * entry already retained, or to an earlier one of the batch, at that entry's
+ * payload, and add the others to the dedup table.  The buffers replaced are
+ * stored in @duplicates for the caller to free once the lock is dropped.
+ * Must be called with dev->lock held, in dedup mode.
+ */
+static void aesd_entries_share(struct aesd_dev *dev, struct aesd_buffer_entry *entries, unsigned int nr,
+        const char **duplicates)
+{
+    struct aesd_payload *payload, *shared;
+    struct hlist_head *bucket;
+    unsigned int i;
+
+    for (i = 0; i < nr; i++) {
+        payload = aesd_payload_of(entries[i].buffptr);
+        payload->hash = jhash(payload->data, payload->size, 0);
+        bucket = &dev->dedup_table[payload->hash & ((1 << AESD_DEDUP_BITS) - 1)];
+        hlist_for_each_entry(shared, bucket, node) {
+            if (shared->hash == payload->hash && shared->size == payload->size &&
+                    !memcmp(shared->data, payload->data, payload->size)) {
+                break;
+            }
+        }
+        if (shared) {
+            shared->refs++;
+            duplicates[i] = entries[i].buffptr;
+            entries[i].buffptr = shared->data;
+            aesd_stats_add(&dev->stats, AESD_STAT_DEDUP_HITS, 1);
+            aesd_stats_add(&dev->stats, AESD_STAT_DEDUP_BYTES, payload->size);
+        } else {
+            payload->refs = 1;
+            hlist_add_head(&payload->node, bucket);
+        }
+    }
+}
+
+/**
+ * Drop the reference an entry leaving the current ring holds on @buffptr.
+ * Returns the allocation to free once no reader can see it anymore, or NULL
+ * while other retained entries still share it.  Must be called with
+ * dev->lock held.
+ */
+static const void *aesd_entry_put(struct aesd_dev *dev, const char *buffptr)
+{
+    struct aesd_payload *payload;
+
+    if (!dev->dedup) {
+        return buffptr;
+    }
+    payload = aesd_payload_of(buffptr);
+    if (--payload->refs) {
+        return NULL;
+    }
+    hlist_del(&payload->node);
+    return payload;
+}
+
+static void aesd_ring_free_rcu(struct rcu_head *head)
+{
+    struct aesd_ring *ring = container_of(head, struct aesd_ring, rcu);
+    uint8_t i;
+
+    // Callbacks may run out of order, but any of them completing means the
+    // readers of every older ring are gone too, so only ever move forward
+    if (ring->store && ring->reclaim_to > READ_ONCE(ring->store->reclaimed)) {
+        WRITE_ONCE(ring->store->reclaimed, ring->reclaim_to);
+    }
+    for (i = 0; i < ring->nr_evicted; i++) {
+        kfree(ring->evicted[i]);
+    }
+    kmem_cache_free(aesd_ring_cachep, ring);
+}
+
+/**
+ * Account for @rm_entry leaving @ring, and hand its buffer to @old, the ring
+ * being replaced, to free after the grace period.  In dedup mode that only
+ * happens once no other entry shares the buffer.  Returns the number of
+ * entries evicted, 0 if @rm_entry was not in use.
+ */
+static unsigned int aesd_ring_evict(struct aesd_dev *dev, struct aesd_ring *ring, struct aesd_ring *old,
+        const struct aesd_buffer_entry *rm_entry)
+{
+    const void *allocation;
+
+    if (!rm_entry->buffptr) {
+        return 0;
+    }
+    ring->size -= rm_entry->size;
+    ring->base += rm_entry->size;
+    if (!old->store) {
+        allocation = aesd_entry_put(dev, rm_entry->buffptr);
+        if (allocation) {
+            old->evicted[old->nr_evicted++] = allocation;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Publish @ring as a copy of the current ring with the @nr_add entries of
+ * @add_entries appended, and then the @nr_evict oldest entries plus any
+ * beyond the retained byte budget removed. The byte budget never evicts the
+ * newest entry.
+ * @dropped counts bytes committed in the same batch that were never stored
+ * because later entries would have evicted them right away.
+ * The replaced ring, and the entry buffers evicted, are freed once every
+ * reader that could still see them has left its SRCU section.
+ * Must be called with dev->lock held.
+ */
+void aesd_ring_publish(struct aesd_dev *dev, struct aesd_ring *ring,
+        const struct aesd_buffer_entry *add_entries, unsigned int nr_add,
+        size_t dropped, unsigned int nr_evict)
+{
+    struct aesd_ring *old = rcu_dereference_protected(dev->ring, lockdep_is_held(&dev->lock));
+    struct aesd_buffer_entry rm_entry;
+    unsigned long max_retained = READ_ONCE(aesd_max_retained);
+    unsigned int i, evicted = 0;
+
+    memcpy(ring, old, sizeof(*ring));
+    ring->nr_evicted = 0;
+    ring->base += dropped;
+    old->nr_evicted = 0;
+    old->store = dev->store.data ? &dev->store : NULL;
+
+    for (i = 0; i < nr_add; i++) {
+        rm_entry = aesd_circular_buffer_add_entry(&ring->circular_buffer, &add_entries[i]);
+        ring->size += add_entries[i].size;
+        evicted += aesd_ring_evict(dev, ring, old, &rm_entry);
+    }
+    while ((nr_evict && aesd_circular_buffer_count(&ring->circular_buffer)) ||
+            (aesd_circular_buffer_count(&ring->circular_buffer) > 1 && ring->size > max_retained)) {
+        rm_entry = aesd_circular_buffer_remove_entry(&ring->circular_buffer);
+        evicted += aesd_ring_evict(dev, ring, old, &rm_entry);
+        if (nr_evict) {
+            nr_evict--;
+        }
+    }
+
+    if (old->store) {
+        old->reclaim_to = aesd_store_head(dev, ring);
+    }
+    aesd_stats_add(&dev->stats, AESD_STAT_EVICTIONS, evicted);
+    rcu_assign_pointer(dev->ring, ring);
+    call_srcu(&dev->srcu, &old->rcu, aesd_ring_free_rcu);
+}
+
+long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, unsigned int write_cmd_offset) {
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_ring *ring;
+    struct aesd_circular_buffer *c_buf;
+    int total_cmds, n, i, idx;
+    struct aesd_buffer_entry *entry = NULL;
+    loff_t size_to_skip = 0;
+    long retval = 0;
+
+    idx = srcu_read_lock(&dev->srcu);
+    ring = srcu_dereference(dev->ring, &dev->srcu);
+    c_buf = &ring->circular_buffer;
+    i = c_buf->out_offs;
+
+    if (c_buf->full) {
+        total_cmds = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    } else {
+        total_cmds = (c_buf->in_offs - c_buf->out_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+
+    if (write_cmd >= total_cmds) {
+        retval = -EINVAL;
+        goto out;
+    }
+
+    for (n = 0; n < total_cmds; n++) {
+        entry = &c_buf->entry[i];
+        if (n == write_cmd) {
+            break;
+        }
+        size_to_skip += entry->size; 
+        i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; 
+    }
+
+    if (write_cmd_offset >= entry->size) {
+        retval = -EINVAL;
+        goto out;
+    }
+
+    size_to_skip += write_cmd_offset;
+    filp->f_pos = size_to_skip;
+    file->base = ring->base;
+
+  out:
+    srcu_read_unlock(&dev->srcu, idx);
+    return retval;
+}
+
+loff_t aesd_llseek(struct file *filp, loff_t offset, int whence) {
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_ring *ring;
+    loff_t retval = -EINVAL;
+    int idx;
+
+    idx = srcu_read_lock(&dev->srcu);
+    ring = srcu_dereference(dev->ring, &dev->srcu);
+
+    retval = fixed_size_llseek(filp, offset, whence, ring->size);
+    file->base = ring->base;
+
+    srcu_read_unlock(&dev->srcu, idx);
+    return retval;
+}
+
+long aesd_set_tail(struct file *filp, bool tail) {
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    int idx;
+
+    idx = srcu_read_lock(&dev->srcu);
+    file->tail = tail;
+    file->base = srcu_dereference(dev->ring, &dev->srcu)->base;
+    srcu_read_unlock(&dev->srcu, idx);
+    return 0;
+}
+
+/**
+ * Fill in the entry table of @snap, and copy the data to the user buffer it
+ * names when that is large enough, all from a single ring snapshot
+ */
+long aesd_snapshot(struct file *filp, struct aesd_snapshot *snap)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_ring *ring;
+    struct aesd_circular_buffer *c_buf;
+    struct aesd_buffer_entry *entry;
+    char __user *data = u64_to_user_ptr(snap->data);
+    uint64_t offset = 0;
+    uint8_t n, i, count;
+    long retval = 0;
+    int idx;
+
+    BUILD_BUG_ON(AESD_SNAPSHOT_MAX_ENTRIES < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+
+    idx = srcu_read_lock(&dev->srcu);
+    ring = srcu_dereference(dev->ring, &dev->srcu);
+    c_buf = &ring->circular_buffer;
+    count = aesd_circular_buffer_count(c_buf);
+
+    snap->size = ring->size;
+    snap->base = ring->base;
+    snap->entry_count = count;
+    memset(snap->entries, 0, sizeof(snap->entries));
+    for (n = 0, i = c_buf->out_offs; n < count; n++, i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        entry = &c_buf->entry[i];
+        snap->entries[n].offset = offset;
+        snap->entries[n].size = entry->size;
+        // The ring is immutable and SRCU readers may sleep, so copy straight from the entries
+        if (data && ring->size <= snap->data_len &&
+                copy_to_user(data + offset, entry->buffptr, entry->size)) {
+            retval = -EFAULT;
+            break;
+        }
+        offset += entry->size;
+    }
+
+    srcu_read_unlock(&dev->srcu, idx);
+    return retval;
+}
+
+/**
+ * Position @filp at the first retained command committed at or after
+ * seek->time_ns, or at the end of the data when every command is older.
+ * Commit times are sorted in ring order, so this is a binary search over the
+ * entry table and no command data is touched.
+ */
+long aesd_seek_time(struct file *filp, struct aesd_seektime *seek)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_ring *ring;
+    struct aesd_circular_buffer *c_buf;
+    struct aesd_buffer_entry *entry;
+    uint8_t lo, hi, mid, n, count;
+    u64 stamp, offset = 0;
+    int idx;
+
+    if (seek->clock != AESD_SEEKTIME_MONOTONIC && seek->clock != AESD_SEEKTIME_REALTIME) {
+        return -EINVAL;
+    }
+
+    idx = srcu_read_lock(&dev->srcu);
+    ring = srcu_dereference(dev->ring, &dev->srcu);
+    c_buf = &ring->circular_buffer;
+    count = aesd_circular_buffer_count(c_buf);
+
+    seek->found_ns = 0;
+    lo = 0;
+    hi = count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        entry = &c_buf->entry[(c_buf->out_offs + mid) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        stamp = seek->clock == AESD_SEEKTIME_REALTIME ? entry->real_ns : entry->mono_ns;
+        if (stamp < seek->time_ns) {
+            lo = mid + 1;
+        } else {
+            seek->found_ns = stamp;
+            hi = mid;
+        }
+    }
+    for (n = 0; n < lo; n++) {
+        offset += c_buf->entry[(c_buf->out_offs + n) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size;
+    }
+
+    seek->write_cmd = lo;
+    seek->offset = offset;
+    filp->f_pos = offset;
+    file->base = ring->base;
+
+    srcu_read_unlock(&dev->srcu, idx);
+    return 0;
+}
+
+/**
+ * For tail readers, move @f_pos back by the bytes evicted from @ring since
+ * @file was last positioned so it keeps pointing at the same data.
+ */
+loff_t aesd_file_pos(struct aesd_file *file, struct aesd_ring *ring, loff_t f_pos)
+{
+    u64 evicted = ring->base - file->base;
+
+    if (!file->tail) {
+        return f_pos;
+    }
+    if (evicted >= (u64)f_pos) {
+        return 0;
+    }
+    return f_pos - evicted;
+}
+
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_ring *ring;
+    struct aesd_circular_buffer *c_buf;
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset_byte, chunk, done;
+    size_t copied = 0;
+    unsigned int commits;
+    uint8_t index;
+    ssize_t retval = 0;
+    int idx;
+    u64 start = ktime_get_ns();
+    
+    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+    
+    // Readers never take dev->lock: they work on the ring published under SRCU,
+    // whose entries stay allocated until they leave the read side section
+    idx = srcu_read_lock(&dev->srcu);
+    commits = READ_ONCE(dev->commits);
+    smp_rmb();
+    ring = srcu_dereference(dev->ring, &dev->srcu);
+    *f_pos = aesd_file_pos(file, ring, *f_pos);
+
+    // Tail readers sleep at the end of data until the next packet is committed
+    while (file->tail && *f_pos >= ring->size) {
+        if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+            retval = -EAGAIN;
+            goto out;
+        }
+        file->base = ring->base;
+        srcu_read_unlock(&dev->srcu, idx);
+
+        if (wait_event_interruptible(dev->readq, READ_ONCE(dev->commits) != commits)) {
+            return -ERESTARTSYS;
+        }
+
+        idx = srcu_read_lock(&dev->srcu);
+        commits = READ_ONCE(dev->commits);
+        smp_rmb();
+        ring = srcu_dereference(dev->ring, &dev->srcu);
+        *f_pos = aesd_file_pos(file, ring, *f_pos);
+    }
+    file->base = ring->base;
+    c_buf = &ring->circular_buffer;
+
+    if (*f_pos > ring->size) {
+        PDEBUG("f_pos > ring->size");
+        goto out;
+    }
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(c_buf, *f_pos, &entry_offset_byte);
+
+    if (entry == NULL || !entry->buffptr || entry->buffptr == 0) {
+        PDEBUG("could not find valid entry for f_pos: %lld", *f_pos);
+        goto out;
+    }
+
+    PDEBUG("found valid entry for f_pos: %lld", *f_pos);
+
+    // Keep copying from consecutive entries until the user buffer is full
+    // or we wrap around to in_offs, so one read() can drain the whole device
+    index = entry - c_buf->entry;
+    while (copied < count) {
+        chunk = min(count - copied, entry->size - entry_offset_byte);
+        done = copy_to_iter(entry->buffptr + entry_offset_byte, chunk, to);
+        copied += done;
+        if (done < chunk) {
+            if (!copied) {
+                retval = -EFAULT;
+                goto out;
+            }
+            break;
+        }
+        entry_offset_byte = 0;
+        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        if (index == c_buf->in_offs) {
+            break;
+        }
+        entry = &c_buf->entry[index];
+    }
+
+    PDEBUG("copied %zu bytes to user", copied);
+
+    *f_pos += copied;
+    retval = copied;
+
+  out:
+    srcu_read_unlock(&dev->srcu, idx);
+    // For tail readers this includes the time spent waiting for a commit
+    aesd_stats_add(&dev->stats, AESD_STAT_READS, 1);
+    aesd_stats_add(&dev->stats, AESD_STAT_BYTES_READ, copied);
+    aesd_stats_latency(&dev->stats, AESD_HIST_READ, ktime_get_ns() - start);
+    return retval;
+}
+
+/**
+ * Free the pending fragments of @dev, appending them to the mmap() history
+ * first when they were committed rather than discarded
+ */
+static void aesd_cmds_free(struct aesd_dev *dev, bool committed, u64 history_start)
+{
+    struct aesd_cmd_str *e, *n;
+
+    list_for_each_entry_safe(e, n, &dev->cmds, node) {
+        if (committed) {
+            aesd_history_append(dev, e->str, e->size, history_start);
+        }
+        kfree(e->str);
+        list_del(&e->node);
+        kmem_cache_free(aesd_cmd_cachep, e);
+    }
+    dev->cur_cmd_size = 0;
+}
+
+/**
+ * Tell readers a batch was committed.  Must be called with dev->lock held.
+ */
+static void aesd_commit_notify(struct aesd_dev *dev)
+{
+    // Order the ring publication before the commit count tail readers sample
+    smp_wmb();
+    WRITE_ONCE(dev->commits, dev->commits + 1);
+    wake_up_interruptible(&dev->readq);
+    kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+}
+
+/**
+ * Reserve room for the pending command of @dev followed by @count new bytes
+ * in the byte store, and return its logical offset in @pos_rtn.  When the
+ * reservation has to wrap to the start of the store, the pending bytes are
+ * moved there and the tail skips the unused end.  If readers may still see
+ * the space, the oldest entries are evicted as needed and their readers
+ * waited for.  Must be called with dev->lock held.
+ */
+static int aesd_store_reserve(struct aesd_dev *dev, size_t count, u64 *pos_rtn)
+{
+    struct aesd_store *store = &dev->store;
+    struct aesd_ring *ring, *old;
+    struct aesd_circular_buffer *c_buf;
+    size_t need = dev->cur_cmd_size + count;
+    u64 pos = store->tail, head, floor;
+    unsigned int nr_evict = 0;
+    uint8_t i;
+
+    if (need > store->capacity) {
+        PDEBUG("write of %zu bytes does not fit the %zu byte store", need, store->capacity);
+        return -ENOSPC;
+    }
+    if (pos % store->capacity + need > store->capacity) {
+        pos += store->capacity - pos % store->capacity;
+    }
+
+    // With nothing left for readers to see, the skipped end is free as well
+    floor = READ_ONCE(store->reclaimed);
+    if (pos + need > (floor == store->tail ? pos : floor) + store->capacity) {
+        old = rcu_dereference_protected(dev->ring, lockdep_is_held(&dev->lock));
+        c_buf = &old->circular_buffer;
+        head = aesd_store_head(dev, old);
+        // Find how many of the oldest entries overlap the reservation
+        for (i = c_buf->out_offs; nr_evict < aesd_circular_buffer_count(c_buf) &&
+                pos + need > head + store->capacity; i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+            nr_evict++;
+            head += c_buf->entry[i].size;
+            if (nr_evict < aesd_circular_buffer_count(c_buf) &&
+                    c_buf->entry[(i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].buffptr == store->data) {
+                head += (store->capacity - head % store->capacity) % store->capacity;
+            }
+        }
+        if (nr_evict) {
+            ring = kmem_cache_alloc(aesd_ring_cachep, GFP_KERNEL);
+            if (!ring) {
+                return -ENOMEM;
+            }
+            aesd_ring_publish(dev, ring, NULL, 0, 0, nr_evict);
+            aesd_history_set_start(dev, ring->base);
+            old = ring;
+        }
+        // Readers of the replaced rings are the only ones that can still see
+        // the space, so after this it is free whatever the callbacks did
+        synchronize_srcu(&dev->srcu);
+        WRITE_ONCE(store->reclaimed, aesd_store_head(dev, old));
+    }
+
+    if (pos != store->tail) {
+        memmove(store->data, store->data + store->tail % store->capacity, dev->cur_cmd_size);
+        store->tail = pos;
+    }
+    *pos_rtn = pos;
+    return 0;
+}
+
+/**
+ * aesd_write_iter() for a device in byte store mode.  The batch is copied
+ * from @from straight into the store behind the pending command and its
+ * records are committed where they lie, so the only allocation is the ring
+ * snapshot.  Unlike the allocating path, the copy from user space is done
+ * under dev->lock.
+ */
+static ssize_t aesd_store_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *filp = iocb->ki_filp;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_store *store = &dev->store;
+    struct aesd_ring *ring;
+    struct aesd_buffer_entry add_entries[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED] = {};
+    char *cmd, *record, *newline, *end;
+    unsigned int nr_records = 0, first_kept, i;
+    size_t dropped = 0, pending, longest = 0;
+    ssize_t retval;
+    u64 start = ktime_get_ns(), locked, pos;
+
+    ring = kmem_cache_alloc(aesd_ring_cachep, GFP_KERNEL);
+    if (!ring) {
+        return -ENOMEM;
+    }
+
+    if (mutex_lock_interruptible(&dev->lock)) {
+        retval = -ERESTARTSYS;
+        goto out_free;
+    }
+    locked = ktime_get_ns();
+    aesd_stats_add(&dev->stats, AESD_STAT_LOCK_WAIT_NS, locked - start);
+
+    retval = aesd_store_reserve(dev, count, &pos);
+    if (retval) {
+        goto out;
+    }
+    // Nothing past the tail is visible to readers until the ring is published
+    cmd = store->data + pos % store->capacity;
+    end = cmd + dev->cur_cmd_size + count;
+    if (copy_from_iter(cmd + dev->cur_cmd_size, count, from) != count) {
+        retval = -EFAULT;
+        goto out;
+    }
+    for (record = cmd + dev->cur_cmd_size; (newline = memchr(record, '\n', end - record)); record = newline + 1) {
+        // The first record completes the pending command
+        longest = max_t(size_t, longest, newline + 1 - (nr_records ? record : cmd));
+        nr_records++;
+    }
+
+    if (longest > READ_ONCE(aesd_max_retained)) {
+        PDEBUG("command of %zu bytes would exceed %lu retained bytes", longest, aesd_max_retained);
+        retval = -ENOSPC;
+        goto out;
+    }
+    // Only bytes left unterminated count against the budget
+    pending = nr_records ? end - record : dev->cur_cmd_size + count;
+    if (pending > READ_ONCE(aesd_max_pending)) {
+        PDEBUG("pending command would exceed %lu bytes", aesd_max_pending);
+        retval = -ENOSPC;
+        goto out;
+    }
+
+    record = cmd;
+    if (nr_records) {
+        first_kept = nr_records > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ?
+                nr_records - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : 0;
+        for (i = 0; i < nr_records; i++, record = newline + 1) {
+            newline = memchr(record, '\n', end - record);
+            if (i < first_kept) {
+                dropped += newline + 1 - record;
+                continue;
+            }
+            add_entries[i - first_kept].buffptr = record;
+            add_entries[i - first_kept].size = newline + 1 - record;
+        }
+        store->tail = pos + (record - cmd);
+
+        aesd_entries_stamp(dev, add_entries, min(nr_records, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED), locked);
+        aesd_ring_publish(dev, ring, add_entries, min(nr_records, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED),
+                dropped, 0);
+        aesd_stats_add(&dev->stats, AESD_STAT_EVICTIONS, first_kept);
+        aesd_history_append(dev, cmd, record - cmd, ring->base);
+        ring = NULL;
+        aesd_commit_notify(dev);
+        PDEBUG("written %u commands with %zu bytes", nr_records, (size_t)(record - cmd));
+    }
+    dev->cur_cmd_size = end - record;
+    if (dev->cur_cmd_size) {
+        aesd_stats_add(&dev->stats, AESD_STAT_PARTIAL_WRITES, 1);
+        PDEBUG("current command size: %zu", dev->cur_cmd_size);
+    }
+
+    *f_pos += count;
+    retval = count;
+    aesd_stats_add(&dev->stats, AESD_STAT_BYTES_WRITTEN, count);
+
+  out:
+    mutex_unlock(&dev->lock);
+    aesd_stats_add(&dev->stats, AESD_STAT_WRITES, 1);
+    aesd_stats_latency(&dev->stats, AESD_HIST_WRITE, ktime_get_ns() - start);
+  out_free:
+    if (ring) {
+        kmem_cache_free(aesd_ring_cachep, ring);
+    }
+    return retval;
+}
+
+/**
+ * Every newline terminated record in @from becomes one entry, the first one
+ * completing any command left pending by earlier writes, and bytes after the
+ * last newline are kept pending.  A writev() of many packets therefore costs
+ * one lock acquisition and one ring publication.
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *filp = iocb->ki_filp;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_ring *ring = NULL;
+    struct aesd_buffer_entry add_entries[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED] = {};
+    const char *duplicates[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED] = {};
+    struct aesd_cmd_str *cmd = NULL, *e;
+    char *data, *buffptr, *record, *newline, *end, *tail;
+    unsigned int nr_records = 0, first_kept, i;
+    size_t first_size = 0, dropped = 0, pending, longest = 0;
+    unsigned long max_pending = READ_ONCE(aesd_max_pending), max_retained = READ_ONCE(aesd_max_retained);
+    ssize_t retval = -ENOMEM;
+    u64 start = ktime_get_ns(), locked;
+
+    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
+
+    // Commands are bounded by the retained budget and what stays unterminated
+    // by the pending one, so nothing larger is worth copying in
+    if (count > max_pending && count - max_pending > max_retained) {
+        PDEBUG("write of %zu bytes would exceed the byte budgets", count);
+        return -ENOSPC;
+    }
+    if (dev->store.data) {
+        return aesd_store_write_iter(iocb, from);
+    }
+
+    // Stage the whole batch, and every entry that does not depend on the
+    // pending command, before taking the lock
+    data = kvmalloc(count, GFP_KERNEL);
+    if (!data) {
+        return -ENOMEM;
+    }
+    if (copy_from_iter(data, count, from) != count) {
+        kvfree(data);
+        return -EFAULT;
+    }
+    end = data + count;
+    for (record = data; (newline = memchr(record, '\n', end - record)); record = newline + 1) {
+        if (!nr_records) {
+            first_size = newline + 1 - data;
+        }
+        longest = max_t(size_t, longest, newline + 1 - record);
+        nr_records++;
+    }
+    tail = record;
+    if (longest > max_retained) {
+        PDEBUG("command of %zu bytes would exceed %lu retained bytes", longest, max_retained);
+        kvfree(data);
+        return -ENOSPC;
+    }
+
+    // Only the newest records of a large batch can survive in the ring
+    first_kept = nr_records > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ?
+            nr_records - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : 0;
+    for (i = 0, record = data; i < nr_records; i++, record = newline + 1) {
+        newline = memchr(record, '\n', end - record);
+        if (i == 0 || i < first_kept) {
+            if (i) {
+                dropped += newline + 1 - record;
+            }
+            continue;
+        }
+        buffptr = aesd_entry_alloc(dev, newline + 1 - record);
+        if (!buffptr) {
+            goto out_free;
+        }
+        memcpy(buffptr, record, newline + 1 - record);
+        add_entries[i - first_kept].buffptr = buffptr;
+        add_entries[i - first_kept].size = newline + 1 - record;
+    }
+    if (nr_records) {
+        ring = kmem_cache_alloc(aesd_ring_cachep, GFP_KERNEL);
+        if (!ring) {
+            goto out_free;
+        }
+    }
+    if (tail < end) {
+        cmd = kmem_cache_zalloc(aesd_cmd_cachep, GFP_KERNEL);
+        if (!cmd) {
+            goto out_free;
+        }
+        cmd->size = end - tail;
+        cmd->str = kmemdup(tail, cmd->size, GFP_KERNEL);
+        if (!cmd->str) {
+            goto out_free;
+        }
+    }
+
+    if (mutex_lock_interruptible(&dev->lock)) {
+        retval = -ERESTARTSYS;
+        goto out_free;
+    }
+    locked = ktime_get_ns();
+    aesd_stats_add(&dev->stats, AESD_STAT_LOCK_WAIT_NS, locked - start);
+
+    pending = dev->cur_cmd_size + (nr_records ? first_size : count);
+    if (nr_records && pending > max_retained) {
+        PDEBUG("command of %zu bytes would exceed %lu retained bytes", pending, max_retained);
+        retval = -ENOSPC;
+        goto out;
+    }
+    // Only bytes left unterminated count against the budget
+    if ((nr_records ? (size_t)(end - tail) : pending) > max_pending) {
+        PDEBUG("pending command would exceed %lu bytes", max_pending);
+        retval = -ENOSPC;
+        goto out;
+    }
+
+    if (nr_records) {
+        if (first_kept == 0) {
+            buffptr = aesd_entry_alloc(dev, pending);
+            if (!buffptr) {
+                goto out;
+            }
+            add_entries[0].buffptr = buffptr;
+            add_entries[0].size = pending;
+            list_for_each_entry(e, &dev->cmds, node) {
+                memcpy(buffptr, e->str, e->size);
+                buffptr += e->size;
+            }
+            memcpy(buffptr, data, first_size);
+        } else {
+            dropped += pending;
+        }
+
+        if (dev->dedup) {
+            aesd_entries_share(dev, add_entries, min(nr_records, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED),
+                    duplicates);
+        }
+        aesd_entries_stamp(dev, add_entries, min(nr_records, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED), locked);
+        aesd_ring_publish(dev, ring, add_entries, min(nr_records, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED),
+                dropped, 0);
+        aesd_stats_add(&dev->stats, AESD_STAT_EVICTIONS, first_kept);
+        aesd_cmds_free(dev, true, ring->base);
+        aesd_history_append(dev, data, tail - data, ring->base);
+        ring = NULL;
+        memset(add_entries, 0, sizeof(add_entries));
+        aesd_commit_notify(dev);
+        PDEBUG("written %u commands with %zu bytes", nr_records, (size_t)(tail - data) + pending - first_size);
+    }
+    if (cmd) {
+        list_add_tail(&cmd->node, &dev->cmds);
+        dev->cur_cmd_size += cmd->size;
+        cmd = NULL;
+        aesd_stats_add(&dev->stats, AESD_STAT_PARTIAL_WRITES, 1);
+        PDEBUG("current command size: %zu", dev->cur_cmd_size);
+    }
+
+    *f_pos += count;
+    retval = count;
+    aesd_stats_add(&dev->stats, AESD_STAT_BYTES_WRITTEN, count);
+
+  out:
+    mutex_unlock(&dev->lock);
+    aesd_stats_add(&dev->stats, AESD_STAT_WRITES, 1);
+    aesd_stats_latency(&dev->stats, AESD_HIST_WRITE, ktime_get_ns() - start);
+  out_free:
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        aesd_entry_free(dev, add_entries[i].buffptr);
+        aesd_entry_free(dev, duplicates[i]);
+    }
+    if (ring) {
+        kmem_cache_free(aesd_ring_cachep, ring);
+    }
+    if (cmd) {
+        kfree(cmd->str);
+        kmem_cache_free(aesd_cmd_cachep, cmd);
+    }
+    kvfree(data);
+    return retval;
+}
+
+
+/**
+ * Initialize the ring, locks and pending command list of @dev.  The mmap()
+ * history and statistics are set up by the caller.
+ */
+int aesd_dev_core_init(struct aesd_dev *dev)
+{
+    unsigned int i;
+    int result;
+
+    INIT_LIST_HEAD(&dev->cmds);
+    init_waitqueue_head(&dev->readq);
+    
+    mutex_init(&dev->lock);
+
+    result = init_srcu_struct(&dev->srcu);
+    if (result) {
+        return result;
+    }
+    if (aesd_store_bytes) {
+        dev->store.data = vmalloc(aesd_store_bytes);
+        if (!dev->store.data) {
+            cleanup_srcu_struct(&dev->srcu);
+            return -ENOMEM;
+        }
+        dev->store.capacity = aesd_store_bytes;
+    }
+    dev->dedup = aesd_dedup && !dev->store.data;
+    for (i = 0; i < (1 << AESD_DEDUP_BITS); i++) {
+        INIT_HLIST_HEAD(&dev->dedup_table[i]);
+    }
+    RCU_INIT_POINTER(dev->ring, kmem_cache_zalloc(aesd_ring_cachep, GFP_KERNEL));
+    if (!rcu_access_pointer(dev->ring)) {
+        vfree(dev->store.data);
+        cleanup_srcu_struct(&dev->srcu);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ * Free everything set up by aesd_dev_core_init(), once no file can reach @dev
+ */
+void aesd_dev_core_cleanup(struct aesd_dev *dev)
+{
+    uint8_t index;
+    struct aesd_buffer_entry *entry;
+    struct aesd_ring *ring;
+
+    // Let pending callbacks free the rings and entries already replaced
+    srcu_barrier(&dev->srcu);
+    ring = rcu_dereference_protected(dev->ring, true);
+    if (!dev->store.data) {
+        AESD_CIRCULAR_BUFFER_FOREACH(entry, &ring->circular_buffer, index) {
+            if (entry->buffptr) {
+                kfree(aesd_entry_put(dev, entry->buffptr));
+            }
+        }
+    }
+    kmem_cache_free(aesd_ring_cachep, ring);
+    cleanup_srcu_struct(&dev->srcu);
+    vfree(dev->store.data);
+    dev->store.data = NULL;
+
+    aesd_cmds_free(dev, false, 0);
+}
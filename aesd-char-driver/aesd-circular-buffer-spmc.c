@@ -0,0 +1,187 @@
+/**
+ * @file aesd-circular-buffer-spmc.c
+ * @brief Lock-free single producer, multiple consumer circular buffer
+ *
+ * Each slot is a small seqlock: the producer makes the slot's sequence
+ * number odd, stores the new entry and then publishes the even number naming
+ * it, while readers check the number before and after copying.  Only the
+ * entry descriptors are protected this way.  Readers copying the data an
+ * entry points to must call aesd_circular_buffer_spmc_validate() afterwards
+ * and discard the copy if it fails, and the producer may only reuse the
+ * memory of entries returned by aesd_circular_buffer_spmc_add_entry(), never
+ * free it while readers may still copy from it.
+ */
+
+#include "aesd-circular-buffer-spmc.h"
+
+#define AESD_SPMC_SEQ(index) (2 * (index) + 2)
+
+/**
+* Initializes @param buffer to an empty buffer.  Must not race with any other call.
+*/
+void aesd_circular_buffer_spmc_init(struct aesd_circular_buffer_spmc *buffer)
+{
+    uint8_t i;
+
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        atomic_init(&buffer->entry[i].seq, 0);
+        atomic_init(&buffer->entry[i].buffptr, NULL);
+        atomic_init(&buffer->entry[i].size, 0);
+        atomic_init(&buffer->entry[i].mono_ns, 0);
+        atomic_init(&buffer->entry[i].real_ns, 0);
+    }
+    atomic_init(&buffer->in_offs, 0);
+    atomic_init(&buffer->out_offs, 0);
+}
+
+static void aesd_spmc_load(struct aesd_circular_buffer_spmc_slot *slot, struct aesd_buffer_entry *entry)
+{
+    entry->buffptr = atomic_load_explicit(&slot->buffptr, memory_order_relaxed);
+    entry->size = atomic_load_explicit(&slot->size, memory_order_relaxed);
+    entry->mono_ns = atomic_load_explicit(&slot->mono_ns, memory_order_relaxed);
+    entry->real_ns = atomic_load_explicit(&slot->real_ns, memory_order_relaxed);
+}
+
+/**
+* Adds @param add_entry to @param buffer, overwriting the oldest entry if the buffer is full.
+* Must only be called from the single producer thread.
+* @return the overwritten entry, whose memory the producer may now reuse, or an entry with a
+* NULL buffptr if nothing was overwritten, including when a consumer removed the oldest
+* entry first.
+*/
+struct aesd_buffer_entry aesd_circular_buffer_spmc_add_entry(struct aesd_circular_buffer_spmc *buffer,
+            const struct aesd_buffer_entry *add_entry)
+{
+    uint64_t in = atomic_load_explicit(&buffer->in_offs, memory_order_relaxed);
+    uint64_t out = atomic_load_explicit(&buffer->out_offs, memory_order_relaxed);
+    struct aesd_circular_buffer_spmc_slot *slot = &buffer->entry[in % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry retval = {};
+
+    // Race consumers for the oldest entry: whoever moves out_offs past it owns it
+    while (in - out >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        if (atomic_compare_exchange_weak_explicit(&buffer->out_offs, &out, out + 1,
+                    memory_order_acq_rel, memory_order_relaxed)) {
+            aesd_spmc_load(slot, &retval);
+            break;
+        }
+    }
+
+    atomic_store_explicit(&slot->seq, 2 * in + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&slot->buffptr, add_entry->buffptr, memory_order_relaxed);
+    atomic_store_explicit(&slot->size, add_entry->size, memory_order_relaxed);
+    atomic_store_explicit(&slot->mono_ns, add_entry->mono_ns, memory_order_relaxed);
+    atomic_store_explicit(&slot->real_ns, add_entry->real_ns, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, AESD_SPMC_SEQ(in), memory_order_release);
+
+    atomic_store_explicit(&buffer->in_offs, in + 1, memory_order_release);
+    return retval;
+}
+
+/**
+* Copies entry number @param index of @param buffer to @param entry_rtn.
+* @return false if the entry was never added or has been overwritten
+*/
+bool aesd_circular_buffer_spmc_get_entry(struct aesd_circular_buffer_spmc *buffer, uint64_t index,
+            struct aesd_buffer_entry *entry_rtn)
+{
+    struct aesd_circular_buffer_spmc_slot *slot = &buffer->entry[index % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != AESD_SPMC_SEQ(index)) {
+        return false;
+    }
+    aesd_spmc_load(slot, entry_rtn);
+    return aesd_circular_buffer_spmc_validate(buffer, index);
+}
+
+/**
+* @return true if entry number @param index is still in @param buffer, so that anything read
+* through a copy of it since aesd_circular_buffer_spmc_get_entry() is intact
+*/
+bool aesd_circular_buffer_spmc_validate(struct aesd_circular_buffer_spmc *buffer, uint64_t index)
+{
+    struct aesd_circular_buffer_spmc_slot *slot = &buffer->entry[index % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->seq, memory_order_relaxed) == AESD_SPMC_SEQ(index);
+}
+
+/**
+* Removes the oldest entry from @param buffer and stores it in @param entry_rtn.  Safe to call
+* from any number of consumer threads; each entry is returned to exactly one of them, or to
+* the producer if it overwrites the entry first.
+* @return false if @param buffer was empty
+*/
+bool aesd_circular_buffer_spmc_remove_entry(struct aesd_circular_buffer_spmc *buffer,
+            struct aesd_buffer_entry *entry_rtn)
+{
+    uint64_t out = atomic_load_explicit(&buffer->out_offs, memory_order_acquire);
+
+    for (;;) {
+        if (out == atomic_load_explicit(&buffer->in_offs, memory_order_acquire)) {
+            return false;
+        }
+        if (!aesd_circular_buffer_spmc_get_entry(buffer, out, entry_rtn)) {
+            // Overwritten by the producer, which moved out_offs on first
+            out = atomic_load_explicit(&buffer->out_offs, memory_order_acquire);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&buffer->out_offs, &out, out + 1,
+                    memory_order_acq_rel, memory_order_acquire)) {
+            return true;
+        }
+    }
+}
+
+/**
+* @return the number of entries currently stored in @param buffer, which may change as soon as
+* it is returned
+*/
+uint8_t aesd_circular_buffer_spmc_count(struct aesd_circular_buffer_spmc *buffer)
+{
+    uint64_t out = atomic_load_explicit(&buffer->out_offs, memory_order_acquire);
+    uint64_t in = atomic_load_explicit(&buffer->in_offs, memory_order_acquire);
+
+    // out_offs may have been sampled a whole overwrite ago
+    if (in - out > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    return in - out;
+}
+
+/**
+* Lock-free counterpart of aesd_circular_buffer_find_entry_offset_for_fpos().
+* @param char_offset is counted from the oldest entry when the search starts, and the search
+*      starts over if an entry it walks over is overwritten meanwhile.
+* @param entry_rtn receives a copy of the entry holding @param char_offset, whose data may
+*      only be trusted after aesd_circular_buffer_spmc_validate() on @param index_rtn.
+* @param entry_offset_byte_rtn receives the offset of @param char_offset within that entry.
+* @param index_rtn receives the index of that entry, and may be NULL.
+* @return false if this position is not available in the buffer
+*/
+bool aesd_circular_buffer_spmc_find_entry_offset_for_fpos(struct aesd_circular_buffer_spmc *buffer,
+            size_t char_offset, struct aesd_buffer_entry *entry_rtn, size_t *entry_offset_byte_rtn,
+            uint64_t *index_rtn)
+{
+    uint64_t in, index;
+    size_t offset;
+
+  retry:
+    offset = char_offset;
+    index = atomic_load_explicit(&buffer->out_offs, memory_order_acquire);
+    in = atomic_load_explicit(&buffer->in_offs, memory_order_acquire);
+    for (; index < in; index++) {
+        if (!aesd_circular_buffer_spmc_get_entry(buffer, index, entry_rtn)) {
+            goto retry;
+        }
+        if (offset < entry_rtn->size) {
+            *entry_offset_byte_rtn = offset;
+            if (index_rtn) {
+                *index_rtn = index;
+            }
+            return true;
+        }
+        offset -= entry_rtn->size;
+    }
+    return false;
+}
@@ -0,0 +1,79 @@
+/*
+ * aesd-circular-buffer-spmc.h
+ *
+ *  Lock-free single producer, multiple consumer variant of
+ *  aesd_circular_buffer for user space, built on C11 atomics.
+ *
+ *  One thread adds entries, any number of threads look entries up, copy
+ *  their data or remove them, and nobody takes a lock.  in_offs and out_offs
+ *  count entries since init instead of wrapping, and each slot carries a
+ *  sequence number naming the entry it holds, so a reader can tell when the
+ *  entry it is reading was overwritten and retry.
+ */
+
+#ifndef AESD_CIRCULAR_BUFFER_SPMC_H
+#define AESD_CIRCULAR_BUFFER_SPMC_H
+
+#ifdef __KERNEL__
+#error "aesd-circular-buffer-spmc is user space only, the driver publishes rings under SRCU instead"
+#endif
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aesd-circular-buffer.h"
+
+/*
+ * Slots and offsets each get a cache line, so readers checking one slot do
+ * not contend with the producer filling the next
+ */
+struct aesd_circular_buffer_spmc_slot
+{
+    /**
+     * 2 * index + 2 once entry number index is stored here, odd while the
+     * producer is replacing it, 0 if the slot was never written
+     */
+    _Alignas(64) _Atomic uint64_t seq;
+    _Atomic(const char *) buffptr;
+    _Atomic size_t size;
+    _Atomic uint64_t mono_ns;
+    _Atomic uint64_t real_ns;
+};
+
+struct aesd_circular_buffer_spmc
+{
+    struct aesd_circular_buffer_spmc_slot entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    /**
+     * Index of the next entry to add, only written by the producer.  The
+     * entry with index i lives in entry[i % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].
+     */
+    _Alignas(64) _Atomic uint64_t in_offs;
+    /**
+     * Index of the oldest entry, advanced by the producer when it overwrites
+     * it and by consumers removing it
+     */
+    _Alignas(64) _Atomic uint64_t out_offs;
+};
+
+extern void aesd_circular_buffer_spmc_init(struct aesd_circular_buffer_spmc *buffer);
+
+extern struct aesd_buffer_entry aesd_circular_buffer_spmc_add_entry(struct aesd_circular_buffer_spmc *buffer,
+            const struct aesd_buffer_entry *add_entry);
+
+extern bool aesd_circular_buffer_spmc_remove_entry(struct aesd_circular_buffer_spmc *buffer,
+            struct aesd_buffer_entry *entry_rtn);
+
+extern uint8_t aesd_circular_buffer_spmc_count(struct aesd_circular_buffer_spmc *buffer);
+
+extern bool aesd_circular_buffer_spmc_get_entry(struct aesd_circular_buffer_spmc *buffer, uint64_t index,
+            struct aesd_buffer_entry *entry_rtn);
+
+extern bool aesd_circular_buffer_spmc_validate(struct aesd_circular_buffer_spmc *buffer, uint64_t index);
+
+extern bool aesd_circular_buffer_spmc_find_entry_offset_for_fpos(struct aesd_circular_buffer_spmc *buffer,
+            size_t char_offset, struct aesd_buffer_entry *entry_rtn, size_t *entry_offset_byte_rtn,
+            uint64_t *index_rtn);
+
+#endif /* AESD_CIRCULAR_BUFFER_SPMC_H */
@@ -86,22 +86,38 @@ struct aesd_buffer_entry aesd_circular_buffer_add_entry(struct aesd_circular_buf
     return retval;
 }
 
-// struct aesd_buffer_entry *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer) {
-//     struct aesd_buffer_entry *retval;
+/**
+* Removes the oldest entry from @param buffer and advances buffer->out_offs past it.
+* Any necessary locking must be handled by the caller
+* @return the removed entry, so the caller can release the memory it references, or an
+* entry with a NULL buffptr and zero size if @param buffer was empty.
+*/
+struct aesd_buffer_entry aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry retval = {};
 
-//     if (!buffer->full && buffer->in_offs == buffer->out_offs) {
-//         return NULL;
-//     }
+    if (!buffer->full && buffer->in_offs == buffer->out_offs) {
+        return retval;
+    }
 
-//     retval = &buffer->entry[buffer->out_offs];
-//     buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    retval = buffer->entry[buffer->out_offs];
+    memset(&buffer->entry[buffer->out_offs], 0, sizeof(struct aesd_buffer_entry));
+    buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->full = false;
 
-//     if (buffer->full) {
-//         buffer->full = false;
-//     }
+    return retval;
+}
 
-//     return retval;
-// }
+/**
+* @return the number of entries currently stored in @param buffer
+*/
+uint8_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full) {
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    return (buffer->in_offs - buffer->out_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
 
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
@@ -16,7 +16,16 @@
 #include <stdbool.h>
 #endif
 
+/*
+ * User space callers such as aesdsocket's memory backend may size the buffer
+ * themselves; in_offs and out_offs are uint8_t, hence the upper bound
+ */
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
+#if AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED < 1 || AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED > 255
+#error "AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED must be between 1 and 255"
+#endif
 
 struct aesd_buffer_entry
 {
@@ -28,6 +37,14 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * CLOCK_MONOTONIC time the entry was committed, in nanoseconds
+     */
+    uint64_t mono_ns;
+    /**
+     * CLOCK_REALTIME time the entry was committed, in nanoseconds
+     */
+    uint64_t real_ns;
 };
 
 struct aesd_circular_buffer
@@ -56,6 +73,10 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern struct aesd_buffer_entry aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern struct aesd_buffer_entry aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer);
+
+extern uint8_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
 /**
@@ -0,0 +1,122 @@
+/**
+ * @file aesd-stats.c
+ * @brief Per-CPU statistics and latency histograms for the aesd char driver
+ *
+ * Counters are only ever updated on the local CPU, so the hot read and write
+ * paths never share a cache line for accounting.  They are summed over all
+ * possible CPUs when read from debugfs, under <debugfs>/aesdchar/aesdcharN/.
+ */
+
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/fs.h>
+
+#include "aesd-stats.h"
+
+static const char * const aesd_stat_names[AESD_STAT_NR] = {
+    [AESD_STAT_WRITES] = "writes",
+    [AESD_STAT_READS] = "reads",
+    [AESD_STAT_BYTES_WRITTEN] = "bytes_written",
+    [AESD_STAT_BYTES_READ] = "bytes_read",
+    [AESD_STAT_EVICTIONS] = "evictions",
+    [AESD_STAT_PARTIAL_WRITES] = "partial_writes",
+    [AESD_STAT_LOCK_WAIT_NS] = "lock_wait_ns",
+    [AESD_STAT_DEDUP_HITS] = "dedup_hits",
+    [AESD_STAT_DEDUP_BYTES] = "dedup_bytes",
+};
+
+static const char * const aesd_hist_names[AESD_HIST_NR] = {
+    [AESD_HIST_WRITE] = "write",
+    [AESD_HIST_READ] = "read",
+};
+
+int aesd_stats_init(struct aesd_stats *stats)
+{
+    stats->cpu = alloc_percpu(struct aesd_stats_cpu);
+    stats->dir = NULL;
+    return stats->cpu ? 0 : -ENOMEM;
+}
+
+void aesd_stats_free(struct aesd_stats *stats)
+{
+    debugfs_remove_recursive(stats->dir);
+    free_percpu(stats->cpu);
+}
+
+static int aesd_stats_counters_show(struct seq_file *s, void *unused)
+{
+    struct aesd_stats *stats = s->private;
+    u64 sum;
+    int i, cpu;
+
+    for (i = 0; i < AESD_STAT_NR; i++) {
+        sum = 0;
+        for_each_possible_cpu(cpu) {
+            sum += per_cpu_ptr(stats->cpu, cpu)->counters[i];
+        }
+        seq_printf(s, "%s %llu\n", aesd_stat_names[i], sum);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats_counters);
+
+/**
+ * Print each histogram as "<name> <bucket_ns> <count>" lines, skipping empty
+ * buckets, where bucket_ns is the lower bound of the bucket
+ */
+static int aesd_stats_latency_show(struct seq_file *s, void *unused)
+{
+    struct aesd_stats *stats = s->private;
+    u64 sum;
+    int h, b, cpu;
+
+    for (h = 0; h < AESD_HIST_NR; h++) {
+        for (b = 0; b < AESD_HIST_BUCKETS; b++) {
+            sum = 0;
+            for_each_possible_cpu(cpu) {
+                sum += per_cpu_ptr(stats->cpu, cpu)->hist[h][b];
+            }
+            if (sum) {
+                seq_printf(s, "%s %llu %llu\n", aesd_hist_names[h], 1ULL << b, sum);
+            }
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats_latency);
+
+/**
+ * Any write to the reset file clears all counters and histograms.  Updates
+ * racing with the reset may survive it.
+ */
+static ssize_t aesd_stats_reset_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct aesd_stats *stats = filp->private_data;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu_ptr(stats->cpu, cpu), 0, sizeof(struct aesd_stats_cpu));
+    }
+    return count;
+}
+
+static const struct file_operations aesd_stats_reset_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = aesd_stats_reset_write,
+    .llseek = noop_llseek,
+};
+
+/**
+ * Create the debugfs directory @name under @parent for @stats.  Like the rest
+ * of debugfs this is best effort, failures only lose the files.
+ */
+void aesd_stats_debugfs_init(struct aesd_stats *stats, struct dentry *parent, const char *name)
+{
+    stats->dir = debugfs_create_dir(name, parent);
+    debugfs_create_file("stats", 0444, stats->dir, stats, &aesd_stats_counters_fops);
+    debugfs_create_file("latency", 0444, stats->dir, stats, &aesd_stats_latency_fops);
+    debugfs_create_file("reset", 0200, stats->dir, stats, &aesd_stats_reset_fops);
+}
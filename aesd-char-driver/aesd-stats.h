@@ -0,0 +1,92 @@
+/*
+ * aesd-stats.h
+ *
+ *  Per-CPU statistics and latency histograms for the aesd char driver,
+ *  exported through debugfs
+ */
+
+#ifndef AESD_CHAR_DRIVER_AESD_STATS_H_
+#define AESD_CHAR_DRIVER_AESD_STATS_H_
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/minmax.h>
+#endif
+
+struct dentry;
+
+enum aesd_stat_counter {
+    AESD_STAT_WRITES,
+    AESD_STAT_READS,
+    AESD_STAT_BYTES_WRITTEN,
+    AESD_STAT_BYTES_READ,
+    AESD_STAT_EVICTIONS,
+    AESD_STAT_PARTIAL_WRITES,
+    AESD_STAT_LOCK_WAIT_NS,
+    AESD_STAT_DEDUP_HITS,
+    AESD_STAT_DEDUP_BYTES,
+    AESD_STAT_NR,
+};
+
+enum aesd_stat_hist {
+    AESD_HIST_WRITE,
+    AESD_HIST_READ,
+    AESD_HIST_NR,
+};
+
+/**
+ * Bucket n of a latency histogram counts calls that took [2^n, 2^(n+1)) ns,
+ * the last bucket also counts everything slower
+ */
+#define AESD_HIST_BUCKETS 32
+
+#ifdef __KERNEL__
+struct aesd_stats_cpu {
+    u64 counters[AESD_STAT_NR];
+    u64 hist[AESD_HIST_NR][AESD_HIST_BUCKETS];
+};
+
+struct aesd_stats {
+    struct aesd_stats_cpu __percpu *cpu;
+    struct dentry *dir;
+};
+
+extern int aesd_stats_init(struct aesd_stats *stats);
+extern void aesd_stats_free(struct aesd_stats *stats);
+extern void aesd_stats_debugfs_init(struct aesd_stats *stats, struct dentry *parent, const char *name);
+
+/**
+ * Add @value to counter @counter on the local CPU, safe from any context
+ */
+static inline void aesd_stats_add(struct aesd_stats *stats, enum aesd_stat_counter counter, u64 value)
+{
+    this_cpu_add(stats->cpu->counters[counter], value);
+}
+
+/**
+ * Account one call of @ns nanoseconds in histogram @hist on the local CPU
+ */
+static inline void aesd_stats_latency(struct aesd_stats *stats, enum aesd_stat_hist hist, u64 ns)
+{
+    unsigned int bucket = min_t(unsigned int, ilog2(ns | 1), AESD_HIST_BUCKETS - 1);
+
+    this_cpu_inc(stats->cpu->hist[hist][bucket]);
+}
+#else
+/* The user space build of the driver core keeps no statistics */
+struct aesd_stats {
+    int unused;
+};
+
+static inline void aesd_stats_add(struct aesd_stats *stats, enum aesd_stat_counter counter, u64 value)
+{
+}
+
+static inline void aesd_stats_latency(struct aesd_stats *stats, enum aesd_stat_hist hist, u64 ns)
+{
+}
+#endif /* __KERNEL__ */
+
+#endif /* AESD_CHAR_DRIVER_AESD_STATS_H_ */
@@ -0,0 +1,189 @@
+/**
+ * @file aesd-user-shim.c
+ * @brief User space implementations of the kernel interfaces declared in aesd-user-shim.h
+ */
+
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-user-shim.h"
+
+int init_srcu_struct(struct srcu_struct *ssp)
+{
+    memset(ssp, 0, sizeof(*ssp));
+    return pthread_mutex_init(&ssp->gp_lock, NULL) ? -ENOMEM : 0;
+}
+
+void cleanup_srcu_struct(struct srcu_struct *ssp)
+{
+    pthread_mutex_destroy(&ssp->gp_lock);
+}
+
+int srcu_read_lock(struct srcu_struct *ssp)
+{
+    int idx = __atomic_load_n(&ssp->idx, __ATOMIC_RELAXED) & 1;
+
+    // Full barrier: the increment must be visible before any pointer the reader loads
+    __atomic_fetch_add(&ssp->readers[idx], 1, __ATOMIC_SEQ_CST);
+    return idx;
+}
+
+void srcu_read_unlock(struct srcu_struct *ssp, int idx)
+{
+    __atomic_fetch_sub(&ssp->readers[idx], 1, __ATOMIC_RELEASE);
+}
+
+static void srcu_flip_and_wait(struct srcu_struct *ssp)
+{
+    unsigned int old = __atomic_fetch_add(&ssp->idx, 1, __ATOMIC_SEQ_CST) & 1;
+
+    while (__atomic_load_n(&ssp->readers[old], __ATOMIC_ACQUIRE) != 0) {
+        sched_yield();
+    }
+}
+
+/**
+ * Wait for every reader that might have seen state from before the call.
+ * Two flips, as in the kernel, also cover a reader that sampled the index
+ * just before the first flip and incremented the old counter after it.
+ * Must be called with gp_lock held.
+ */
+static void srcu_wait_readers(struct srcu_struct *ssp)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    srcu_flip_and_wait(ssp);
+    srcu_flip_and_wait(ssp);
+}
+
+static void srcu_run_callbacks(struct rcu_head *head)
+{
+    struct rcu_head *next;
+
+    for (; head; head = next) {
+        next = head->next;
+        head->func(head);
+    }
+}
+
+void synchronize_srcu(struct srcu_struct *ssp)
+{
+    pthread_mutex_lock(&ssp->gp_lock);
+    srcu_wait_readers(ssp);
+    pthread_mutex_unlock(&ssp->gp_lock);
+}
+
+void srcu_barrier(struct srcu_struct *ssp)
+{
+    struct rcu_head *cbs;
+
+    pthread_mutex_lock(&ssp->gp_lock);
+    cbs = ssp->cbs;
+    ssp->cbs = NULL;
+    ssp->nr_cbs = 0;
+    srcu_wait_readers(ssp);
+    pthread_mutex_unlock(&ssp->gp_lock);
+    srcu_run_callbacks(cbs);
+}
+
+void call_srcu(struct srcu_struct *ssp, struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+    bool flush;
+
+    head->func = func;
+    pthread_mutex_lock(&ssp->gp_lock);
+    head->next = ssp->cbs;
+    ssp->cbs = head;
+    flush = ++ssp->nr_cbs >= AESD_SRCU_BATCH;
+    pthread_mutex_unlock(&ssp->gp_lock);
+
+    if (flush) {
+        srcu_barrier(ssp);
+    }
+}
+
+void iov_iter_init(struct iov_iter *i, unsigned int direction, const struct iovec *iov,
+        unsigned long nr_segs, size_t count)
+{
+    i->iov = iov;
+    i->nr_segs = nr_segs;
+    i->iov_offset = 0;
+    i->count = count;
+}
+
+/**
+ * Copy @bytes between @addr and the segments of @i, advancing it
+ */
+static size_t iov_iter_copy(char *addr, size_t bytes, struct iov_iter *i, bool to_iter)
+{
+    size_t copied = 0, chunk;
+
+    bytes = min(bytes, i->count);
+    while (copied < bytes) {
+        chunk = min(bytes - copied, i->iov->iov_len - i->iov_offset);
+        if (to_iter) {
+            memcpy((char *)i->iov->iov_base + i->iov_offset, addr + copied, chunk);
+        } else {
+            memcpy(addr + copied, (char *)i->iov->iov_base + i->iov_offset, chunk);
+        }
+        copied += chunk;
+        i->iov_offset += chunk;
+        i->count -= chunk;
+        if (i->iov_offset == i->iov->iov_len) {
+            i->iov++;
+            i->nr_segs--;
+            i->iov_offset = 0;
+        }
+    }
+    return copied;
+}
+
+size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i)
+{
+    return iov_iter_copy((char *)addr, bytes, i, true);
+}
+
+size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *i)
+{
+    return iov_iter_copy(addr, bytes, i, false);
+}
+
+loff_t fixed_size_llseek(struct file *file, loff_t offset, int whence, loff_t size)
+{
+    loff_t pos;
+
+    switch (whence) {
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = file->f_pos + offset;
+            break;
+        case SEEK_END:
+            pos = size + offset;
+            break;
+        default:
+            return -EINVAL;
+    }
+    if (pos < 0 || pos > size) {
+        return -EINVAL;
+    }
+    file->f_pos = pos;
+    return pos;
+}
+
+u64 ktime_get_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+u64 ktime_get_real_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,343 @@
+/*
+ * aesd-user-shim.h
+ *
+ *  Minimal user space stand-ins for the kernel interfaces used by
+ *  aesd-char-core.c, so the driver core can be benchmarked and fuzzed on an
+ *  ordinary Linux host.  Only what the core needs is provided, with the
+ *  same names and calling conventions as the kernel.
+ */
+
+#ifndef AESD_CHAR_DRIVER_AESD_USER_SHIM_H_
+#define AESD_CHAR_DRIVER_AESD_USER_SHIM_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define U64_MAX UINT64_MAX
+#define ERESTARTSYS 512
+
+#define __user
+#define __rcu
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) max((type)(a), (type)(b))
+#define BUILD_BUG_ON(cond) ((void)sizeof(char[1 - 2 * !!(cond)]))
+
+#define READ_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile __typeof__(x) *)&(x) = (v))
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+#define module_param(name, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+
+/*
+ * Memory allocation
+ */
+typedef unsigned int gfp_t;
+#define GFP_KERNEL 0u
+#define GFP_NOWAIT 1u
+#define __GFP_NOWARN 0u
+#define SLAB_HWCACHE_ALIGN 0ul
+
+#define kmalloc(size, gfp) malloc(size)
+#define kzalloc(size, gfp) calloc(1, size)
+#define kvmalloc(size, gfp) malloc(size)
+#define kfree(ptr) free((void *)(ptr))
+#define kvfree(ptr) free((void *)(ptr))
+#define vmalloc(size) malloc(size)
+#define vfree(ptr) free((void *)(ptr))
+
+static inline void *kmemdup(const void *src, size_t len, gfp_t gfp)
+{
+    void *p = malloc(len);
+
+    if (p) {
+        memcpy(p, src, len);
+    }
+    return p;
+}
+
+struct kmem_cache {
+    size_t size;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+        unsigned long flags, void (*ctor)(void *))
+{
+    struct kmem_cache *cache = malloc(sizeof(*cache));
+
+    if (cache) {
+        cache->size = size;
+    }
+    return cache;
+}
+#define KMEM_CACHE(s, flags) kmem_cache_create(#s, sizeof(struct s), 0, flags, NULL)
+#define kmem_cache_alloc(cache, gfp) malloc((cache)->size)
+#define kmem_cache_zalloc(cache, gfp) calloc(1, (cache)->size)
+#define kmem_cache_free(cache, ptr) free(ptr)
+#define kmem_cache_destroy(cache) free(cache)
+
+/*
+ * Locking and waiting
+ */
+struct mutex {
+    pthread_mutex_t m;
+};
+#define mutex_init(lock) pthread_mutex_init(&(lock)->m, NULL)
+#define mutex_lock(lock) pthread_mutex_lock(&(lock)->m)
+#define mutex_lock_interruptible(lock) pthread_mutex_lock(&(lock)->m)
+#define mutex_trylock(lock) (pthread_mutex_trylock(&(lock)->m) == 0)
+#define mutex_unlock(lock) pthread_mutex_unlock(&(lock)->m)
+#define lockdep_is_held(lock) 1
+
+typedef struct wait_queue_head {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} wait_queue_head_t;
+
+#define init_waitqueue_head(wq) \
+    do { pthread_mutex_init(&(wq)->lock, NULL); pthread_cond_init(&(wq)->cond, NULL); } while (0)
+#define wait_event_interruptible(wq, condition) ({ \
+    pthread_mutex_lock(&(wq).lock); \
+    while (!(condition)) \
+        pthread_cond_wait(&(wq).cond, &(wq).lock); \
+    pthread_mutex_unlock(&(wq).lock); \
+    0; })
+#define wake_up_interruptible(wq) \
+    do { pthread_mutex_lock(&(wq)->lock); pthread_cond_broadcast(&(wq)->cond); pthread_mutex_unlock(&(wq)->lock); } while (0)
+
+struct fasync_struct;
+#define kill_fasync(fa, sig, band) ((void)(fa))
+
+/*
+ * Sleepable RCU: readers bump one of two counters, grace periods flip
+ * between them and wait for the old one to drain.  Callbacks are batched so
+ * a writer only waits for readers once every AESD_SRCU_BATCH calls.
+ */
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+struct srcu_struct {
+    long readers[2];
+    unsigned int idx;
+    pthread_mutex_t gp_lock;
+    struct rcu_head *cbs;
+    unsigned int nr_cbs;
+};
+
+#define AESD_SRCU_BATCH 64
+
+extern int init_srcu_struct(struct srcu_struct *ssp);
+extern void cleanup_srcu_struct(struct srcu_struct *ssp);
+extern int srcu_read_lock(struct srcu_struct *ssp);
+extern void srcu_read_unlock(struct srcu_struct *ssp, int idx);
+extern void synchronize_srcu(struct srcu_struct *ssp);
+extern void call_srcu(struct srcu_struct *ssp, struct rcu_head *head, void (*func)(struct rcu_head *head));
+extern void srcu_barrier(struct srcu_struct *ssp);
+
+#define srcu_dereference(p, ssp) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_access_pointer(p) __atomic_load_n(&(p), __ATOMIC_RELAXED)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+
+/*
+ * Lists
+ */
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_for_each_entry(pos, head, member) \
+    for (pos = list_entry((head)->next, __typeof__(*pos), member); \
+            &pos->member != (head); \
+            pos = list_entry(pos->member.next, __typeof__(*pos), member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+    for (pos = list_entry((head)->next, __typeof__(*pos), member), \
+            n = list_entry(pos->member.next, __typeof__(*pos), member); \
+            &pos->member != (head); \
+            pos = n, n = list_entry(n->member.next, __typeof__(*n), member))
+
+struct hlist_node {
+    struct hlist_node *next, **pprev;
+};
+
+struct hlist_head {
+    struct hlist_node *first;
+};
+
+#define INIT_HLIST_HEAD(head) ((head)->first = NULL)
+
+static inline void hlist_add_head(struct hlist_node *entry, struct hlist_head *head)
+{
+    entry->next = head->first;
+    if (head->first) {
+        head->first->pprev = &entry->next;
+    }
+    head->first = entry;
+    entry->pprev = &head->first;
+}
+
+static inline void hlist_del(struct hlist_node *entry)
+{
+    *entry->pprev = entry->next;
+    if (entry->next) {
+        entry->next->pprev = entry->pprev;
+    }
+}
+
+#define hlist_entry_safe(ptr, type, member) ({ \
+    __typeof__(ptr) ____ptr = (ptr); \
+    ____ptr ? container_of(____ptr, type, member) : NULL; })
+#define hlist_for_each_entry(pos, head, member) \
+    for (pos = hlist_entry_safe((head)->first, __typeof__(*pos), member); \
+            pos; \
+            pos = hlist_entry_safe(pos->member.next, __typeof__(*pos), member))
+
+/*
+ * Hashing, the kernel's jhash() (Bob Jenkins' lookup2 successor)
+ */
+static inline u32 rol32(u32 word, unsigned int shift)
+{
+    return (word << (shift & 31)) | (word >> ((-shift) & 31));
+}
+
+#define __jhash_mix(a, b, c) do { \
+    a -= c; a ^= rol32(c, 4); c += b; \
+    b -= a; b ^= rol32(a, 6); a += c; \
+    c -= b; c ^= rol32(b, 8); b += a; \
+    a -= c; a ^= rol32(c, 16); c += b; \
+    b -= a; b ^= rol32(a, 19); a += c; \
+    c -= b; c ^= rol32(b, 4); b += a; \
+} while (0)
+
+#define __jhash_final(a, b, c) do { \
+    c ^= b; c -= rol32(b, 14); \
+    a ^= c; a -= rol32(c, 11); \
+    b ^= a; b -= rol32(a, 25); \
+    c ^= b; c -= rol32(b, 16); \
+    a ^= c; a -= rol32(c, 4); \
+    b ^= a; b -= rol32(a, 14); \
+    c ^= b; c -= rol32(b, 24); \
+} while (0)
+
+#define JHASH_INITVAL 0xdeadbeef
+
+static inline u32 jhash(const void *key, u32 length, u32 initval)
+{
+    const u8 *k = key;
+    u32 a, b, c, w[3];
+    u8 tail[12] = {};
+
+    a = b = c = JHASH_INITVAL + length + initval;
+    while (length > 12) {
+        memcpy(w, k, sizeof(w));
+        a += w[0];
+        b += w[1];
+        c += w[2];
+        __jhash_mix(a, b, c);
+        length -= 12;
+        k += 12;
+    }
+    if (length == 0) {
+        return c;
+    }
+    // The last 1 to 12 bytes, little endian and zero padded
+    memcpy(tail, k, length);
+    a += tail[0] | tail[1] << 8 | tail[2] << 16 | (u32)tail[3] << 24;
+    b += tail[4] | tail[5] << 8 | tail[6] << 16 | (u32)tail[7] << 24;
+    c += tail[8] | tail[9] << 8 | tail[10] << 16 | (u32)tail[11] << 24;
+    __jhash_final(a, b, c);
+    return c;
+}
+
+/*
+ * Files and user copies
+ */
+struct cdev {
+    int unused;
+};
+struct device;
+
+struct file {
+    void *private_data;
+    unsigned int f_flags;
+    loff_t f_pos;
+};
+
+#define IOCB_NOWAIT (1 << 7)
+
+struct kiocb {
+    struct file *ki_filp;
+    loff_t ki_pos;
+    int ki_flags;
+};
+
+struct iov_iter {
+    const struct iovec *iov;
+    unsigned long nr_segs;
+    size_t iov_offset;
+    size_t count;
+};
+
+#define ITER_SOURCE 1
+#define ITER_DEST 0
+
+extern void iov_iter_init(struct iov_iter *i, unsigned int direction, const struct iovec *iov,
+        unsigned long nr_segs, size_t count);
+#define iov_iter_count(i) ((i)->count)
+extern size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i);
+extern size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *i);
+extern loff_t fixed_size_llseek(struct file *file, loff_t offset, int whence, loff_t size);
+
+#define u64_to_user_ptr(x) ((void *)(uintptr_t)(x))
+#define copy_to_user(to, from, n) (memcpy(to, from, n), 0)
+#define copy_from_user(to, from, n) (memcpy(to, from, n), 0)
+
+extern u64 ktime_get_ns(void);
+extern u64 ktime_get_real_ns(void);
+
+#endif /* AESD_CHAR_DRIVER_AESD_USER_SHIM_H_ */
@@ -8,14 +8,26 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
+#ifdef __KERNEL__
 #include <asm-generic/access_ok.h>
 #include <linux/mutex.h>
 #include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/fs.h>
+#include <linux/srcu.h>
+#include <linux/cache.h>
+#include <linux/cdev.h>
 #include <linux/version.h>
+#else
+#include "aesd-user-shim.h"
+#endif
 #include "aesd-circular-buffer.h"
+#include "aesd-stats.h"
+#include "aesd_ioctl.h"
 
 #define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
+#ifdef __KERNEL__
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,0,0)
 #define access_ok_wrapper(type,arg,cmd) \
 	access_ok(type, arg, cmd)
@@ -24,14 +36,46 @@
 	access_ok(arg, cmd)
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,4,0)
+#define class_create_wrapper(name) \
+	class_create(THIS_MODULE, name)
+#else
+#define class_create_wrapper(name) \
+	class_create(name)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,5,0)
+#define splice_read_wrapper generic_file_splice_read
+#else
+#define splice_read_wrapper copy_splice_read
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+#define vm_flags_set_wrapper(vma,flags) \
+	((vma)->vm_flags |= (flags))
+#define vm_flags_clear_wrapper(vma,flags) \
+	((vma)->vm_flags &= ~(flags))
+#else
+#define vm_flags_set_wrapper(vma,flags) \
+	vm_flags_set(vma, flags)
+#define vm_flags_clear_wrapper(vma,flags) \
+	vm_flags_clear(vma, flags)
+#endif
+#endif /* __KERNEL__ */
+
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
 #  ifdef __KERNEL__
      /* This one if debugging is on, and kernel space */
-#    define PDEBUG(fmt, args...) printk( KERN_DEBUG "aesdchar: " fmt, ## args)
+     /* Dynamic debug, enable with echo 'module aesdchar +p' > <debugfs>/dynamic_debug/control */
+#    define PDEBUG(fmt, args...) pr_debug("aesdchar: " fmt "\n", ## args)
 #  else
-     /* This one for user space */
-#    define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
+     /* This one for user space, quiet unless built with AESD_USER_DEBUG like pr_debug() */
+#    ifdef AESD_USER_DEBUG
+#      define PDEBUG(fmt, args...) fprintf(stderr, "aesdchar: " fmt "\n", ## args)
+#    else
+#      define PDEBUG(fmt, args...) do { } while (0)
+#    endif
 #  endif
 #else
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
@@ -43,19 +87,184 @@ struct aesd_cmd_str {
      struct list_head node;
 };
 
+/**
+ * log2 of the buckets in a device's table of shared payloads.  The table only
+ * holds the retained entries, at most AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ */
+#define AESD_DEDUP_BITS 6
+
+/**
+ * Entry buffer in dedup mode, enabled with aesd_dedup.  Retained entries
+ * with identical contents point their buffptr at the data of one payload,
+ * found through the device's dedup table by the jhash of the contents.
+ * Payloads are immutable once committed, @refs counts the entries of the
+ * current ring using it and, like the table, is guarded by dev->lock.
+ */
+struct aesd_payload {
+    struct hlist_node node;
+    u32 hash;
+    unsigned int refs;
+    size_t size;
+    char data[];
+};
+
+/**
+ * Page backed copy of the most recent history, exported read only through mmap().
+ * The first page holds a struct aesd_mmap_header, the following data_pages pages
+ * are the data window.
+ */
+struct aesd_history {
+    struct aesd_mmap_header *header;
+    char *data;
+    unsigned long data_pages;
+    size_t capacity;
+};
+
+/**
+ * Optional contiguous storage for entry data, enabled with aesd_store_bytes.
+ * Commands are stored back to back at increasing logical offsets, the byte
+ * at logical offset L living at data[L % capacity], and a command is never
+ * split across the end of the buffer so each entry's buffptr stays
+ * contiguous.  The unterminated command is kept right after @tail.
+ */
+struct aesd_store {
+    char *data;
+    size_t capacity;
+    /**
+     * Logical offset one past the newest committed command
+     */
+    u64 tail;
+    /**
+     * Logical offset below which no reader can still see the data, advanced
+     * as replaced rings are freed
+     */
+    u64 reclaimed;
+};
+
+/**
+ * Snapshot of the retained entries. A ring is never modified once published
+ * through aesd_dev.ring: each commit publishes a modified copy and the old
+ * ring is freed after an SRCU grace period, so readers need no lock.
+ */
+struct aesd_ring {
+    struct aesd_circular_buffer circular_buffer;
+    /**
+     * Total bytes in circular_buffer
+     */
+    size_t size;
+    /**
+     * Logical offset of file position 0, i.e. bytes evicted since the device was created
+     */
+    u64 base;
+    /**
+     * Entry allocations evicted by the ring that replaced this one, freed
+     * with it: the buffers themselves, or in dedup mode the payloads no
+     * longer used by any entry.  A batch can evict every old entry and all
+     * but the newest of its own.
+     */
+    const char *evicted[2 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint8_t nr_evicted;
+    /**
+     * In byte store mode entries are not freed individually: freeing the
+     * ring instead releases the store up to @reclaim_to, the oldest entry of
+     * the ring that replaced it
+     */
+    struct aesd_store *store;
+    u64 reclaim_to;
+    struct rcu_head rcu;
+};
+
+struct aesd_dev;
+
+/**
+ * Per open file state, stored in filp->private_data
+ */
+struct aesd_file {
+    struct aesd_dev *dev;
+    /**
+     * ring->base when f_pos was last set, used by tail readers to follow their
+     * data across evictions
+     */
+    u64 base;
+    /**
+     * Set through AESDCHAR_IOCTAIL: reads at the end of data block (or fail
+     * with -EAGAIN under O_NONBLOCK) until the next packet is committed
+     */
+    bool tail;
+};
+
+/**
+ * One aesdchar minor. Devices are independent: each has its own ring, lock
+ * and accounting, and is cache line aligned so an array of them has no false
+ * sharing between devices.
+ */
 struct aesd_dev
 {
 
     /**
     * TODO: Add structure(s) and locks needed to complete assignment requirements
     */
-    struct aesd_circular_buffer circular_buffer;
-    size_t size;
+    /**
+     * Current ring, replaced under lock and read under srcu
+     */
+    struct aesd_ring __rcu *ring;
+    struct srcu_struct srcu;
+    wait_queue_head_t readq;
+    struct fasync_struct *async_queue;
+    struct aesd_history history;
+    struct cdev cdev;     /* Char device structure      */
+    struct device *device;
+    struct aesd_stats stats;
+
+    /*
+     * Writer side state, kept off the cache lines readers use
+     */
+    struct mutex lock ____cacheline_aligned_in_smp;
     struct list_head cmds;
     size_t cur_cmd_size;
-    struct mutex lock;
-    struct cdev cdev;     /* Char device structure      */
-};
+    /**
+     * Entry data in byte store mode, unused (data NULL) when each entry is
+     * allocated separately
+     */
+    struct aesd_store store;
+    /**
+     * Payloads of the current ring's entries by hash, used when identical
+     * entries share one buffer (dedup set)
+     */
+    bool dedup;
+    struct hlist_head dedup_table[1 << AESD_DEDUP_BITS];
+    /**
+     * Number of packets committed, bumped before waking readq
+     */
+    unsigned int commits;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Driver core in aesd-char-core.c, shared with the user space build
+ */
+extern unsigned long aesd_max_retained;
+extern unsigned long aesd_max_pending;
+extern unsigned long aesd_store_bytes;
+extern bool aesd_dedup;
+extern struct kmem_cache *aesd_ring_cachep;
+extern struct kmem_cache *aesd_cmd_cachep;
 
+extern int aesd_core_init(void);
+extern void aesd_core_exit(void);
+extern int aesd_dev_core_init(struct aesd_dev *dev);
+extern void aesd_dev_core_cleanup(struct aesd_dev *dev);
+extern void aesd_history_append(struct aesd_dev *dev, const char *buf, size_t size, u64 history_start);
+extern void aesd_history_set_start(struct aesd_dev *dev, u64 history_start);
+extern void aesd_ring_publish(struct aesd_dev *dev, struct aesd_ring *ring,
+        const struct aesd_buffer_entry *add_entries, unsigned int nr_add,
+        size_t dropped, unsigned int nr_evict);
+extern long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, unsigned int write_cmd_offset);
+extern long aesd_set_tail(struct file *filp, bool tail);
+extern long aesd_snapshot(struct file *filp, struct aesd_snapshot *snap);
+extern long aesd_seek_time(struct file *filp, struct aesd_seektime *seek);
+extern loff_t aesd_llseek(struct file *filp, loff_t offset, int whence);
+extern loff_t aesd_file_pos(struct aesd_file *file, struct aesd_ring *ring, loff_t f_pos);
+extern ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to);
+extern ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from);
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -0,0 +1,185 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief Throughput of aesd_circular_buffer behind a mutex against the lock-free SPMC variant
+ *
+ * One producer adds -n entries, reusing the buffer of each overwritten
+ * entry, while -r readers repeatedly look up a position and copy the data
+ * of the entry holding it, the way aesdsocket serves its history.  The same
+ * workload runs first on the original buffer wrapped in a pthread mutex and
+ * then on aesd_circular_buffer_spmc.
+ *
+ * Usage: aesd-circular-buffer-bench [-r readers] [-n entries] [-p payload_size]
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd-circular-buffer-spmc.h"
+
+#define MAX_PAYLOAD 4096
+
+struct bench_state {
+    bool spmc;
+    struct aesd_circular_buffer buffer;
+    pthread_mutex_t lock;
+    struct aesd_circular_buffer_spmc spmc_buffer;
+    size_t payload_size;
+    atomic_bool done;
+};
+
+struct reader_args {
+    struct bench_state *state;
+    unsigned long long lookups;
+    unsigned long long retries;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *reader_thread(void *arg)
+{
+    struct reader_args *args = arg;
+    struct bench_state *state = args->state;
+    struct aesd_buffer_entry entry, *found;
+    char copy[MAX_PAYLOAD];
+    size_t offset, pos;
+    unsigned int seed = (uintptr_t)args;
+    uint64_t index;
+
+    while (!atomic_load_explicit(&state->done, memory_order_relaxed)) {
+        pos = rand_r(&seed) % (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * state->payload_size);
+        if (state->spmc) {
+            if (!aesd_circular_buffer_spmc_find_entry_offset_for_fpos(&state->spmc_buffer, pos, &entry,
+                        &offset, &index)) {
+                continue;
+            }
+            memcpy(copy, entry.buffptr + offset, entry.size - offset);
+            if (!aesd_circular_buffer_spmc_validate(&state->spmc_buffer, index)) {
+                args->retries++;
+                continue;
+            }
+        } else {
+            pthread_mutex_lock(&state->lock);
+            found = aesd_circular_buffer_find_entry_offset_for_fpos(&state->buffer, pos, &offset);
+            if (found) {
+                memcpy(copy, found->buffptr + offset, found->size - offset);
+            }
+            pthread_mutex_unlock(&state->lock);
+            if (!found) {
+                continue;
+            }
+        }
+        args->lookups++;
+    }
+    return NULL;
+}
+
+/**
+ * Run the workload on one buffer flavour and print its throughput
+ */
+static int run(bool spmc, unsigned int readers, unsigned long entries, size_t payload_size)
+{
+    static char payloads[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1][MAX_PAYLOAD];
+    static struct bench_state state;
+    struct reader_args args[readers ? readers : 1];
+    pthread_t tids[readers ? readers : 1];
+    struct aesd_buffer_entry entry = { .size = payload_size }, evicted;
+    char *spare = payloads[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    unsigned long long lookups = 0, retries = 0;
+    double start, elapsed;
+    unsigned long i;
+    unsigned int n;
+
+    state.spmc = spmc;
+    state.payload_size = payload_size;
+    aesd_circular_buffer_init(&state.buffer);
+    pthread_mutex_init(&state.lock, NULL);
+    aesd_circular_buffer_spmc_init(&state.spmc_buffer);
+    atomic_init(&state.done, false);
+
+    start = now_sec();
+    for (n = 0; n < readers; n++) {
+        args[n] = (struct reader_args){ .state = &state };
+        if (pthread_create(&tids[n], NULL, reader_thread, &args[n]) != 0) {
+            fprintf(stderr, "Error creating reader thread\n");
+            return -1;
+        }
+    }
+    for (i = 0; i < entries; i++) {
+        entry.buffptr = i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ? payloads[i] : spare;
+        memset((char *)entry.buffptr, 'a' + i % 26, payload_size);
+        if (spmc) {
+            evicted = aesd_circular_buffer_spmc_add_entry(&state.spmc_buffer, &entry);
+        } else {
+            pthread_mutex_lock(&state.lock);
+            evicted = aesd_circular_buffer_add_entry(&state.buffer, &entry);
+            pthread_mutex_unlock(&state.lock);
+        }
+        if (evicted.buffptr) {
+            spare = (char *)evicted.buffptr;
+        }
+    }
+    elapsed = now_sec() - start;
+    atomic_store(&state.done, true);
+    for (n = 0; n < readers; n++) {
+        pthread_join(tids[n], NULL);
+        lookups += args[n].lookups;
+        retries += args[n].retries;
+    }
+    pthread_mutex_destroy(&state.lock);
+
+    printf("%-6s add: %.0f entries/s, lookup: %.0f/s", spmc ? "spmc" : "mutex", entries / elapsed, lookups / elapsed);
+    if (spmc) {
+        printf(", %llu copies retried", retries);
+    }
+    printf("\n");
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int readers = 4;
+    unsigned long entries = 5000000;
+    size_t payload_size = 64;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:n:p:")) != -1) {
+        switch (opt) {
+            case 'r':
+                readers = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                entries = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                payload_size = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-r readers] [-n entries] [-p payload_size]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (payload_size < 1 || payload_size > MAX_PAYLOAD) {
+        fprintf(stderr, "payload size must be between 1 and %d\n", MAX_PAYLOAD);
+        return 1;
+    }
+
+    printf("1 producer, %u readers, %zu byte payloads\n", readers, payload_size);
+    if (run(false, readers, entries, payload_size) != 0 || run(true, readers, entries, payload_size) != 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,273 @@
+/**
+ * @file aesd-core-bench.c
+ * @brief Multi-threaded throughput benchmark of the aesdchar core, run in user space
+ *
+ * Links the driver core from aesd-char-core.c against the user space shim,
+ * so the write and read paths can be profiled with ordinary tools and no
+ * kernel.  Writer threads commit packets, in writev() style batches with -b,
+ * while reader threads repeatedly drain the whole history from offset 0.
+ * -s uses a byte store of that size instead of one allocation per entry, -d
+ * shares one allocation between identical entries, and -c makes readers
+ * check every complete packet they read is intact and in commit order.
+ * Packets are all identical unless checked.
+ *
+ * Usage: aesd-core-bench [-w writers] [-r readers] [-p packet_size] [-n packets] [-b batch]
+ *        [-s store_bytes] [-d] [-c]
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-core-harness.h"
+
+#define HISTORY_CAPACITY (64 * 1024)
+// Packet header with -c: writer letter and 8 hex digit sequence number
+#define CHECK_HEADER 9
+#define CHECK_MAX_WRITERS 26
+
+struct bench_args {
+    struct aesd_dev *dev;
+    size_t packet_size;
+    unsigned int packets;
+    unsigned int batch;
+    unsigned int id;
+    bool check;
+    unsigned long long ops;
+    unsigned long long bytes;
+    int rc;
+};
+
+static volatile int writers_done;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fill @packet as writer @id's packet number @seq: the writer letter, the
+ * sequence number in hex, the letter repeated and a newline
+ */
+static void fill_packet(char *packet, size_t packet_size, unsigned int id, unsigned int seq)
+{
+    char header[CHECK_HEADER + 1];
+
+    snprintf(header, sizeof(header), "%c%08x", 'a' + id, seq);
+    memcpy(packet, header, CHECK_HEADER);
+    memset(packet + CHECK_HEADER, 'a' + id, packet_size - CHECK_HEADER - 1);
+}
+
+/**
+ * Check that every packet lying wholly inside @buf is intact, and that the
+ * packets of each writer appear in increasing order, as they must within a
+ * single read() of one ring.  Space reused too early shows up as a newer
+ * packet ahead of older ones, or a torn one.
+ */
+static int check_packets(const char *buf, size_t len, size_t packet_size)
+{
+    const char *end = buf + len, *packet, *newline;
+    long long last[CHECK_MAX_WRITERS];
+    unsigned int id, seq;
+    size_t i;
+
+    memset(last, -1, sizeof(last));
+    packet = memchr(buf, '\n', len);
+    for (; packet && (newline = memchr(packet + 1, '\n', end - packet - 1)); packet = newline) {
+        if ((size_t)(newline - packet) != packet_size || packet[1] < 'a' || packet[1] >= 'a' + CHECK_MAX_WRITERS ||
+                sscanf(packet + 2, "%8x", &seq) != 1) {
+            return -1;
+        }
+        id = packet[1] - 'a';
+        for (i = CHECK_HEADER + 1; i < packet_size; i++) {
+            if (packet[i] != packet[1]) {
+                return -1;
+            }
+        }
+        if ((long long)seq <= last[id]) {
+            return -1;
+        }
+        last[id] = seq;
+    }
+    return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct bench_args *args = arg;
+    char *packets = malloc(args->packet_size * args->batch);
+    struct iovec iov[args->batch];
+    struct aesd_file file;
+    struct file filp;
+    unsigned int i, j, n;
+
+    args->rc = -1;
+    if (packets == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    for (i = 0; i < args->batch; i++) {
+        iov[i].iov_base = packets + i * args->packet_size;
+        iov[i].iov_len = args->packet_size;
+        ((char *)iov[i].iov_base)[args->packet_size - 1] = '\n';
+    }
+
+    aesd_harness_open(args->dev, &filp, &file, O_WRONLY);
+    for (i = 0; i < args->packets; i += n) {
+        n = args->packets - i < args->batch ? args->packets - i : args->batch;
+        for (j = 0; args->check && j < n; j++) {
+            fill_packet(iov[j].iov_base, args->packet_size, args->id, i + j);
+        }
+        if (aesd_harness_writev(&filp, iov, n) != (ssize_t)(n * args->packet_size)) {
+            fprintf(stderr, "write failed\n");
+            goto out;
+        }
+        args->ops += n;
+        args->bytes += n * args->packet_size;
+    }
+    args->rc = 0;
+
+  out:
+    free(packets);
+    return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+    struct bench_args *args = arg;
+    struct aesd_file file;
+    struct file filp;
+    char buf[65536];
+    ssize_t rc;
+
+    aesd_harness_open(args->dev, &filp, &file, O_RDONLY);
+    while (!__atomic_load_n(&writers_done, __ATOMIC_RELAXED)) {
+        filp.f_pos = 0;
+        while ((rc = aesd_harness_read(&filp, buf, sizeof(buf))) > 0) {
+            args->bytes += rc;
+            if (args->check && check_packets(buf, rc, args->packet_size) != 0) {
+                fprintf(stderr, "read a corrupted packet\n");
+                args->rc = -1;
+                return NULL;
+            }
+        }
+        if (rc < 0) {
+            fprintf(stderr, "read failed: %zd\n", rc);
+            args->rc = -1;
+            return NULL;
+        }
+        args->ops++;
+    }
+    args->rc = 0;
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int writers = 1, readers = 1, packets = 1000000, batch = 1, i;
+    unsigned long long packets_written = 0, read_bytes = 0, drains = 0;
+    size_t packet_size = 32;
+    bool check = false;
+    struct aesd_dev *dev;
+    double start, elapsed;
+    int opt, rc = 0;
+
+    while ((opt = getopt(argc, argv, "w:r:p:n:b:s:dc")) != -1) {
+        switch (opt) {
+            case 'w':
+                writers = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                readers = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                packet_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                packets = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                batch = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                aesd_store_bytes = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                aesd_dedup = true;
+                break;
+            case 'c':
+                check = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-w writers] [-r readers] [-p packet_size] [-n packets] [-b batch] "
+                        "[-s store_bytes] [-d] [-c]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (writers < 1 || packet_size < 1 || batch < 1 || batch > 1024) {
+        fprintf(stderr, "writers, packet size and batch must be at least 1, batch at most 1024\n");
+        return 1;
+    }
+    if (check && (writers > CHECK_MAX_WRITERS || packet_size <= CHECK_HEADER)) {
+        fprintf(stderr, "-c needs at most %d writers and packets over %d bytes\n", CHECK_MAX_WRITERS, CHECK_HEADER);
+        return 1;
+    }
+
+    if (aesd_core_init() != 0 || (dev = aesd_harness_dev_create(HISTORY_CAPACITY)) == NULL) {
+        fprintf(stderr, "Error creating device\n");
+        return 1;
+    }
+
+    struct bench_args wargs[writers], rargs[readers ? readers : 1];
+    pthread_t wtids[writers], rtids[readers ? readers : 1];
+
+    start = now_sec();
+    for (i = 0; i < readers; i++) {
+        rargs[i] = (struct bench_args){ .dev = dev, .packet_size = packet_size, .check = check };
+        if (pthread_create(&rtids[i], NULL, reader_thread, &rargs[i]) != 0) {
+            fprintf(stderr, "Error creating reader thread\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < writers; i++) {
+        wargs[i] = (struct bench_args){ .dev = dev, .packet_size = packet_size, .packets = packets, .batch = batch,
+            .id = i, .check = check };
+        if (pthread_create(&wtids[i], NULL, writer_thread, &wargs[i]) != 0) {
+            fprintf(stderr, "Error creating writer thread\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < writers; i++) {
+        pthread_join(wtids[i], NULL);
+        packets_written += wargs[i].ops;
+        rc |= wargs[i].rc;
+    }
+    elapsed = now_sec() - start;
+    __atomic_store_n(&writers_done, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < readers; i++) {
+        pthread_join(rtids[i], NULL);
+        read_bytes += rargs[i].bytes;
+        drains += rargs[i].ops;
+        rc |= rargs[i].rc;
+    }
+
+    printf("%u writers, %u readers, %zu byte packets in batches of %u, %s\n", writers, readers, packet_size, batch,
+            aesd_store_bytes ? "byte store" : aesd_dedup ? "shared entries" : "allocated entries");
+    printf("write: %.0f packets/s, %.2f MB/s\n", packets_written / elapsed,
+            packets_written * packet_size / elapsed / (1024 * 1024));
+    if (readers) {
+        printf("read: %.0f drains/s, %.2f MB/s\n", drains / elapsed, read_bytes / elapsed / (1024 * 1024));
+    }
+
+    aesd_harness_dev_destroy(dev);
+    aesd_core_exit();
+    return rc == 0 ? 0 : 1;
+}
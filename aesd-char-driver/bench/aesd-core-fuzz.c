@@ -0,0 +1,419 @@
+/**
+ * @file aesd-core-fuzz.c
+ * @brief Fuzz harness for the aesdchar core, checked against a reference model
+ *
+ * Each input is decoded into a sequence of write, writev, read, lseek,
+ * AESDCHAR_IOCSEEKTO, AESDCHAR_IOCSNAPSHOT and AESDCHAR_IOCSEEKTIME
+ * operations on a fresh device.
+ * Every result is compared with a simple model of the documented behaviour:
+ * newline terminated commands, at most AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ * retained, oldest evicted beyond the byte budget, ENOSPC for a command
+ * larger than that budget or when the bytes left unterminated would exceed
+ * the pending budget.  Budgets are kept small so inputs reach eviction
+ * quickly, and now and then a terminated write exceeds both.  The first
+ * byte picks allocated entries, allocated entries sharing identical
+ * contents or a byte store, sized so only the budgets, never the store
+ * space, cause evictions.
+ *
+ * Built with -DAESD_LIBFUZZER this is a libFuzzer target.  Otherwise main()
+ * replays the files given on the command line, or runs -i pseudo random
+ * inputs from seed -s.
+ *
+ * Usage: aesd-core-fuzz [-i iterations] [-s seed] [file...]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aesd-core-harness.h"
+
+#define FUZZ_MAX_RETAINED 256
+#define FUZZ_MAX_PENDING 128
+#define FUZZ_HISTORY_CAPACITY 512
+#define FUZZ_STORE_BYTES 2048
+#define MODEL_MAX AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+#define check(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            abort(); \
+        } \
+    } while (0)
+
+struct model {
+    char *entries[MODEL_MAX];
+    size_t sizes[MODEL_MAX];
+    unsigned int count;
+    size_t total;
+    u64 base;
+    char pending[FUZZ_MAX_PENDING];
+    size_t pending_len;
+};
+
+struct input {
+    const uint8_t *data;
+    size_t size;
+};
+
+static uint8_t next_byte(struct input *in)
+{
+    uint8_t b = 0;
+
+    if (in->size) {
+        b = *in->data++;
+        in->size--;
+    }
+    return b;
+}
+
+static void model_evict(struct model *m)
+{
+    m->base += m->sizes[0];
+    m->total -= m->sizes[0];
+    free(m->entries[0]);
+    memmove(m->entries, m->entries + 1, (m->count - 1) * sizeof(m->entries[0]));
+    memmove(m->sizes, m->sizes + 1, (m->count - 1) * sizeof(m->sizes[0]));
+    m->count--;
+}
+
+static void model_add(struct model *m, const char *prefix, size_t prefix_len, const char *buf, size_t len)
+{
+    char *entry = malloc(prefix_len + len);
+
+    check(entry != NULL);
+    memcpy(entry, prefix, prefix_len);
+    memcpy(entry + prefix_len, buf, len);
+    if (m->count == MODEL_MAX) {
+        model_evict(m);
+    }
+    m->entries[m->count] = entry;
+    m->sizes[m->count] = prefix_len + len;
+    m->count++;
+    m->total += prefix_len + len;
+}
+
+/**
+ * Apply a write of @len bytes to the model, returning what write() should
+ */
+static ssize_t model_write(struct model *m, const char *buf, size_t len)
+{
+    const char *end = buf + len, *record = buf, *newline;
+    size_t left, prefix = m->pending_len;
+
+    if (len > FUZZ_MAX_PENDING + FUZZ_MAX_RETAINED) {
+        return -ENOSPC;
+    }
+    // No command may outgrow the retained budget
+    for (; (newline = memchr(record, '\n', end - record)) != NULL; record = newline + 1, prefix = 0) {
+        if (prefix + (newline + 1 - record) > FUZZ_MAX_RETAINED) {
+            return -ENOSPC;
+        }
+    }
+    record = buf;
+    // Only what stays unterminated counts against the pending budget
+    newline = memrchr(buf, '\n', len);
+    left = newline ? (size_t)(end - newline - 1) : m->pending_len + len;
+    if (left > FUZZ_MAX_PENDING) {
+        return -ENOSPC;
+    }
+
+    while ((newline = memchr(record, '\n', end - record)) != NULL) {
+        model_add(m, m->pending, m->pending_len, record, newline + 1 - record);
+        m->pending_len = 0;
+        record = newline + 1;
+    }
+    memcpy(m->pending + m->pending_len, record, end - record);
+    m->pending_len += end - record;
+
+    while (m->count > 1 && m->total > FUZZ_MAX_RETAINED) {
+        model_evict(m);
+    }
+    return len;
+}
+
+static void model_content(const struct model *m, char *buf)
+{
+    unsigned int i;
+
+    for (i = 0; i < m->count; i++) {
+        memcpy(buf, m->entries[i], m->sizes[i]);
+        buf += m->sizes[i];
+    }
+}
+
+static void model_free(struct model *m)
+{
+    while (m->count) {
+        model_evict(m);
+    }
+}
+
+static void fill_payload(struct input *in, char *buf, size_t len)
+{
+    unsigned int spacing = 2 + next_byte(in) % 96;
+    size_t i;
+    uint8_t b;
+
+    // Map bytes onto a small alphabet, with a newline on average every
+    // spacing bytes so both short packets and the byte budgets are reached
+    for (i = 0; i < len; i++) {
+        b = next_byte(in);
+        buf[i] = b % spacing == 0 ? '\n' : 'a' + b % 26;
+    }
+}
+
+/**
+ * Commit time on @clock of entry @n of the ring, oldest first.  The model
+ * cannot predict commit times, so they are taken from the device and only
+ * the search over them is checked.
+ */
+static u64 ring_stamp(struct aesd_dev *dev, unsigned int n, uint32_t clock)
+{
+    struct aesd_circular_buffer *c_buf = &dev->ring->circular_buffer;
+    struct aesd_buffer_entry *entry = &c_buf->entry[(c_buf->out_offs + n) % MODEL_MAX];
+
+    return clock == AESD_SEEKTIME_REALTIME ? entry->real_ns : entry->mono_ns;
+}
+
+static void check_history(struct aesd_dev *dev, const struct model *m)
+{
+    struct aesd_mmap_header *header = dev->history.header;
+
+    check(header->tail == m->base + m->total);
+    check(header->history_start == m->base);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    struct input in = { data, size };
+    struct model m = { .count = 0 };
+    struct aesd_dev *dev;
+    struct aesd_file file;
+    struct file filp;
+    struct aesd_snapshot snap;
+    struct aesd_seektime seek;
+    struct iovec iov[4];
+    char buf[FUZZ_MAX_PENDING + FUZZ_MAX_RETAINED + 64], content[FUZZ_MAX_RETAINED + FUZZ_MAX_PENDING * 2];
+    char snap_data[sizeof(content)];
+    loff_t pos = 0, expected_pos, offset;
+    ssize_t rc, expected;
+    size_t len, split[4];
+    unsigned int i, nr, cmd, mode;
+    bool oversized;
+    int whence;
+
+    aesd_max_retained = FUZZ_MAX_RETAINED;
+    aesd_max_pending = FUZZ_MAX_PENDING;
+    mode = next_byte(&in) % 3;
+    aesd_store_bytes = mode == 1 ? FUZZ_STORE_BYTES : 0;
+    aesd_dedup = mode == 2;
+    dev = aesd_harness_dev_create(FUZZ_HISTORY_CAPACITY);
+    check(dev != NULL);
+    aesd_harness_open(dev, &filp, &file, O_RDWR);
+
+    while (in.size) {
+        switch (next_byte(&in) % 8) {
+            case 0:
+                len = next_byte(&in) % (FUZZ_MAX_PENDING + 32);
+                // Now and then a terminated write too large for both budgets
+                oversized = next_byte(&in) % 16 == 0;
+                if (oversized) {
+                    len = FUZZ_MAX_PENDING + FUZZ_MAX_RETAINED + 1 + len % 64;
+                }
+                fill_payload(&in, buf, len);
+                if (oversized) {
+                    buf[len - 1] = '\n';
+                }
+                expected = model_write(&m, buf, len);
+                rc = aesd_harness_write(&filp, buf, len);
+                check(rc == expected);
+                check(!oversized || rc == -ENOSPC);
+                if (rc > 0) {
+                    pos += rc;
+                }
+                check(filp.f_pos == pos);
+                break;
+            case 1:
+                nr = 1 + next_byte(&in) % 4;
+                len = 0;
+                for (i = 0; i < nr; i++) {
+                    split[i] = next_byte(&in) % 40;
+                    iov[i].iov_base = buf + len;
+                    iov[i].iov_len = split[i];
+                    len += split[i];
+                }
+                fill_payload(&in, buf, len);
+                expected = model_write(&m, buf, len);
+                rc = aesd_harness_writev(&filp, iov, nr);
+                check(rc == expected);
+                if (rc > 0) {
+                    pos += rc;
+                }
+                break;
+            case 2:
+                len = next_byte(&in);
+                model_content(&m, content);
+                expected = pos < (loff_t)m.total ? (ssize_t)min(len, m.total - pos) : 0;
+                rc = aesd_harness_read(&filp, buf, len);
+                check(rc == expected);
+                check(memcmp(buf, content + pos, rc) == 0);
+                pos += rc;
+                check(filp.f_pos == pos);
+                break;
+            case 3:
+                whence = next_byte(&in) % 3;
+                offset = (int8_t)next_byte(&in) * 4;
+                expected_pos = (whence == SEEK_SET ? 0 : whence == SEEK_CUR ? pos : (loff_t)m.total) + offset;
+                rc = aesd_llseek(&filp, offset, whence);
+                if (expected_pos < 0 || expected_pos > (loff_t)m.total) {
+                    check(rc == -EINVAL);
+                } else {
+                    check(rc == expected_pos);
+                    pos = expected_pos;
+                }
+                check(filp.f_pos == pos);
+                break;
+            case 4:
+                cmd = next_byte(&in) % (MODEL_MAX + 2);
+                offset = next_byte(&in);
+                rc = aesd_adjust_file_offset(&filp, cmd, offset);
+                if (cmd >= m.count || (size_t)offset >= m.sizes[cmd]) {
+                    check(rc == -EINVAL);
+                } else {
+                    check(rc == 0);
+                    for (pos = offset, i = 0; i < cmd; i++) {
+                        pos += m.sizes[i];
+                    }
+                    check(filp.f_pos == pos);
+                }
+                break;
+            case 5:
+                memset(&snap, 0, sizeof(snap));
+                snap.data = (uintptr_t)snap_data;
+                snap.data_len = next_byte(&in) % 2 ? sizeof(snap_data) : next_byte(&in);
+                check(aesd_snapshot(&filp, &snap) == 0);
+                check(snap.entry_count == m.count);
+                check(snap.size == m.total);
+                check(snap.base == m.base);
+                for (offset = 0, i = 0; i < m.count; i++) {
+                    check(snap.entries[i].offset == (u64)offset);
+                    check(snap.entries[i].size == m.sizes[i]);
+                    offset += m.sizes[i];
+                }
+                if (m.total <= snap.data_len) {
+                    model_content(&m, content);
+                    check(memcmp(snap_data, content, m.total) == 0);
+                }
+                break;
+            case 6:
+                check_history(dev, &m);
+                break;
+            case 7:
+                memset(&seek, 0, sizeof(seek));
+                seek.clock = next_byte(&in) % 3;
+                cmd = next_byte(&in) % (MODEL_MAX + 1);
+                if (cmd < m.count) {
+                    // Aim at, just before or just after an existing stamp
+                    seek.time_ns = ring_stamp(dev, cmd, seek.clock) + (int)(next_byte(&in) % 3) - 1;
+                } else {
+                    seek.time_ns = next_byte(&in) % 2 ? 0 : U64_MAX;
+                }
+                rc = aesd_seek_time(&filp, &seek);
+                if (seek.clock > AESD_SEEKTIME_REALTIME) {
+                    check(rc == -EINVAL);
+                    break;
+                }
+                check(rc == 0);
+                for (pos = 0, i = 0; i < m.count && ring_stamp(dev, i, seek.clock) < seek.time_ns; i++) {
+                    pos += m.sizes[i];
+                }
+                check(seek.write_cmd == i);
+                check(seek.offset == (u64)pos);
+                check(seek.found_ns == (i < m.count ? ring_stamp(dev, i, seek.clock) : 0));
+                check(filp.f_pos == pos);
+                for (i = 1; i < m.count; i++) {
+                    check(ring_stamp(dev, i - 1, seek.clock) <= ring_stamp(dev, i, seek.clock));
+                }
+                break;
+        }
+    }
+    check_history(dev, &m);
+
+    aesd_harness_dev_destroy(dev);
+    model_free(&m);
+    return 0;
+}
+
+#ifndef AESD_LIBFUZZER
+static int run_file(const char *path)
+{
+    static uint8_t data[1 << 16];
+    FILE *f = fopen(path, "rb");
+    size_t size;
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    return LLVMFuzzerTestOneInput(data, size);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = 10000, i;
+    unsigned int seed = 1;
+    uint8_t data[4096];
+    size_t size, j;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:s:")) != -1) {
+        switch (opt) {
+            case 'i':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-i iterations] [-s seed] [file...]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (aesd_core_init() != 0) {
+        fprintf(stderr, "Error initializing the aesdchar core\n");
+        return 1;
+    }
+
+    if (optind < argc) {
+        for (; optind < argc; optind++) {
+            if (run_file(argv[optind]) != 0) {
+                return 1;
+            }
+        }
+    } else {
+        srand(seed);
+        for (i = 0; i < iterations; i++) {
+            size = rand() % sizeof(data);
+            for (j = 0; j < size; j++) {
+                data[j] = rand();
+            }
+            LLVMFuzzerTestOneInput(data, size);
+        }
+        printf("%lu inputs from seed %u passed\n", iterations, seed);
+    }
+
+    aesd_core_exit();
+    return 0;
+}
+#else
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    return aesd_core_init();
+}
+#endif
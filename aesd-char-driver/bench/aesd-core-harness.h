@@ -0,0 +1,92 @@
+/**
+ * @file aesd-core-harness.h
+ * @brief Helpers to drive the user space build of the aesdchar core like a file
+ *
+ * Stands in for the VFS and main.c: sets up a struct aesd_dev with a heap
+ * backed history window, and wraps aesd_read_iter()/aesd_write_iter() so
+ * callers can use plain buffers and iovecs against a struct file.
+ */
+
+#ifndef AESD_CORE_HARNESS_H
+#define AESD_CORE_HARNESS_H
+
+#include "aesdchar.h"
+
+static inline struct aesd_dev *aesd_harness_dev_create(size_t history_capacity)
+{
+    size_t size = (sizeof(struct aesd_dev) + 63) & ~(size_t)63;
+    struct aesd_dev *dev = aligned_alloc(64, size);
+
+    if (dev == NULL) {
+        return NULL;
+    }
+    memset(dev, 0, size);
+    dev->history.header = calloc(1, sizeof(struct aesd_mmap_header));
+    dev->history.data = malloc(history_capacity);
+    dev->history.capacity = history_capacity;
+    if (dev->history.header == NULL || dev->history.data == NULL || aesd_dev_core_init(dev) != 0) {
+        free(dev->history.header);
+        free(dev->history.data);
+        free(dev);
+        return NULL;
+    }
+    dev->history.header->capacity = history_capacity;
+    dev->history.header->magic = AESD_MMAP_MAGIC;
+    return dev;
+}
+
+static inline void aesd_harness_dev_destroy(struct aesd_dev *dev)
+{
+    aesd_dev_core_cleanup(dev);
+    free(dev->history.header);
+    free(dev->history.data);
+    free(dev);
+}
+
+static inline void aesd_harness_open(struct aesd_dev *dev, struct file *filp, struct aesd_file *file, unsigned int flags)
+{
+    memset(file, 0, sizeof(*file));
+    memset(filp, 0, sizeof(*filp));
+    file->dev = dev;
+    filp->private_data = file;
+    filp->f_flags = flags;
+}
+
+static inline ssize_t aesd_harness_writev(struct file *filp, const struct iovec *iov, unsigned long nr_segs)
+{
+    struct kiocb iocb = { .ki_filp = filp, .ki_pos = filp->f_pos };
+    struct iov_iter iter;
+    size_t count = 0;
+    unsigned long i;
+    ssize_t rc;
+
+    for (i = 0; i < nr_segs; i++) {
+        count += iov[i].iov_len;
+    }
+    iov_iter_init(&iter, ITER_SOURCE, iov, nr_segs, count);
+    rc = aesd_write_iter(&iocb, &iter);
+    filp->f_pos = iocb.ki_pos;
+    return rc;
+}
+
+static inline ssize_t aesd_harness_write(struct file *filp, const void *buf, size_t len)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+    return aesd_harness_writev(filp, &iov, 1);
+}
+
+static inline ssize_t aesd_harness_read(struct file *filp, void *buf, size_t len)
+{
+    struct kiocb iocb = { .ki_filp = filp, .ki_pos = filp->f_pos };
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct iov_iter iter;
+    ssize_t rc;
+
+    iov_iter_init(&iter, ITER_DEST, &iov, 1, len);
+    rc = aesd_read_iter(&iocb, &iter);
+    filp->f_pos = iocb.ki_pos;
+    return rc;
+}
+
+#endif /* AESD_CORE_HARNESS_H */
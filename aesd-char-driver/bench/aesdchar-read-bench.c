@@ -0,0 +1,206 @@
+/**
+ * @file aesdchar-read-bench.c
+ * @brief Measure the read() syscalls and throughput needed to drain /dev/aesdchar
+ *
+ * Fills the device with short packets and then repeatedly reads the whole
+ * history from offset 0 with a range of user buffer sizes, reporting the
+ * number of read() calls per pass and the resulting throughput.  Run it
+ * against the old and new module to compare per-entry and multi-entry reads.
+ * With -t, that many threads each drain the device through their own file
+ * descriptor at the same time, to show how readers scale across CPUs.
+ *
+ * Usage: aesdchar-read-bench [-p packet_size] [-c packet_count] [-n passes] [-t threads] [device]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_DEVICE "/dev/aesdchar"
+
+static const size_t buffer_sizes[] = { 16, 64, 256, 2048, 65536 };
+
+struct reader_args {
+    const char *device;
+    size_t buffer_size;
+    unsigned int passes;
+    unsigned long long reads;
+    unsigned long long bytes;
+    int rc;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int fill_device(int fd, size_t packet_size, unsigned int packet_count)
+{
+    char *packet = malloc(packet_size);
+    unsigned int i;
+
+    if (packet == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    memset(packet, 'a', packet_size - 1);
+    packet[packet_size - 1] = '\n';
+
+    for (i = 0; i < packet_count; i++) {
+        if (write(fd, packet, packet_size) != (ssize_t)packet_size) {
+            perror("write");
+            free(packet);
+            return -1;
+        }
+    }
+    free(packet);
+    return 0;
+}
+
+static void *reader_thread(void *arg)
+{
+    struct reader_args *args = arg;
+    char *buf = malloc(args->buffer_size);
+    unsigned int pass;
+    ssize_t rc;
+    int fd;
+
+    args->rc = -1;
+    if (buf == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    fd = open(args->device, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        free(buf);
+        return NULL;
+    }
+
+    for (pass = 0; pass < args->passes; pass++) {
+        if (lseek(fd, 0, SEEK_SET) == -1) {
+            perror("lseek");
+            goto out;
+        }
+        do {
+            rc = read(fd, buf, args->buffer_size);
+            if (rc == -1) {
+                perror("read");
+                goto out;
+            }
+            args->reads++;
+            args->bytes += rc;
+        } while (rc > 0);
+    }
+    args->rc = 0;
+
+  out:
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static int bench_buffer_size(const char *device, size_t buffer_size, unsigned int passes, unsigned int threads)
+{
+    struct reader_args args[threads];
+    pthread_t tids[threads];
+    unsigned long long reads = 0, bytes = 0;
+    unsigned int i;
+    double start, elapsed;
+    int rc = 0;
+
+    start = now_sec();
+    for (i = 0; i < threads; i++) {
+        args[i] = (struct reader_args){ device, buffer_size, passes, 0, 0, -1 };
+        if (pthread_create(&tids[i], NULL, reader_thread, &args[i]) != 0) {
+            fprintf(stderr, "Error creating reader thread\n");
+            threads = i;
+            rc = -1;
+            break;
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        reads += args[i].reads;
+        bytes += args[i].bytes;
+        rc |= args[i].rc;
+    }
+    elapsed = now_sec() - start;
+    if (rc != 0 || threads == 0) {
+        return -1;
+    }
+
+    printf("%8zu %14.1f %14.1f %12.1f %12.2f\n", buffer_size,
+            (double)reads / passes / threads, (double)bytes / passes / threads,
+            elapsed * 1e9 / passes, bytes / elapsed / (1024 * 1024));
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = DEFAULT_DEVICE;
+    size_t packet_size = 32;
+    unsigned int packet_count = 10, passes = 100000, threads = 1;
+    unsigned int i;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "p:c:n:t:")) != -1) {
+        switch (opt) {
+            case 'p':
+                packet_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                packet_count = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                passes = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                threads = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p packet_size] [-c packet_count] [-n passes] [-t threads] [device]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        device = argv[optind];
+    }
+    if (packet_size < 1 || passes < 1 || threads < 1) {
+        fprintf(stderr, "packet size, passes and threads must be at least 1\n");
+        return 1;
+    }
+
+    fd = open(device, O_RDWR);
+    if (fd == -1) {
+        fprintf(stderr, "open %s: %s\n", device, strerror(errno));
+        return 1;
+    }
+    if (fill_device(fd, packet_size, packet_count) != 0) {
+        close(fd);
+        return 1;
+    }
+
+    printf("%u packets of %zu bytes, %u passes per buffer size, %u reader threads\n",
+            packet_count, packet_size, passes, threads);
+    printf("%8s %14s %14s %12s %12s\n", "bufsize", "reads/pass", "bytes/pass", "ns/pass", "MB/s");
+    for (i = 0; i < sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); i++) {
+        if (bench_buffer_size(device, buffer_sizes[i], passes, threads) != 0) {
+            close(fd);
+            return 1;
+        }
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,204 @@
+/**
+ * @file aesdchar-splice-bench.c
+ * @brief Compare read()/send() against sendfile() for moving /dev/aesdchar history to a socket
+ *
+ * Fills the device, then repeatedly sends the whole history to a TCP
+ * loopback connection, once with the 2 KB read()/send() loop aesdsocket
+ * used and once with sendfile(), which needs .splice_read in the driver.
+ * A helper thread drains the other end of the connection.
+ *
+ * Usage: aesdchar-splice-bench [-p packet_size] [-c packet_count] [-n passes] [device]
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_DEVICE "/dev/aesdchar"
+#define BUFFER_SIZE 2048
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *drain_thread(void *arg)
+{
+    int listenfd = *(int *)arg, connfd;
+    char buf[65536];
+
+    connfd = accept(listenfd, NULL, NULL);
+    if (connfd == -1) {
+        perror("accept");
+        return NULL;
+    }
+    while (recv(connfd, buf, sizeof(buf), 0) > 0) {
+    }
+    close(connfd);
+    return NULL;
+}
+
+static int connect_loopback(int *listenfd)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    int fd;
+
+    *listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (*listenfd == -1 || bind(*listenfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(*listenfd, 1) == -1 || getsockname(*listenfd, (struct sockaddr *)&addr, &len) == -1) {
+        perror("listen");
+        return -1;
+    }
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    return fd;
+}
+
+static ssize_t send_read_loop(int devfd, int sockfd)
+{
+    char buf[BUFFER_SIZE];
+    ssize_t total = 0, rc;
+
+    while ((rc = read(devfd, buf, sizeof(buf))) > 0) {
+        if (send(sockfd, buf, rc, 0) != rc) {
+            return -1;
+        }
+        total += rc;
+    }
+    return rc == 0 ? total : -1;
+}
+
+static ssize_t send_sendfile(int devfd, int sockfd)
+{
+    ssize_t total = 0, rc;
+
+    while ((rc = sendfile(sockfd, devfd, NULL, 1 << 20)) > 0) {
+        total += rc;
+    }
+    return rc == 0 ? total : -1;
+}
+
+static int bench_mode(const char *name, ssize_t (*send_history)(int, int), int devfd, int sockfd, unsigned int passes)
+{
+    unsigned long long bytes = 0;
+    unsigned int pass;
+    double start, elapsed;
+    ssize_t rc;
+
+    start = now_sec();
+    for (pass = 0; pass < passes; pass++) {
+        if (lseek(devfd, 0, SEEK_SET) == -1) {
+            perror("lseek");
+            return -1;
+        }
+        rc = send_history(devfd, sockfd);
+        if (rc == -1) {
+            fprintf(stderr, "%s: %s\n", name, strerror(errno));
+            return -1;
+        }
+        bytes += rc;
+    }
+    elapsed = now_sec() - start;
+
+    printf("%-12s %14.1f %12.1f %12.2f\n", name, (double)bytes / passes,
+            elapsed * 1e9 / passes, bytes / elapsed / (1024 * 1024));
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = DEFAULT_DEVICE;
+    size_t packet_size = 4096;
+    unsigned int packet_count = 10, passes = 10000, i;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    pthread_t drainer;
+    int opt, devfd, listenfd, sockfd, rc;
+    char *packet;
+
+    while ((opt = getopt(argc, argv, "p:c:n:")) != -1) {
+        switch (opt) {
+            case 'p':
+                packet_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                packet_count = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                passes = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p packet_size] [-c packet_count] [-n passes] [device]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        device = argv[optind];
+    }
+    if (packet_size < 1 || passes < 1) {
+        fprintf(stderr, "packet size and passes must be at least 1\n");
+        return 1;
+    }
+
+    devfd = open(device, O_RDWR);
+    if (devfd == -1) {
+        fprintf(stderr, "open %s: %s\n", device, strerror(errno));
+        return 1;
+    }
+    packet = malloc(packet_size);
+    if (packet == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    memset(packet, 'a', packet_size - 1);
+    packet[packet_size - 1] = '\n';
+    for (i = 0; i < packet_count; i++) {
+        if (write(devfd, packet, packet_size) != (ssize_t)packet_size) {
+            perror("write");
+            return 1;
+        }
+    }
+    free(packet);
+
+    sockfd = connect_loopback(&listenfd);
+    if (sockfd == -1 || pthread_create(&drainer, NULL, drain_thread, &listenfd) != 0) {
+        return 1;
+    }
+    getsockname(listenfd, (struct sockaddr *)&addr, &len);
+    if (connect(sockfd, (struct sockaddr *)&addr, len) == -1) {
+        perror("connect");
+        return 1;
+    }
+
+    printf("%u packets of %zu bytes, %u passes per mode\n", packet_count, packet_size, passes);
+    printf("%-12s %14s %12s %12s\n", "mode", "bytes/pass", "ns/pass", "MB/s");
+    rc = bench_mode("read+send", send_read_loop, devfd, sockfd, passes);
+    if (rc == 0) {
+        rc = bench_mode("sendfile", send_sendfile, devfd, sockfd, passes);
+    }
+
+    shutdown(sockfd, SHUT_WR);
+    pthread_join(drainer, NULL);
+    close(sockfd);
+    close(listenfd);
+    close(devfd);
+    return rc == 0 ? 0 : 1;
+}
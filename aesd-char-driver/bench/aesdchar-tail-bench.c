@@ -0,0 +1,177 @@
+/**
+ * @file aesdchar-tail-bench.c
+ * @brief Measure commit to wakeup latency of a tail reader on /dev/aesdchar
+ *
+ * A writer thread commits packets holding their CLOCK_MONOTONIC send time
+ * while the main thread tails the device, either with blocking reads
+ * (AESDCHAR_IOCTAIL) or with epoll on an O_NONBLOCK descriptor, and reports
+ * the latency distribution between commit and wakeup.
+ *
+ * Usage: aesdchar-tail-bench [-e] [-n packets] [-i interval_us] [device]
+ */
+
+#define _GNU_SOURCE
+
+#include "aesd_ioctl.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_DEVICE "/dev/aesdchar"
+
+struct writer_args {
+    const char *device;
+    unsigned int packets;
+    unsigned int interval_us;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct writer_args *args = arg;
+    char packet[32];
+    unsigned int i;
+    int fd, len;
+
+    fd = open(args->device, O_WRONLY);
+    if (fd == -1) {
+        perror("open writer");
+        return NULL;
+    }
+    for (i = 0; i < args->packets; i++) {
+        usleep(args->interval_us);
+        len = snprintf(packet, sizeof(packet), "%llu\n", now_ns());
+        if (write(fd, packet, len) != len) {
+            perror("write");
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static int compare_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    struct writer_args args = { DEFAULT_DEVICE, 10000, 1000 };
+    unsigned long long *latency, sum = 0;
+    unsigned int received = 0;
+    bool use_epoll = false;
+    char buf[4096], *line, *next;
+    uint32_t enable = 1;
+    struct epoll_event ev;
+    pthread_t writer;
+    int opt, fd, epfd = -1;
+    ssize_t rc;
+
+    while ((opt = getopt(argc, argv, "en:i:")) != -1) {
+        switch (opt) {
+            case 'e':
+                use_epoll = true;
+                break;
+            case 'n':
+                args.packets = strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                args.interval_us = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-e] [-n packets] [-i interval_us] [device]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        args.device = argv[optind];
+    }
+
+    latency = calloc(args.packets ? args.packets : 1, sizeof(*latency));
+    if (latency == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    fd = open(args.device, O_RDONLY | (use_epoll ? O_NONBLOCK : 0));
+    if (fd == -1) {
+        fprintf(stderr, "open %s: %s\n", args.device, strerror(errno));
+        return 1;
+    }
+    if (ioctl(fd, AESDCHAR_IOCTAIL, &enable) == -1) {
+        perror("ioctl AESDCHAR_IOCTAIL");
+        return 1;
+    }
+    lseek(fd, 0, SEEK_END);
+
+    if (use_epoll) {
+        epfd = epoll_create1(0);
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll");
+            return 1;
+        }
+    }
+
+    if (pthread_create(&writer, NULL, writer_thread, &args) != 0) {
+        fprintf(stderr, "Error creating writer thread\n");
+        return 1;
+    }
+
+    while (received < args.packets) {
+        if (use_epoll && epoll_wait(epfd, &ev, 1, -1) == -1) {
+            perror("epoll_wait");
+            break;
+        }
+        rc = read(fd, buf, sizeof(buf) - 1);
+        if (rc == -1 && errno == EAGAIN) {
+            continue;
+        } else if (rc <= 0) {
+            perror("read");
+            break;
+        }
+        unsigned long long woke = now_ns();
+        buf[rc] = '\0';
+        for (line = buf; (next = strchr(line, '\n')) != NULL && received < args.packets; line = next + 1) {
+            latency[received++] = woke - strtoull(line, NULL, 10);
+        }
+    }
+    pthread_join(writer, NULL);
+
+    if (received == 0) {
+        fprintf(stderr, "No packets received\n");
+        return 1;
+    }
+    qsort(latency, received, sizeof(*latency), compare_ull);
+    for (unsigned int i = 0; i < received; i++) {
+        sum += latency[i];
+    }
+    printf("%s: %u packets, latency ns min %llu avg %llu p50 %llu p99 %llu max %llu\n",
+            use_epoll ? "epoll" : "blocking read", received, latency[0], sum / received,
+            latency[received / 2], latency[received * 99 / 100], latency[received - 1]);
+
+    free(latency);
+    if (epfd != -1) {
+        close(epfd);
+    }
+    close(fd);
+    return 0;
+}
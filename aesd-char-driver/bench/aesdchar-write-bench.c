@@ -0,0 +1,156 @@
+/**
+ * @file aesdchar-write-bench.c
+ * @brief Measure aggregate packet write throughput to one or more aesdchar devices
+ *
+ * Starts a number of writer threads, each committing small packets with
+ * write().  Threads are sharded round robin over -d devices named
+ * <prefix>0 .. <prefix>N-1, so running with -d 1 and -d N shows how write
+ * throughput scales once producers stop contending on one device lock.
+ * With -b, each thread submits its packets in batches of that many with
+ * writev(), which the driver commits under a single lock acquisition.
+ *
+ * Usage: aesdchar-write-bench [-t threads] [-d devices] [-p packet_size] [-n packets] [-b batch] [prefix]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PREFIX "/dev/aesdchar"
+
+struct writer_args {
+    char device[64];
+    size_t packet_size;
+    unsigned int packets;
+    unsigned int batch;
+    int rc;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct writer_args *args = arg;
+    char *packet = malloc(args->packet_size);
+    struct iovec iov[args->batch];
+    unsigned int i, n;
+    ssize_t len;
+    int fd;
+
+    args->rc = -1;
+    if (packet == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memset(packet, 'w', args->packet_size - 1);
+    packet[args->packet_size - 1] = '\n';
+    for (i = 0; i < args->batch; i++) {
+        iov[i].iov_base = packet;
+        iov[i].iov_len = args->packet_size;
+    }
+
+    fd = open(args->device, O_WRONLY);
+    if (fd == -1) {
+        fprintf(stderr, "open %s: %s\n", args->device, strerror(errno));
+        free(packet);
+        return NULL;
+    }
+    for (i = 0; i < args->packets; i += n) {
+        n = args->packets - i < args->batch ? args->packets - i : args->batch;
+        len = n == 1 ? write(fd, packet, args->packet_size) : writev(fd, iov, n);
+        if (len != (ssize_t)(n * args->packet_size)) {
+            perror("write");
+            goto out;
+        }
+    }
+    args->rc = 0;
+
+  out:
+    close(fd);
+    free(packet);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *prefix = DEFAULT_PREFIX;
+    unsigned int threads = 1, devices = 1, packets = 100000, batch = 1, i;
+    size_t packet_size = 32;
+    double start, elapsed;
+    int opt, rc = 0;
+
+    while ((opt = getopt(argc, argv, "t:d:p:n:b:")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                devices = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                packet_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                packets = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                batch = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t threads] [-d devices] [-p packet_size] [-n packets] [-b batch] [prefix]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        prefix = argv[optind];
+    }
+    if (threads < 1 || devices < 1 || packet_size < 1 || batch < 1 || batch > IOV_MAX) {
+        fprintf(stderr, "threads, devices, packet size and batch must be at least 1, batch at most %d\n", IOV_MAX);
+        return 1;
+    }
+
+    struct writer_args args[threads];
+    pthread_t tids[threads];
+
+    start = now_sec();
+    for (i = 0; i < threads; i++) {
+        snprintf(args[i].device, sizeof(args[i].device), "%s%u", prefix, i % devices);
+        args[i].packet_size = packet_size;
+        args[i].packets = packets;
+        args[i].batch = batch;
+        if (pthread_create(&tids[i], NULL, writer_thread, &args[i]) != 0) {
+            fprintf(stderr, "Error creating writer thread\n");
+            threads = i;
+            rc = -1;
+            break;
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        rc |= args[i].rc;
+    }
+    elapsed = now_sec() - start;
+    if (rc != 0) {
+        return 1;
+    }
+
+    printf("%u threads over %u devices, %u packets of %zu bytes each in batches of %u: %.0f packets/s, %.2f MB/s\n",
+            threads, devices, packets, packet_size, batch, (double)threads * packets / elapsed,
+            (double)threads * packets * packet_size / elapsed / (1024 * 1024));
+    return 0;
+}
@@ -19,76 +19,150 @@
 #include <linux/fs.h> // file_operations
 #include <linux/uaccess.h>
 #include <linux/capability.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/srcu.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/device.h>
+#include <linux/shrinker.h>
+#include <linux/debugfs.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+int aesd_nr_devs = 1;
+module_param(aesd_nr_devs, int, S_IRUGO);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of aesdchar devices, created as /dev/aesdchar0..N-1");
+static unsigned int aesd_mmap_pages = 16;
+module_param(aesd_mmap_pages, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_mmap_pages, "Number of data pages in the mmap() history window");
 
 MODULE_AUTHOR("Anish Nandhan");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
-
-static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, unsigned int write_cmd_offset) {
-    struct aesd_dev *dev = filp->private_data;
-    struct aesd_circular_buffer *c_buf = &dev->circular_buffer;
-    int total_cmds, n, i = c_buf->out_offs;
-    struct aesd_buffer_entry *entry;
-    loff_t size_to_skip = 0;
-    long retval = 0;
+struct aesd_dev *aesd_devices;
+static struct class *aesd_class;
+static struct dentry *aesd_debugfs_root;
 
+static int aesd_history_init(struct aesd_history *history, unsigned long data_pages)
+{
+    void *area = vmalloc_user((data_pages + 1) * PAGE_SIZE);
 
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS;
+    if (!area) {
+        return -ENOMEM;
     }
+    history->header = area;
+    history->data = (char *)area + PAGE_SIZE;
+    history->data_pages = data_pages;
+    history->capacity = data_pages * PAGE_SIZE;
+
+    history->header->data_offset = PAGE_SIZE;
+    history->header->capacity = history->capacity;
+    history->header->magic = AESD_MMAP_MAGIC;
+    return 0;
+}
 
-    if (c_buf->full) {
-        total_cmds = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    } else {
-        total_cmds = (c_buf->in_offs - c_buf->out_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    }
+static void aesd_history_free(struct aesd_history *history)
+{
+    vfree(history->header);
+    history->header = NULL;
+}
 
-    if (write_cmd >= total_cmds) {
-        retval = -EINVAL;
-        goto out;
-    }
+static unsigned long aesd_shrink_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    unsigned long count = 0;
+    struct aesd_dev *dev;
+    int i, idx;
 
-    for (n = 0; n < total_cmds; n++) {
-        entry = &c_buf->entry[i];
-        if (n == write_cmd) {
-            break;
+    for (i = 0; i < aesd_nr_devs; i++) {
+        dev = &aesd_devices[i];
+        // Evicting from a byte store frees no memory
+        if (dev->store.data) {
+            continue;
         }
-        size_to_skip += entry->size; 
-        i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; 
+        idx = srcu_read_lock(&dev->srcu);
+        // The newest entry of each device is never evicted
+        count += max(aesd_circular_buffer_count(&srcu_dereference(dev->ring, &dev->srcu)->circular_buffer), 1) - 1;
+        srcu_read_unlock(&dev->srcu, idx);
     }
+    return count ? count : SHRINK_EMPTY;
+}
 
-    if (write_cmd_offset >= entry->size) {
-        retval = -EINVAL;
-        goto out;
+/**
+ * Evict the oldest entries of each device under memory pressure, skipping
+ * devices whose writer currently holds the lock
+ */
+static unsigned long aesd_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    unsigned long freed = 0, nr_to_scan = sc->nr_to_scan;
+    unsigned int entries, nr_evict;
+    struct aesd_dev *dev;
+    struct aesd_ring *ring;
+    int i;
+
+    for (i = 0; i < aesd_nr_devs && freed < nr_to_scan; i++) {
+        dev = &aesd_devices[i];
+        if (dev->store.data || !mutex_trylock(&dev->lock)) {
+            continue;
+        }
+        ring = rcu_dereference_protected(dev->ring, lockdep_is_held(&dev->lock));
+        entries = aesd_circular_buffer_count(&ring->circular_buffer);
+        nr_evict = min_t(unsigned long, entries ? entries - 1 : 0, nr_to_scan - freed);
+        if (nr_evict) {
+            ring = kmem_cache_alloc(aesd_ring_cachep, GFP_NOWAIT | __GFP_NOWARN);
+            if (ring) {
+                aesd_ring_publish(dev, ring, NULL, 0, 0, nr_evict);
+                aesd_history_set_start(dev, ring->base);
+                freed += nr_evict;
+            }
+        }
+        mutex_unlock(&dev->lock);
     }
+    return freed ? freed : SHRINK_STOP;
+}
 
-    size_to_skip += write_cmd_offset;
-    filp->f_pos = size_to_skip;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,7,0)
+static struct shrinker aesd_shrinker_static = {
+    .count_objects = aesd_shrink_count,
+    .scan_objects = aesd_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+static struct shrinker *aesd_shrinker = &aesd_shrinker_static;
 
-  out:
-    mutex_unlock(&dev->lock);
-    return retval;
+static int aesd_shrinker_register(void)
+{
+    return register_shrinker(aesd_shrinker, "aesdchar");
 }
 
-loff_t aesd_llseek(struct file *filp, loff_t offset, int whence) {
-    struct aesd_dev *dev = filp->private_data;
-    loff_t retval = -EINVAL;
+static void aesd_shrinker_unregister(void)
+{
+    unregister_shrinker(aesd_shrinker);
+}
+#else
+static struct shrinker *aesd_shrinker;
 
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS;
+static int aesd_shrinker_register(void)
+{
+    aesd_shrinker = shrinker_alloc(0, "aesdchar");
+    if (!aesd_shrinker) {
+        return -ENOMEM;
     }
+    aesd_shrinker->count_objects = aesd_shrink_count;
+    aesd_shrinker->scan_objects = aesd_shrink_scan;
+    shrinker_register(aesd_shrinker);
+    return 0;
+}
 
-    retval = fixed_size_llseek(filp, offset, whence, dev->size);
-
-  out:
-    mutex_unlock(&dev->lock);
-    return retval;
+static void aesd_shrinker_unregister(void)
+{
+    shrinker_free(aesd_shrinker);
 }
+#endif
 
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     int err = 0;
@@ -116,6 +190,39 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
                 retval = aesd_adjust_file_offset(filp, seek_arg.write_cmd, seek_arg.write_cmd_offset);
             }
             break;
+        case AESDCHAR_IOCTAIL:
+            uint32_t tail_arg;
+            if (copy_from_user(&tail_arg, (const void __user *)arg, sizeof(tail_arg))) {
+                retval = -EFAULT;
+            } else {
+                PDEBUG("AESDCHAR_IOCTAIL ioctl received with enable: %u", tail_arg);
+                retval = aesd_set_tail(filp, tail_arg != 0);
+            }
+            break;
+        case AESDCHAR_IOCSNAPSHOT:
+            struct aesd_snapshot snap_arg;
+            if (copy_from_user(&snap_arg, (const void __user *)arg, sizeof(snap_arg))) {
+                retval = -EFAULT;
+            } else {
+                PDEBUG("AESDCHAR_IOCSNAPSHOT ioctl received with data_len: %llu", snap_arg.data_len);
+                retval = aesd_snapshot(filp, &snap_arg);
+                if (!retval && copy_to_user((void __user *)arg, &snap_arg, sizeof(snap_arg))) {
+                    retval = -EFAULT;
+                }
+            }
+            break;
+        case AESDCHAR_IOCSEEKTIME:
+            struct aesd_seektime time_arg;
+            if (copy_from_user(&time_arg, (const void __user *)arg, sizeof(time_arg))) {
+                retval = -EFAULT;
+            } else {
+                PDEBUG("AESDCHAR_IOCSEEKTIME ioctl received with clock: %u and time_ns: %llu", time_arg.clock, time_arg.time_ns);
+                retval = aesd_seek_time(filp, &time_arg);
+                if (!retval && copy_to_user((void __user *)arg, &time_arg, sizeof(time_arg))) {
+                    retval = -EFAULT;
+                }
+            }
+            break;
         default:
             retval = -ENOTTY;
     }
@@ -127,218 +234,316 @@ int aesd_open(struct inode *inode, struct file *filp)
     PDEBUG("open");
 
     struct aesd_dev *dev;
+    struct aesd_file *file;
     dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
 
-    filp->private_data = dev;
+    file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if (!file) {
+        return -ENOMEM;
+    }
+    file->dev = dev;
+    filp->private_data = file;
 
     return 0;
 }
 
-int aesd_release(struct inode *inode, struct file *filp)
+int aesd_fasync(int fd, struct file *filp, int mode)
 {
-    PDEBUG("release");
+    struct aesd_file *file = filp->private_data;
 
-    return 0;
+    return fasync_helper(fd, filp, mode, &file->dev->async_queue);
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+int aesd_release(struct inode *inode, struct file *filp)
 {
-    struct aesd_dev *dev = filp->private_data;
-    struct aesd_circular_buffer *c_buf = &dev->circular_buffer;
-    struct aesd_buffer_entry *entry;
-    size_t entry_offset_byte;
-    ssize_t retval = 0;
-    
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
-    
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS;
-    }
-    if (*f_pos > dev->size) {
-        PDEBUG("f_pos > dev->size");
-        goto out;
-    }
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(c_buf, *f_pos, &entry_offset_byte);
-
-    if (entry == NULL || !entry->buffptr || entry->buffptr == 0) {
-        PDEBUG("could not find valid entry for f_pos: %lld", *f_pos);
-        goto out;
-    }
-
-    PDEBUG("found valid entry for f_pos: %lld", *f_pos);
-
-    if (count > entry->size - entry_offset_byte) {
-        count = entry->size - entry_offset_byte;
-    }
-
-    if (copy_to_user(buf, entry->buffptr + entry_offset_byte, count)) {
-        retval = -EFAULT;
-        goto out;
-    }
-
-    PDEBUG("copied %zu bytes to user", count);
+    PDEBUG("release");
 
-    *f_pos += count;
-    retval = count;
+    aesd_fasync(-1, filp, 0);
+    kfree(filp->private_data);
 
-  out:
-    mutex_unlock(&dev->lock);
-    return retval;
+    return 0;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * Map the history window read only: the header page followed by the data
+ * pages twice, so a range that wraps the end of the window stays contiguous.
+ * The pages live as long as the device, so evicted or overwritten data is
+ * only ever stale, never freed under a mapper.
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-    struct aesd_dev *dev = filp->private_data;
-    struct aesd_circular_buffer *c_buf = &dev->circular_buffer;
-    struct aesd_buffer_entry add_entry, rm_entry;
-    struct aesd_cmd_str *cmd, *e, *n;
-    char *newline, *buffptr;
-    size_t copied_size = 0;
-    ssize_t retval = -ENOMEM;
-
-    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
-
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS;
-    }
-    
-    cmd = kzalloc(sizeof(struct aesd_cmd_str), GFP_KERNEL);
-    if (!cmd) {
-        goto out;
-    }
-
-    cmd->str = kzalloc(count, GFP_KERNEL);
-    if (!cmd->str) {
-        kfree(cmd);
-        goto out;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_history *history = &dev->history;
+    unsigned long npages = vma_pages(vma);
+    unsigned long i, page;
+    int err;
+
+    if (vma->vm_pgoff != 0 || npages > 1 + 2 * history->data_pages) {
+        return -EINVAL;
     }
-
-    if (copy_from_user(cmd->str, buf, count)) {
-        kfree(cmd->str);
-        kfree(cmd);
-        retval = -EFAULT;
-        goto out;
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
     }
-    cmd->size = count;
-
-    list_add_tail(&cmd->node, &dev->cmds);
-    dev->cur_cmd_size += count;
-    PDEBUG("current command size: %zu", dev->cur_cmd_size);
-
-    newline = memchr(cmd->str, '\n', count);
-
-    // Assumption: If '\n' is present there won't be any data following it
-    if (newline) {
-        PDEBUG("newline found in cmd");
-        buffptr = kzalloc(dev->cur_cmd_size, GFP_KERNEL);
-        if (!buffptr) {
-            goto out;
-        }
-        list_for_each_entry_safe(e, n, &dev->cmds, node) {
-            memcpy(buffptr + copied_size, e->str, e->size);
-            copied_size += e->size;
-            kfree(e->str);
-            list_del(&e->node);
-            kfree(e);
-        }
-        add_entry.buffptr = buffptr;
-        add_entry.size = copied_size;
-        rm_entry = aesd_circular_buffer_add_entry(c_buf, &add_entry);
-        if (rm_entry.size) {
-            dev->size -= rm_entry.size;
-            kfree(rm_entry.buffptr);
+    vm_flags_clear_wrapper(vma, VM_MAYWRITE);
+    vm_flags_set_wrapper(vma, VM_DONTEXPAND | VM_DONTDUMP);
+
+    for (i = 0; i < npages; i++) {
+        page = i ? 1 + (i - 1) % history->data_pages : 0;
+        err = vm_insert_page(vma, vma->vm_start + i * PAGE_SIZE,
+                vmalloc_to_page((char *)history->header + page * PAGE_SIZE));
+        if (err) {
+            return err;
         }
-        dev->size += copied_size;
-        dev->cur_cmd_size = 0;
-        PDEBUG("written command with %zu bytes", copied_size);
     }
-
-    *f_pos += count;
-    retval = count;
-
-  out:
-    mutex_unlock(&dev->lock);
-    return retval;
+    return 0;
 }
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_ring *ring;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    int idx;
+
+    poll_wait(filp, &dev->readq, wait);
+
+    idx = srcu_read_lock(&dev->srcu);
+    ring = srcu_dereference(dev->ring, &dev->srcu);
+    if (aesd_file_pos(file, ring, filp->f_pos) < ring->size) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    srcu_read_unlock(&dev->srcu, idx);
 
+    return mask;
+}
 
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
     .llseek =   aesd_llseek,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter =    aesd_read_iter,
+    .write_iter =   aesd_write_iter,
+    .splice_read =  splice_read_wrapper,
+    .splice_write = iter_file_splice_write,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
+    .fasync =   aesd_fasync,
     .open =     aesd_open,
     .release =  aesd_release,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static ssize_t retained_bytes_show(struct device *device, struct device_attribute *attr, char *buf)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    struct aesd_dev *dev = dev_get_drvdata(device);
+    size_t size;
+    int idx;
+
+    idx = srcu_read_lock(&dev->srcu);
+    size = srcu_dereference(dev->ring, &dev->srcu)->size;
+    srcu_read_unlock(&dev->srcu, idx);
+    return sysfs_emit(buf, "%zu\n", size);
+}
+static DEVICE_ATTR_RO(retained_bytes);
+
+static ssize_t retained_entries_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+    uint8_t count;
+    int idx;
+
+    idx = srcu_read_lock(&dev->srcu);
+    count = aesd_circular_buffer_count(&srcu_dereference(dev->ring, &dev->srcu)->circular_buffer);
+    srcu_read_unlock(&dev->srcu, idx);
+    return sysfs_emit(buf, "%u\n", count);
+}
+static DEVICE_ATTR_RO(retained_entries);
+
+static ssize_t evicted_bytes_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+    u64 base;
+    int idx;
+
+    // The ring base only ever advances by the size of evicted entries
+    idx = srcu_read_lock(&dev->srcu);
+    base = srcu_dereference(dev->ring, &dev->srcu)->base;
+    srcu_read_unlock(&dev->srcu, idx);
+    return sysfs_emit(buf, "%llu\n", base);
+}
+static DEVICE_ATTR_RO(evicted_bytes);
+
+static ssize_t pending_bytes_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+
+    return sysfs_emit(buf, "%zu\n", READ_ONCE(dev->cur_cmd_size));
+}
+static DEVICE_ATTR_RO(pending_bytes);
+
+static struct attribute *aesd_attrs[] = {
+    &dev_attr_retained_bytes.attr,
+    &dev_attr_retained_entries.attr,
+    &dev_attr_evicted_bytes.attr,
+    &dev_attr_pending_bytes.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(aesd);
+
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
+{
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
+        return err;
+    }
+
+    dev->device = device_create(aesd_class, NULL, devno, dev, "aesdchar%d", index);
+    if (IS_ERR(dev->device)) {
+        err = PTR_ERR(dev->device);
+        printk(KERN_ERR "Error %d creating aesdchar%d device", err, index);
+        cdev_del(&dev->cdev);
     }
     return err;
 }
 
+static int aesd_dev_init(struct aesd_dev *dev, int index)
+{
+    char name[16];
+    int result;
+
+    result = aesd_dev_core_init(dev);
+    if (result) {
+        return result;
+    }
 
+    result = aesd_history_init(&dev->history, aesd_mmap_pages);
+    if (result) {
+        aesd_dev_core_cleanup(dev);
+        return result;
+    }
+
+    result = aesd_stats_init(&dev->stats);
+    if (result) {
+        aesd_history_free(&dev->history);
+        aesd_dev_core_cleanup(dev);
+        return result;
+    }
+
+    result = aesd_setup_cdev(dev, index);
+
+    if( result ) {
+        aesd_stats_free(&dev->stats);
+        aesd_history_free(&dev->history);
+        aesd_dev_core_cleanup(dev);
+        return result;
+    }
+
+    snprintf(name, sizeof(name), "aesdchar%d", index);
+    aesd_stats_debugfs_init(&dev->stats, aesd_debugfs_root, name);
+
+    return result;
+}
+
+static void aesd_dev_cleanup(struct aesd_dev *dev)
+{
+    device_destroy(aesd_class, dev->cdev.dev);
+    cdev_del(&dev->cdev);
+
+    aesd_dev_core_cleanup(dev);
+    aesd_history_free(&dev->history);
+    aesd_stats_free(&dev->stats);
+}
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
-    int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    int result, i;
+
+    if (aesd_nr_devs <= 0) {
+        aesd_nr_devs = 1;
+    }
+    if (aesd_mmap_pages == 0) {
+        aesd_mmap_pages = 1;
+    }
+
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
-    /**
-    * TODO: initialize the AESD specific portion of the device
-    */
-    INIT_LIST_HEAD(&aesd_device.cmds);
-    
-    mutex_init(&aesd_device.lock);
 
-    result = aesd_setup_cdev(&aesd_device);
+    result = aesd_core_init();
+    if (result) {
+        goto fail_region;
+    }
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+    aesd_class = class_create_wrapper("aesdchar");
+    if (IS_ERR(aesd_class)) {
+        result = PTR_ERR(aesd_class);
+        goto fail_core;
+    }
+    aesd_class->dev_groups = aesd_groups;
+    aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
+
+    // Each struct aesd_dev is cache line aligned, so devices in the array never share a line
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (!aesd_devices) {
+        result = -ENOMEM;
+        goto fail_class;
     }
 
-    return result;
+    for (i = 0; i < aesd_nr_devs; i++) {
+        result = aesd_dev_init(&aesd_devices[i], i);
+        if (result) {
+            goto fail_devices;
+        }
+    }
 
+    result = aesd_shrinker_register();
+    if (result) {
+        goto fail_devices;
+    }
+
+    return 0;
+
+  fail_devices:
+    while (--i >= 0) {
+        aesd_dev_cleanup(&aesd_devices[i]);
+    }
+    kfree(aesd_devices);
+  fail_class:
+    debugfs_remove_recursive(aesd_debugfs_root);
+    class_destroy(aesd_class);
+  fail_core:
+    aesd_core_exit();
+  fail_region:
+    unregister_chrdev_region(dev, aesd_nr_devs);
+    return result;
 }
 
 void aesd_cleanup_module(void)
 {
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
-    struct aesd_cmd_str *e, *n;
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    int i;
 
-    cdev_del(&aesd_device.cdev);
-
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.circular_buffer, index) {
-        kfree(entry->buffptr);
-    }
-
-    list_for_each_entry_safe(e, n, &aesd_device.cmds, node) {
-        kfree(e->str);
-        list_del(&e->node);
-        kfree(e);
+    aesd_shrinker_unregister();
+    for (i = 0; i < aesd_nr_devs; i++) {
+        aesd_dev_cleanup(&aesd_devices[i]);
     }
+    kfree(aesd_devices);
+    debugfs_remove_recursive(aesd_debugfs_root);
+    class_destroy(aesd_class);
+    aesd_core_exit();
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 
@@ -0,0 +1,188 @@
+/**
+ * Measures the latency of launching /bin/true from a caller of growing RSS,
+ * once with fork() + execv() and once with do_exec()'s posix_spawn().
+ *
+ * Usage: spawn-bench [-n iterations] [size MB ...]
+ *        spawn-bench -b commands
+ * Sizes default to 10 100 1000 10000 MB, a size that cannot be allocated
+ * and touched is reported and skipped.
+ *
+ * With -b it instead runs a batch of short shell loops one after the other
+ * with do_exec() and then through do_exec_batch() at growing concurrency.
+ */
+#include "systemcalls.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define COMMAND "/bin/true"
+// A little CPU bound work for the batch, so that it can show scaling with cores
+#define BATCH_SCRIPT "i=0; while [ $i -lt 2000 ]; do i=$((i+1)); done"
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * The launch do_exec() used before posix_spawn(), kept here as the baseline
+ */
+static bool fork_exec(void)
+{
+    char *command[] = { COMMAND, NULL };
+    int status;
+    pid_t pid;
+
+    pid = fork();
+    if (pid == -1) {
+        perror("fork() error");
+        return false;
+    }
+    if (pid == 0) {
+        execv(command[0], command);
+        _exit(EXIT_FAILURE);
+    }
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            perror("waitpid() error");
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool spawn_exec(void)
+{
+    return do_exec(1, COMMAND);
+}
+
+/**
+ * @return the mean latency in microseconds of @param iterations calls of @param launch,
+ *   or a negative value if one of them failed
+ */
+static double time_launch(bool (*launch)(void), unsigned int iterations)
+{
+    double start = now();
+    unsigned int i;
+
+    for (i = 0; i < iterations; i++) {
+        if (!launch()) {
+            return -1;
+        }
+    }
+    return (now() - start) * 1e6 / iterations;
+}
+
+static int bench_batch(size_t nr_commands)
+{
+    char *const command[] = { "/bin/sh", "-c", BATCH_SCRIPT, NULL };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    char *const **commands;
+    struct exec_result *results;
+    unsigned int running;
+    double start, serial;
+    size_t i;
+
+    commands = malloc(nr_commands * sizeof(*commands));
+    results = malloc(nr_commands * sizeof(*results));
+    if (commands == NULL || results == NULL) {
+        perror("malloc() error");
+        free(commands);
+        free(results);
+        return 1;
+    }
+    for (i = 0; i < nr_commands; i++) {
+        commands[i] = command;
+    }
+
+    start = now();
+    for (i = 0; i < nr_commands; i++) {
+        do_exec(3, command[0], command[1], command[2]);
+    }
+    serial = now() - start;
+    printf("%d online CPUs, %zu commands\n", (int)cpus, nr_commands);
+    printf("%10s %12s %12s\n", "running", "seconds", "commands/s");
+    printf("%10s %12.3f %12.1f\n", "do_exec", serial, nr_commands / serial);
+
+    for (running = 1; running <= (cpus > 1 ? 2 * cpus : 4); running *= 2) {
+        start = now();
+        if (do_exec_batch(commands, nr_commands, running, results) != 0) {
+            fprintf(stderr, "Some commands of the batch failed\n");
+        }
+        serial = now() - start;
+        printf("%10u %12.3f %12.1f\n", running, serial, nr_commands / serial);
+    }
+
+    free(commands);
+    free(results);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static char *default_sizes[] = { "10", "100", "1000", "10000" };
+    char **sizes = default_sizes;
+    unsigned int iterations = 200;
+    size_t batch = 0;
+    int nr_sizes = 4, opt, i;
+
+    while ((opt = getopt(argc, argv, "b:n:")) != -1) {
+        switch (opt) {
+            case 'b':
+                batch = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n iterations] [size MB ...] or %s -b commands\n", argv[0], argv[0]);
+                return 1;
+        }
+    }
+    if (batch > 0) {
+        return bench_batch(batch);
+    }
+    if (iterations == 0) {
+        fprintf(stderr, "Iterations must be positive\n");
+        return 1;
+    }
+    if (optind < argc) {
+        sizes = argv + optind;
+        nr_sizes = argc - optind;
+    }
+
+    printf("%10s %18s %18s\n", "RSS MB", "fork+execv us", "posix_spawn us");
+    for (i = 0; i < nr_sizes; i++) {
+        size_t bytes = strtoull(sizes[i], NULL, 0) << 20;
+        double forked, spawned;
+        char *ballast = NULL;
+
+        if (bytes > 0) {
+            ballast = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ballast == MAP_FAILED) {
+                printf("%10s %18s %18s\n", sizes[i], "-", "-");
+                fprintf(stderr, "Could not map %s MB: %s\n", sizes[i], strerror(errno));
+                continue;
+            }
+            // Untouched pages are not resident, dirty every one of them
+            memset(ballast, 1, bytes);
+        }
+
+        forked = time_launch(fork_exec, iterations);
+        spawned = time_launch(spawn_exec, iterations);
+        printf("%10s %18.1f %18.1f\n", sizes[i], forked, spawned);
+        fflush(stdout);
+
+        if (ballast != NULL) {
+            munmap(ballast, bytes);
+        }
+    }
+    return 0;
+}
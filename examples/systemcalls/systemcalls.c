@@ -1,10 +1,21 @@
+#define _GNU_SOURCE
+
 #include "systemcalls.h"
 #include <fcntl.h>
 #include <errno.h>
+#include <spawn.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+extern char **environ;
+
 /**
  * @param cmd the command to execute with system()
  * @return true if the command in @param cmd was executed
@@ -23,6 +34,90 @@ bool do_system(const char *cmd)
     return true;
 }
 
+/**
+ * Launches @param command with posix_spawn(), which glibc implements with
+ * clone(CLONE_VM | CLONE_VFORK) so no page tables are copied however large
+ * the caller is.
+ * @param stdout_fd if not -1 is duplicated onto the child's stdout
+ * @param stderr_fd if not -1 is duplicated onto the child's stderr
+ * @param pid set to the pid of the child
+ */
+static bool spawn_command(char *const command[], int stdout_fd, int stderr_fd, pid_t *pid)
+{
+    posix_spawn_file_actions_t actions, *actionsp = NULL;
+    int rc;
+
+    if (stdout_fd != -1 || stderr_fd != -1) {
+        rc = posix_spawn_file_actions_init(&actions);
+        if (rc != 0) {
+            errno = rc;
+            perror("posix_spawn_file_actions error");
+            return false;
+        }
+        if (stdout_fd != -1) {
+            rc = posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+        }
+        if (rc == 0 && stderr_fd != -1) {
+            rc = posix_spawn_file_actions_adddup2(&actions, stderr_fd, STDERR_FILENO);
+        }
+        if (rc != 0) {
+            posix_spawn_file_actions_destroy(&actions);
+            errno = rc;
+            perror("posix_spawn_file_actions error");
+            return false;
+        }
+        actionsp = &actions;
+    }
+
+    fflush(stdout);
+    rc = posix_spawn(pid, command[0], actionsp, NULL, command, environ);
+    if (actionsp != NULL) {
+        posix_spawn_file_actions_destroy(actionsp);
+    }
+    if (rc != 0) {
+        errno = rc;
+        perror("posix_spawn() error");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Reaps exactly @param pid, never another child of the caller
+ */
+static bool wait_command(pid_t pid, int *status)
+{
+    while (waitpid(pid, status, 0) == -1) {
+        if (errno != EINTR) {
+            perror("waitpid() error");
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool spawn_and_wait(char *const command[], int stdout_fd)
+{
+    int status;
+    pid_t pid;
+
+    if (!spawn_command(command, stdout_fd, -1, &pid) || !wait_command(pid, &status)) {
+        return false;
+    }
+
+    if (!WIFEXITED(status)) {
+        fprintf(stderr, "Process %d did not exit properly\n", pid);
+        return false;
+    }
+
+    if (WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Process %d exited with non-zero exit code: %d\n", pid, WEXITSTATUS(status));
+        return false;
+    }
+
+    return true;
+}
+
 /**
 * @param count -The numbers of variables passed to the function. The variables are command to execute.
 *   followed by arguments to pass to the command
@@ -32,8 +127,8 @@ bool do_system(const char *cmd)
 *   The first is always the full path to the command to execute with execv()
 *   The remaining arguments are a list of arguments to pass to the command in execv()
 * @return true if the command @param ... with arguments @param arguments were executed successfully
-*   using the execv() call, false if an error occurred, either in invocation of the
-*   fork, waitpid, or execv() command, or if a non-zero return value was returned
+*   using posix_spawn(), false if an error occurred, either in invocation of
+*   posix_spawn() or waitpid(), or if a non-zero return value was returned
 *   by the command issued in @param arguments with the specified arguments.
 */
 
@@ -48,48 +143,9 @@ bool do_exec(int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-
-    int cpid = fork();
-
-    if (cpid == -1) {
-        perror("fork() error");
-        va_end(args);
-        return false;
-    }
-
-    fflush(stdout);
-
-    if (cpid == 0) {
-        int ret;
-        ret = execv(command[0], command);
-        if (ret == -1) {
-            perror("execv() failure");
-            _exit(EXIT_FAILURE);
-        }
-    }
-
-    int status, pid;
-    bool ret = true;
-    pid = wait(&status);
-        
-    if (pid == -1) {
-        perror("wait() error");
-        ret = false;
-    }
-
-    if (!WIFEXITED(status)) {
-        fprintf(stderr, "Process %d did not exit properly\n", pid);
-        ret = false;
-    }
-
-    if (WEXITSTATUS(status) != 0) {
-        fprintf(stderr, "Process %d exited with non-zero exit code: %d\n", pid, status);
-        ret = false;
-    }
-
     va_end(args);
 
-    return ret;
+    return spawn_and_wait(command, -1);
 }
 
 /**
@@ -108,71 +164,392 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
+    va_end(args);
 
-/*
- * TODO
- *   Call execv, but first using https://stackoverflow.com/a/13784315/1446624 as a refernce,
- *   redirect standard out to a file specified by outputfile.
- *   The rest of the behaviour is same as do_exec()
- *
-*/
-    int fd, cpid;
+    int fd;
+    bool ret;
 
-    fd = open(outputfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IROTH | S_IRGRP);
+    // Close on exec, the child only keeps the copy dup2()ed onto its stdout
+    fd = open(outputfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IROTH | S_IRGRP);
 
     if (fd == -1) {
         perror("Failed to open file");
-        va_end(args);
         return false;
     }
 
-    cpid = fork();
+    ret = spawn_and_wait(command, fd);
+    close(fd);
 
-    if (cpid == -1) {
-        perror("fork() error");
-        va_end(args);
-        return false;
+    return ret;
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * pidfd_open() through syscall(), as glibc only has a wrapper since 2.36
+ * @return the pidfd, or -1 with errno set, ENOSYS where headers or kernel predate it
+ */
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * A command of the batch that is running, the slot index is the epoll cookie
+ */
+struct batch_slot {
+    size_t command;
+    pid_t pid;
+    int pidfd;
+    struct timespec start;
+};
+
+static void batch_reap(struct batch_slot *slot, struct exec_result *result)
+{
+    if (!wait_command(slot->pid, &result->status)) {
+        result->status = -1;
+    }
+    result->wall_time = elapsed(&slot->start);
+}
+
+int do_exec_batch(char *const *const commands[], size_t nr_commands, unsigned int max_running,
+        struct exec_result results[])
+{
+    struct epoll_event events[16];
+    struct batch_slot *slots;
+    unsigned int *free_slots, nr_free, i;
+    size_t next = 0, running = 0;
+    int epfd, nr_events, failed = 0;
+
+    if (max_running == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_running = cpus > 0 ? cpus : 1;
+    }
+    if (max_running > nr_commands) {
+        max_running = nr_commands > 0 ? nr_commands : 1;
     }
 
-    fflush(stdout);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1() error");
+        return -1;
+    }
+    slots = calloc(max_running, sizeof(*slots));
+    free_slots = calloc(max_running, sizeof(*free_slots));
+    if (slots == NULL || free_slots == NULL) {
+        perror("calloc() error");
+        free(slots);
+        free(free_slots);
+        close(epfd);
+        return -1;
+    }
+    for (nr_free = 0; nr_free < max_running; nr_free++) {
+        free_slots[nr_free] = max_running - 1 - nr_free;
+        slots[nr_free].pidfd = -1;
+    }
+
+    while (next < nr_commands || running > 0) {
+        while (nr_free > 0 && next < nr_commands) {
+            struct epoll_event event = { .events = EPOLLIN };
+            struct batch_slot *slot = &slots[free_slots[nr_free - 1]];
+
+            slot->command = next++;
+            results[slot->command].status = -1;
+            results[slot->command].wall_time = 0;
+            clock_gettime(CLOCK_MONOTONIC, &slot->start);
+            if (!spawn_command(commands[slot->command], -1, -1, &slot->pid)) {
+                failed++;
+                continue;
+            }
 
-    if (cpid == 0) {
-        if (dup2(fd, 1) == -1) {
-            perror("dup2() error");
-            _exit(EXIT_FAILURE);
+            // The child stays a zombie until reaped, so its pid cannot be reused in between
+            slot->pidfd = open_pidfd(slot->pid);
+            event.data.u32 = free_slots[nr_free - 1];
+            if (slot->pidfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, slot->pidfd, &event) == -1) {
+                // Without a pidfd this command is waited for on its own
+                if (slot->pidfd != -1) {
+                    close(slot->pidfd);
+                    slot->pidfd = -1;
+                }
+                batch_reap(slot, &results[slot->command]);
+                failed += results[slot->command].status != 0;
+                continue;
+            }
+            nr_free--;
+            running++;
         }
-        close(fd);
-        int ret;
-        ret = execv(command[0], command);
-        if (ret == -1) {
-            perror("execv() failure");
-            _exit(EXIT_FAILURE);
+        if (running == 0) {
+            break;
+        }
+
+        nr_events = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+        if (nr_events == -1 && errno == EINTR) {
+            continue;
+        } else if (nr_events == -1) {
+            perror("epoll_wait() error");
+            // Nothing is left behind unreaped, the rest is waited for in turn
+            for (i = 0; i < max_running; i++) {
+                if (slots[i].pidfd != -1) {
+                    batch_reap(&slots[i], &results[slots[i].command]);
+                    failed += results[slots[i].command].status != 0;
+                    close(slots[i].pidfd);
+                }
+            }
+            failed += nr_commands - next;
+            break;
+        }
+        for (i = 0; i < (unsigned int)nr_events; i++) {
+            struct batch_slot *slot = &slots[events[i].data.u32];
+
+            batch_reap(slot, &results[slot->command]);
+            failed += results[slot->command].status != 0;
+            epoll_ctl(epfd, EPOLL_CTL_DEL, slot->pidfd, NULL);
+            close(slot->pidfd);
+            slot->pidfd = -1;
+            free_slots[nr_free++] = events[i].data.u32;
+            running--;
         }
     }
 
-    close(fd);
+    free(slots);
+    free(free_slots);
+    close(epfd);
+    return failed;
+}
+
+/**
+ * Appends @param len bytes at @param data to @param buffer, keeping at most
+ * @param max_bytes (0 for no limit) and NUL terminating what is kept
+ */
+static bool buffer_append(struct exec_buffer *buffer, size_t *capacity, const char *data, size_t len,
+        size_t max_bytes)
+{
+    if (max_bytes != 0 && buffer->len + len > max_bytes) {
+        buffer->truncated = true;
+        len = max_bytes - buffer->len;
+    }
+    if (buffer->len + len + 1 > *capacity) {
+        size_t grown = *capacity ? *capacity : 4096;
+        char *data_new;
 
-    int status, pid;
+        while (grown < buffer->len + len + 1) {
+            grown *= 2;
+        }
+        data_new = realloc(buffer->data, grown);
+        if (data_new == NULL) {
+            perror("realloc() error");
+            return false;
+        }
+        buffer->data = data_new;
+        *capacity = grown;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    buffer->data[buffer->len] = '\0';
+    return true;
+}
+
+/**
+ * Drains the read ends of the child's stdout and stderr pipes in @param fds
+ *   into @param buffers until both reach end of file. Bytes past the cap are
+ *   still read, so the child never blocks on a full pipe, but not kept.
+ * @return false on error, possibly before end of file, in which case the
+ *   caller must close @param fds before waiting for the child
+ */
+static bool capture_pipes(int fds[2], struct exec_buffer *buffers[2], size_t max_bytes)
+{
+    size_t capacity[2] = { 0, 0 };
+    struct epoll_event events[2];
+    int epfd, open_fds = 0, nr_events, i;
+    char chunk[16384];
     bool ret = true;
+    ssize_t nr;
 
-    pid = wait(&status);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1() error");
+        return false;
+    }
+    for (i = 0; i < 2; i++) {
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = i };
 
-    if (pid == -1) {
-        perror("wait() error");
-        ret = false;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &event) == -1) {
+            perror("epoll_ctl() error");
+            close(epfd);
+            return false;
+        }
+        open_fds++;
     }
 
-    if (!WIFEXITED(status)) {
-        fprintf(stderr, "Process %d did not exit properly\n", pid);
-        ret = false;
+    while (open_fds > 0) {
+        nr_events = epoll_wait(epfd, events, 2, -1);
+        if (nr_events == -1 && errno == EINTR) {
+            continue;
+        } else if (nr_events == -1) {
+            perror("epoll_wait() error");
+            ret = false;
+            break;
+        }
+        for (i = 0; i < nr_events; i++) {
+            unsigned int stream = events[i].data.u32;
+
+            nr = read(fds[stream], chunk, sizeof(chunk));
+            if (nr == -1 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+            if (nr <= 0) {
+                if (nr == -1) {
+                    perror("read() error");
+                    ret = false;
+                }
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fds[stream], NULL);
+                open_fds--;
+                continue;
+            }
+            if (!buffer_append(buffers[stream], &capacity[stream], chunk, nr, max_bytes)) {
+                ret = false;
+            }
+        }
     }
 
-    if (WEXITSTATUS(status) != 0) {
-        fprintf(stderr, "Process %d exited with non-zero exit code: %d\n", pid, status);
-        ret = false;
+    close(epfd);
+    return ret;
+}
+
+/**
+ * Copies at most @param max_bytes (0 for no limit) of the memfd @param fd the child wrote to into @param buffer
+ */
+static bool capture_memfd(int fd, struct exec_buffer *buffer, size_t max_bytes)
+{
+    size_t len, capacity = 0;
+    struct stat st;
+    void *data;
+    bool ret;
+
+    if (fstat(fd, &st) == -1) {
+        perror("fstat() error");
+        return false;
+    }
+    len = st.st_size;
+    if (len == 0) {
+        return true;
+    }
+    data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap() error");
+        return false;
     }
+    ret = buffer_append(buffer, &capacity, data, len, max_bytes);
+    munmap(data, len);
+    return ret;
+}
 
+bool do_exec_capture(struct exec_capture *capture, size_t max_bytes, bool use_memfd, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
     va_end(args);
 
+    struct exec_buffer *buffers[2] = { &capture->out, &capture->err };
+    int read_fds[2] = { -1, -1 }, write_fds[2] = { -1, -1 };
+    bool ret = false, captured;
+    pid_t pid;
+
+    memset(capture, 0, sizeof(*capture));
+    capture->status = -1;
+
+    for (i = 0; i < 2; i++) {
+        if (use_memfd) {
+            read_fds[i] = memfd_create(i == 0 ? "stdout" : "stderr", MFD_CLOEXEC);
+            if (read_fds[i] == -1) {
+                perror("memfd_create() error");
+                goto out;
+            }
+            write_fds[i] = read_fds[i];
+        } else {
+            int pipe_fds[2];
+
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                perror("pipe2() error");
+                goto out;
+            }
+            read_fds[i] = pipe_fds[0];
+            write_fds[i] = pipe_fds[1];
+        }
+    }
+
+    if (!spawn_command(command, write_fds[0], write_fds[1], &pid)) {
+        goto out;
+    }
+
+    if (use_memfd) {
+        // The child writes straight into memory, there is nothing to drain until it exits
+        if (!wait_command(pid, &capture->status)) {
+            goto out;
+        }
+        captured = capture_memfd(read_fds[0], &capture->out, max_bytes) &&
+                capture_memfd(read_fds[1], &capture->err, max_bytes);
+    } else {
+        // Only the child may hold the write ends, or the pipes never reach end of file
+        for (i = 0; i < 2; i++) {
+            close(write_fds[i]);
+            write_fds[i] = -1;
+        }
+        captured = capture_pipes(read_fds, buffers, max_bytes);
+        if (!captured) {
+            // A pipe may be left undrained, closing it lets a child blocked on it exit with EPIPE
+            for (i = 0; i < 2; i++) {
+                close(read_fds[i]);
+                read_fds[i] = -1;
+            }
+        }
+        if (!wait_command(pid, &capture->status)) {
+            goto out;
+        }
+    }
+
+    if (!WIFEXITED(capture->status)) {
+        fprintf(stderr, "Process %d did not exit properly\n", pid);
+    } else if (WEXITSTATUS(capture->status) != 0) {
+        fprintf(stderr, "Process %d exited with non-zero exit code: %d\n", pid, WEXITSTATUS(capture->status));
+    } else {
+        ret = captured;
+    }
+
+out:
+    for (i = 0; i < 2; i++) {
+        if (read_fds[i] != -1) {
+            close(read_fds[i]);
+        }
+        if (write_fds[i] != -1 && write_fds[i] != read_fds[i]) {
+            close(write_fds[i]);
+        }
+    }
     return ret;
 }
+
+void exec_capture_free(struct exec_capture *capture)
+{
+    free(capture->out.data);
+    free(capture->err.data);
+    memset(capture, 0, sizeof(*capture));
+}
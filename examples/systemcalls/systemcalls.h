@@ -7,3 +7,58 @@ bool do_system(const char *command);
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * Outcome of one command of do_exec_batch()
+ */
+struct exec_result {
+    // waitpid() status, or -1 if the command could not be launched or reaped
+    int status;
+    // Seconds from launch to reaping
+    double wall_time;
+};
+
+/**
+ * Runs @param nr_commands commands, each a NULL terminated argv vector with an
+ *   absolute path first as for do_exec(), with at most @param max_running alive
+ *   at once, or one per online CPU if it is 0. Exited children are noticed
+ *   through pidfds in an epoll set and reaped with waitpid() on their own pid.
+ * @param results filled in with one entry per command, in the order of @param commands
+ * @return the number of commands that did not exit with status 0, or -1 if the
+ *   batch could not be started at all
+ */
+int do_exec_batch(char *const *const commands[], size_t nr_commands, unsigned int max_running,
+        struct exec_result results[]);
+
+/**
+ * Output of a stream captured by do_exec_capture()
+ */
+struct exec_buffer {
+    // NUL terminated, NULL if the stream had no output
+    char *data;
+    size_t len;
+    // More output was written than the cap allowed
+    bool truncated;
+};
+
+struct exec_capture {
+    struct exec_buffer out;
+    struct exec_buffer err;
+    // waitpid() status, or -1 if the command could not be launched or reaped
+    int status;
+};
+
+/**
+ * Runs a command as do_exec() does and returns its stdout and stderr in memory
+ *   rather than in a file. By default they are read from pipes by an epoll loop
+ *   while the command runs. With @param use_memfd the command writes to memfds
+ *   instead, which are read once it has exited. That avoids a copy through the
+ *   pipes for large outputs, but the command's output is then not limited while
+ *   it runs.
+ * @param capture filled in even on failure, release it with exec_capture_free()
+ * @param max_bytes the most kept of each stream, 0 for no limit
+ * @return true if the command exited with status 0 and its output was captured
+ */
+bool do_exec_capture(struct exec_capture *capture, size_t max_bytes, bool use_memfd, int count, ...);
+
+void exec_capture_free(struct exec_capture *capture);
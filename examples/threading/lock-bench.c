@@ -0,0 +1,201 @@
+/**
+ * Compares pthread mutexes with the adaptive mutex, each with and without
+ * lock_stats, across thread counts and critical section lengths.
+ *
+ * Usage: lock-bench [-n operations] [-r]
+ * Every configuration runs the given number of lock/work/unlock operations
+ * split across its threads, with a little unlocked work between them as a
+ * real caller would have. With -r the contention report of every
+ * profiled run is printed at the end.
+ */
+#define _GNU_SOURCE
+
+#include "lockstat.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Loop iterations done outside the lock between two acquisitions
+#define OUTSIDE_WORK 200
+
+enum lock_kind {
+    LOCK_PTHREAD,
+    LOCK_PTHREAD_STATS,
+    LOCK_ADAPTIVE,
+    LOCK_ADAPTIVE_STATS,
+    NR_LOCK_KINDS,
+};
+
+static const char *lock_names[NR_LOCK_KINDS] = {
+    "pthread", "pthread+stats", "adaptive", "adaptive+stats",
+};
+
+struct bench {
+    enum lock_kind kind;
+    pthread_mutex_t pthread_mutex;
+    struct adaptive_mutex adaptive_mutex;
+    struct lock_stats *stats;
+    unsigned long operations;
+    unsigned int critical_work;
+    // Written only under the lock, checked afterwards to prove exclusion
+    unsigned long counter;
+};
+
+static void work(unsigned int iterations)
+{
+    volatile unsigned int sink = 0;
+    unsigned int i;
+
+    for (i = 0; i < iterations; i++) {
+        sink += i;
+    }
+}
+
+static void *bench_thread(void *arg)
+{
+    struct bench *bench = arg;
+    unsigned long i;
+
+    for (i = 0; i < bench->operations; i++) {
+        switch (bench->kind) {
+            case LOCK_PTHREAD:
+                pthread_mutex_lock(&bench->pthread_mutex);
+                break;
+            case LOCK_PTHREAD_STATS:
+                profiled_mutex_lock(&bench->pthread_mutex, bench->stats);
+                break;
+            default:
+                adaptive_mutex_lock(&bench->adaptive_mutex);
+                break;
+        }
+        bench->counter++;
+        work(bench->critical_work);
+        switch (bench->kind) {
+            case LOCK_PTHREAD:
+                pthread_mutex_unlock(&bench->pthread_mutex);
+                break;
+            case LOCK_PTHREAD_STATS:
+                profiled_mutex_unlock(&bench->pthread_mutex, bench->stats);
+                break;
+            default:
+                adaptive_mutex_unlock(&bench->adaptive_mutex);
+                break;
+        }
+        work(OUTSIDE_WORK);
+    }
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @return operations per second of @param nr_threads threads, or a negative value on failure
+ */
+static double run(enum lock_kind kind, unsigned int nr_threads, unsigned int critical_work,
+        unsigned long operations, bool report)
+{
+    struct bench bench = {
+        .kind = kind,
+        .operations = operations / nr_threads,
+        .critical_work = critical_work,
+    };
+    pthread_t threads[nr_threads];
+    unsigned int i, started;
+    double start, elapsed;
+    char *name = NULL;
+
+    if (kind == LOCK_PTHREAD_STATS || kind == LOCK_ADAPTIVE_STATS) {
+        bench.stats = malloc(sizeof(*bench.stats));
+        if (bench.stats == NULL || asprintf(&name, "%s, %u threads, %u iterations held", lock_names[kind],
+                nr_threads, critical_work) == -1) {
+            free(bench.stats);
+            return -1;
+        }
+        lock_stats_init(bench.stats, name);
+    }
+    pthread_mutex_init(&bench.pthread_mutex, NULL);
+    adaptive_mutex_init(&bench.adaptive_mutex, kind == LOCK_ADAPTIVE_STATS ? bench.stats : NULL);
+
+    start = now();
+    for (started = 0; started < nr_threads; started++) {
+        if (pthread_create(&threads[started], NULL, bench_thread, &bench) != 0) {
+            break;
+        }
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = now() - start;
+
+    pthread_mutex_destroy(&bench.pthread_mutex);
+    adaptive_mutex_destroy(&bench.adaptive_mutex);
+    if (bench.stats != NULL && !report) {
+        lock_stats_destroy(bench.stats);
+        free(bench.stats);
+        free(name);
+    }
+    if (started != nr_threads || bench.counter != bench.operations * nr_threads) {
+        fprintf(stderr, "%s lost updates or threads: %lu of %lu\n", lock_names[kind], bench.counter,
+                bench.operations * nr_threads);
+        return -1;
+    }
+    return bench.counter / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    static const unsigned int thread_counts[] = { 1, 2, 4, 8, 16 };
+    static const unsigned int critical_works[] = { 0, 100, 1000, 10000 };
+    unsigned long operations = 400000;
+    bool report = false;
+    unsigned int t, c, k;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r")) != -1) {
+        switch (opt) {
+            case 'n':
+                operations = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                report = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n operations] [-r]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    printf("%ld online CPUs, %lu operations per run, million operations per second\n",
+            sysconf(_SC_NPROCESSORS_ONLN), operations);
+    printf("%8s %9s", "threads", "held");
+    for (k = 0; k < NR_LOCK_KINDS; k++) {
+        printf(" %15s", lock_names[k]);
+    }
+    printf("\n");
+    for (c = 0; c < sizeof(critical_works) / sizeof(critical_works[0]); c++) {
+        for (t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+            printf("%8u %9u", thread_counts[t], critical_works[c]);
+            for (k = 0; k < NR_LOCK_KINDS; k++) {
+                // Long critical sections need fewer operations to be measured
+                double rate = run(k, thread_counts[t], critical_works[c],
+                        critical_works[c] >= 1000 ? operations / 10 : operations, report);
+
+                printf(" %15.3f", rate / 1e6);
+                fflush(stdout);
+            }
+            printf("\n");
+        }
+    }
+
+    if (report) {
+        lock_stats_report_all(stdout);
+    }
+    return 0;
+}
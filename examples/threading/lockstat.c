@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+
+#include "lockstat.h"
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Upper bound of the adaptive spin limit, in pause iterations
+#define ADAPTIVE_SPIN_MAX 1000
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct lock_stats *registry;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int bucket(uint64_t ns)
+{
+    unsigned int i = ns ? 64 - __builtin_clzll(ns) : 0;
+
+    return i < LOCK_STATS_BUCKETS ? i : LOCK_STATS_BUCKETS - 1;
+}
+
+/**
+ * Records an acquisition that started waiting at @param wait_start_ns
+ */
+static void stats_acquired(struct lock_stats *stats, uint64_t wait_start_ns, bool contended)
+{
+    uint64_t now = now_ns();
+
+    atomic_fetch_add_explicit(&stats->acquisitions, 1, memory_order_relaxed);
+    if (contended) {
+        atomic_fetch_add_explicit(&stats->contended, 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&stats->wait_total_ns, now - wait_start_ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->wait_hist[bucket(now - wait_start_ns)], 1, memory_order_relaxed);
+    stats->acquired_ns = now;
+}
+
+/**
+ * Records the hold time, must be called before the lock is released
+ */
+static void stats_releasing(struct lock_stats *stats)
+{
+    uint64_t held = now_ns() - stats->acquired_ns;
+
+    atomic_fetch_add_explicit(&stats->hold_total_ns, held, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->hold_hist[bucket(held)], 1, memory_order_relaxed);
+}
+
+void lock_stats_init(struct lock_stats *stats, const char *name)
+{
+    unsigned int i;
+
+    stats->name = name;
+    atomic_init(&stats->acquisitions, 0);
+    atomic_init(&stats->contended, 0);
+    atomic_init(&stats->wait_total_ns, 0);
+    atomic_init(&stats->hold_total_ns, 0);
+    for (i = 0; i < LOCK_STATS_BUCKETS; i++) {
+        atomic_init(&stats->wait_hist[i], 0);
+        atomic_init(&stats->hold_hist[i], 0);
+    }
+    stats->acquired_ns = 0;
+
+    pthread_mutex_lock(&registry_mutex);
+    stats->next = registry;
+    registry = stats;
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+void lock_stats_destroy(struct lock_stats *stats)
+{
+    struct lock_stats **link;
+
+    pthread_mutex_lock(&registry_mutex);
+    for (link = &registry; *link != NULL; link = &(*link)->next) {
+        if (*link == stats) {
+            *link = stats->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+/**
+ * @return the upper bound in ns of the bucket holding the @param permille th sample of @param hist
+ */
+static uint64_t percentile(const unsigned long *hist, unsigned long total, unsigned int permille)
+{
+    unsigned long seen = 0, wanted = (total * permille + 999) / 1000;
+    unsigned int i;
+
+    for (i = 0; i < LOCK_STATS_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= wanted && seen > 0) {
+            break;
+        }
+    }
+    return i < LOCK_STATS_BUCKETS - 1 ? (1ULL << i) : UINT64_MAX;
+}
+
+static void print_histogram(FILE *file, const char *title, const unsigned long *hist, unsigned long total,
+        unsigned long long total_ns)
+{
+    unsigned long peak = 0;
+    unsigned int i, first = LOCK_STATS_BUCKETS, last = 0;
+
+    fprintf(file, "  %s: mean %llu ns, p50 < %llu ns, p99 < %llu ns\n", title,
+            total ? total_ns / total : 0,
+            (unsigned long long)percentile(hist, total, 500),
+            (unsigned long long)percentile(hist, total, 990));
+    for (i = 0; i < LOCK_STATS_BUCKETS; i++) {
+        if (hist[i] != 0) {
+            first = first < i ? first : i;
+            last = i;
+            peak = peak > hist[i] ? peak : hist[i];
+        }
+    }
+    for (i = first; i <= last && first < LOCK_STATS_BUCKETS; i++) {
+        fprintf(file, "    < %12llu ns %10lu %.*s\n", 1ULL << i, hist[i],
+                (int)(hist[i] * 40 / peak), "########################################");
+    }
+}
+
+void lock_stats_report(FILE *file, struct lock_stats *stats)
+{
+    unsigned long wait_hist[LOCK_STATS_BUCKETS], hold_hist[LOCK_STATS_BUCKETS];
+    unsigned long acquisitions = atomic_load(&stats->acquisitions);
+    unsigned long contended = atomic_load(&stats->contended);
+    unsigned int i;
+
+    for (i = 0; i < LOCK_STATS_BUCKETS; i++) {
+        wait_hist[i] = atomic_load(&stats->wait_hist[i]);
+        hold_hist[i] = atomic_load(&stats->hold_hist[i]);
+    }
+    fprintf(file, "%s: %lu acquisitions, %lu contended (%.1f%%), waited %.3f ms, held %.3f ms\n",
+            stats->name, acquisitions, contended, acquisitions ? 100.0 * contended / acquisitions : 0,
+            atomic_load(&stats->wait_total_ns) / 1e6, atomic_load(&stats->hold_total_ns) / 1e6);
+    print_histogram(file, "wait", wait_hist, acquisitions, atomic_load(&stats->wait_total_ns));
+    print_histogram(file, "hold", hold_hist, acquisitions, atomic_load(&stats->hold_total_ns));
+}
+
+static int compare_wait(const void *a, const void *b)
+{
+    unsigned long long wait_a = atomic_load(&(*(struct lock_stats *const *)a)->wait_total_ns);
+    unsigned long long wait_b = atomic_load(&(*(struct lock_stats *const *)b)->wait_total_ns);
+
+    return wait_a < wait_b ? 1 : wait_a > wait_b ? -1 : 0;
+}
+
+void lock_stats_report_all(FILE *file)
+{
+    struct lock_stats *stats, **sorted;
+    size_t nr_stats = 0, i;
+
+    pthread_mutex_lock(&registry_mutex);
+    for (stats = registry; stats != NULL; stats = stats->next) {
+        nr_stats++;
+    }
+    sorted = malloc(nr_stats * sizeof(*sorted));
+    if (sorted == NULL) {
+        // Unsorted is better than nothing
+        for (stats = registry; stats != NULL; stats = stats->next) {
+            lock_stats_report(file, stats);
+        }
+        pthread_mutex_unlock(&registry_mutex);
+        return;
+    }
+    for (stats = registry, i = 0; stats != NULL; stats = stats->next) {
+        sorted[i++] = stats;
+    }
+    qsort(sorted, nr_stats, sizeof(*sorted), compare_wait);
+    for (i = 0; i < nr_stats; i++) {
+        lock_stats_report(file, sorted[i]);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    free(sorted);
+}
+
+int profiled_mutex_lock(pthread_mutex_t *mutex, struct lock_stats *stats)
+{
+    uint64_t start = now_ns();
+    bool contended = false;
+    int rc;
+
+    rc = pthread_mutex_trylock(mutex);
+    if (rc == EBUSY) {
+        contended = true;
+        rc = pthread_mutex_lock(mutex);
+    }
+    if (rc == 0) {
+        stats_acquired(stats, start, contended);
+    }
+    return rc;
+}
+
+int profiled_mutex_unlock(pthread_mutex_t *mutex, struct lock_stats *stats)
+{
+    stats_releasing(stats);
+    return pthread_mutex_unlock(mutex);
+}
+
+static void futex_wait(atomic_int *word, int value)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_int *word, int count)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#else
+    atomic_signal_fence(memory_order_seq_cst);
+#endif
+}
+
+int adaptive_mutex_init(struct adaptive_mutex *mutex, struct lock_stats *stats)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    atomic_init(&mutex->state, 0);
+    atomic_init(&mutex->spin_average, 0);
+    // Spinning on one CPU only delays the holder
+    mutex->spin_max = cpus > 1 ? ADAPTIVE_SPIN_MAX : 0;
+    mutex->stats = stats;
+    return 0;
+}
+
+int adaptive_mutex_destroy(struct adaptive_mutex *mutex)
+{
+    return atomic_load(&mutex->state) == 0 ? 0 : EBUSY;
+}
+
+int adaptive_mutex_trylock(struct adaptive_mutex *mutex)
+{
+    int unlocked = 0;
+    uint64_t start = mutex->stats ? now_ns() : 0;
+
+    if (!atomic_compare_exchange_strong_explicit(&mutex->state, &unlocked, 1,
+            memory_order_acquire, memory_order_relaxed)) {
+        return EBUSY;
+    }
+    if (mutex->stats != NULL) {
+        stats_acquired(mutex->stats, start, false);
+    }
+    return 0;
+}
+
+int adaptive_mutex_lock(struct adaptive_mutex *mutex)
+{
+    uint64_t start = mutex->stats ? now_ns() : 0;
+    int state = 0, spin_limit, average, spins;
+
+    if (atomic_compare_exchange_strong_explicit(&mutex->state, &state, 1,
+            memory_order_acquire, memory_order_relaxed)) {
+        if (mutex->stats != NULL) {
+            stats_acquired(mutex->stats, start, false);
+        }
+        return 0;
+    }
+
+    // Spin a little longer than recent acquisitions needed, in case the holder is about to leave
+    average = atomic_load_explicit(&mutex->spin_average, memory_order_relaxed);
+    spin_limit = average * 2 + 10;
+    if (spin_limit > mutex->spin_max) {
+        spin_limit = mutex->spin_max;
+    }
+    for (spins = 0; spins < spin_limit; spins++) {
+        cpu_relax();
+        state = atomic_load_explicit(&mutex->state, memory_order_relaxed);
+        if (state == 0 && atomic_compare_exchange_weak_explicit(&mutex->state, &state, 1,
+                memory_order_acquire, memory_order_relaxed)) {
+            break;
+        }
+    }
+    if (spin_limit > 0) {
+        atomic_store_explicit(&mutex->spin_average, average + (spins - average) / 8, memory_order_relaxed);
+    }
+
+    if (spins == spin_limit) {
+        // Park, marking the lock as having waiters so the unlock wakes one of them
+        state = atomic_exchange_explicit(&mutex->state, 2, memory_order_acquire);
+        while (state != 0) {
+            futex_wait(&mutex->state, 2);
+            state = atomic_exchange_explicit(&mutex->state, 2, memory_order_acquire);
+        }
+    }
+
+    if (mutex->stats != NULL) {
+        stats_acquired(mutex->stats, start, true);
+    }
+    return 0;
+}
+
+int adaptive_mutex_unlock(struct adaptive_mutex *mutex)
+{
+    if (mutex->stats != NULL) {
+        stats_releasing(mutex->stats);
+    }
+    if (atomic_fetch_sub_explicit(&mutex->state, 1, memory_order_release) != 1) {
+        atomic_store_explicit(&mutex->state, 0, memory_order_release);
+        futex_wake(&mutex->state, 1);
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+/**
+ * @file lockstat.h
+ * @brief Lock wait and hold time instrumentation, and an adaptive spin-then-park mutex
+ */
+
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Bucket i of a histogram counts times below 2^i ns, the last one everything longer
+#define LOCK_STATS_BUCKETS 40
+
+/**
+ * Statistics of one lock. Wait time runs from asking for the lock to getting it,
+ * hold time from getting it to releasing it.
+ */
+struct lock_stats {
+    const char *name;
+    atomic_ulong acquisitions;
+    // Acquisitions that found the lock taken
+    atomic_ulong contended;
+    atomic_ullong wait_total_ns;
+    atomic_ullong hold_total_ns;
+    atomic_ulong wait_hist[LOCK_STATS_BUCKETS];
+    atomic_ulong hold_hist[LOCK_STATS_BUCKETS];
+    // Only written by the current holder, under the lock
+    uint64_t acquired_ns;
+    struct lock_stats *next;
+};
+
+/**
+ * A mutex that spins for a while on contention before it parks the thread on a futex.
+ * The spin limit adapts to how long recent acquisitions had to spin, as glibc's
+ * PTHREAD_MUTEX_ADAPTIVE_NP does, and is 0 on a single CPU.
+ */
+struct adaptive_mutex {
+    // 0 unlocked, 1 locked, 2 locked with threads parked
+    atomic_int state;
+    atomic_int spin_average;
+    int spin_max;
+    struct lock_stats *stats;
+};
+
+/**
+ * Initializes @param stats named @param name, which must outlive it, and adds it to
+ * the locks reported by lock_stats_report_all()
+ */
+void lock_stats_init(struct lock_stats *stats, const char *name);
+
+/**
+ * Removes @param stats from the locks reported by lock_stats_report_all()
+ */
+void lock_stats_destroy(struct lock_stats *stats);
+
+/**
+ * Prints acquisitions, contention and wait and hold time percentiles and histograms of @param stats
+ */
+void lock_stats_report(FILE *file, struct lock_stats *stats);
+
+/**
+ * Prints lock_stats_report() of every initialized lock, most total wait time first
+ */
+void lock_stats_report_all(FILE *file);
+
+/**
+ * pthread_mutex_lock() of @param mutex recording into @param stats
+ */
+int profiled_mutex_lock(pthread_mutex_t *mutex, struct lock_stats *stats);
+
+/**
+ * pthread_mutex_unlock() of @param mutex recording into @param stats
+ */
+int profiled_mutex_unlock(pthread_mutex_t *mutex, struct lock_stats *stats);
+
+/**
+ * The adaptive mutex calls mirror pthread_mutex_*() and return 0 on success
+ * @param stats if not NULL records every acquisition of @param mutex
+ */
+int adaptive_mutex_init(struct adaptive_mutex *mutex, struct lock_stats *stats);
+
+int adaptive_mutex_destroy(struct adaptive_mutex *mutex);
+
+int adaptive_mutex_lock(struct adaptive_mutex *mutex);
+
+int adaptive_mutex_trylock(struct adaptive_mutex *mutex);
+
+int adaptive_mutex_unlock(struct adaptive_mutex *mutex);
+
+#endif /* LOCKSTAT_H */
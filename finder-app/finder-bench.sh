@@ -0,0 +1,74 @@
+#!/bin/sh
+# Compares the native finder with finder.sh on a generated tree
+# Usage: finder-bench.sh [numfiles] [files per directory] [benchdir]
+#
+# finder.sh is expected to fail with "Argument list too long" once the file
+# names no longer fit on one grep command line; the time it took to get
+# there is still reported.
+
+set -e
+set -u
+
+NUMFILES=${1:-1000000}
+PERDIR=${2:-1000}
+BENCHDIR=${3:-/tmp/aeld-finder-bench}
+WRITESTR=AELD_IS_FUN
+SCRIPTDIR=$(dirname "$0")
+
+if [ ! -x "${SCRIPTDIR}/finder" ]
+then
+	echo "Build the native finder first with make -C ${SCRIPTDIR}"
+	exit 1
+fi
+
+echo "Writing ${NUMFILES} files in directories of ${PERDIR} to ${BENCHDIR}"
+rm -rf "${BENCHDIR}"
+mkdir -p "${BENCHDIR}"
+# One awk process instead of a writer per file, every third file matches
+awk -v n="${NUMFILES}" -v perdir="${PERDIR}" -v dir="${BENCHDIR}" -v str="${WRITESTR}" 'BEGIN {
+	for (i = 0; i < n; i++) {
+		if (i % perdir == 0) {
+			d = sprintf("%s/d%d", dir, i / perdir)
+			system("mkdir -p " d)
+		}
+		f = sprintf("%s/f%d.txt", d, i)
+		printf "line %d\n%s\n", i, (i % 3 == 0 ? str : "nothing here") > f
+		close(f)
+	}
+}'
+EXPECTED="The number of files are ${NUMFILES} and the number of matching lines are $(( (NUMFILES + 2) / 3 ))"
+
+now() {
+	date +%s.%N
+}
+
+run() {
+	name=$1
+	shift
+	sync
+	start=$(now)
+	if output=$("$@" 2>&1)
+	then
+		status=ok
+	else
+		status=failed
+	fi
+	end=$(now)
+	elapsed=$(awk -v s="${start}" -v e="${end}" 'BEGIN { print e - s }')
+	if [ "${output}" = "${EXPECTED}" ]
+	then
+		result=correct
+	else
+		result="wrong: $(echo "${output}" | tail -n 1)"
+	fi
+	printf "%-22s %10.3f s  %s, %s\n" "${name}" "${elapsed}" "${status}" "${result}"
+}
+
+run "finder.sh" sh "${SCRIPTDIR}/finder.sh" "${BENCHDIR}" "${WRITESTR}"
+run "finder -j 1" "${SCRIPTDIR}/finder" -j 1 "${BENCHDIR}" "${WRITESTR}"
+run "finder" "${SCRIPTDIR}/finder" "${BENCHDIR}" "${WRITESTR}"
+# The first indexed run builds the index, the second only stats the files
+run "finder -i, building" "${SCRIPTDIR}/finder" -i "${BENCHDIR}.idx" "${BENCHDIR}" "${WRITESTR}"
+run "finder -i, cached" "${SCRIPTDIR}/finder" -i "${BENCHDIR}.idx" "${BENCHDIR}" "${WRITESTR}"
+
+rm -rf "${BENCHDIR}" "${BENCHDIR}.idx"
@@ -0,0 +1,752 @@
+/**
+ * @file finder-index.c
+ * @brief Persistent trigram index for repeated finder queries
+ *
+ * The index file lists every regular file of the tree with its mtime and
+ * size, sorted by path, and for every trigram (three consecutive bytes not
+ * containing a newline) the files it occurs in.  A query only reads the
+ * files holding all trigrams of the text, so a search over an unchanged tree
+ * costs the walk's stat() calls plus reading the files that really match.
+ *
+ * Before each query the walked files are compared with the index by path,
+ * mtime and size.  If anything changed a new index is written, reusing the
+ * postings of unchanged files and reading only new or modified ones, and
+ * renamed over the old one.
+ *
+ * Layout, in native byte order so the file can be used straight from mmap():
+ *   struct index_header
+ *   struct index_file[nr_files], sorted by path
+ *   paths, each NUL terminated, padded to 8 bytes
+ *   struct index_trigram[nr_trigrams], sorted by trigram
+ *   postings, for each trigram the increasing file numbers holding it as
+ *   LEB128 deltas
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "finder.h"
+
+#define INDEX_MAGIC "FNDIDX01"
+#define INDEX_FILE_BINARY 0x1
+#define NR_TRIGRAMS (1u << 24)
+#define NO_FILE UINT32_MAX
+
+struct index_header {
+    char magic[8];
+    uint32_t nr_files;
+    uint32_t nr_trigrams;
+    uint64_t paths_offset;
+    uint64_t trigrams_offset;
+    uint64_t postings_offset;
+    // Size of the whole index file, so a truncated one is rejected
+    uint64_t size;
+};
+
+struct index_file {
+    uint64_t mtime_ns;
+    uint64_t size;
+    uint64_t path_offset;
+    uint32_t path_len;
+    // INDEX_FILE_BINARY if the file has a NUL byte and never matches
+    uint32_t flags;
+};
+
+struct index_trigram {
+    uint32_t trigram;
+    uint32_t count;
+    // Of the first posting, relative to postings_offset
+    uint64_t offset;
+};
+
+struct index_map {
+    const char *base;
+    size_t size;
+    const struct index_header *header;
+    const struct index_file *files;
+    const char *paths;
+    const struct index_trigram *trigrams;
+    const uint8_t *postings;
+    const uint8_t *postings_end;
+};
+
+struct pairs {
+    // trigram << 32 | file number
+    uint64_t *pairs;
+    size_t nr, capacity;
+};
+
+struct thread_pool_work {
+    void (*fn)(struct thread_pool_work *work, unsigned int thread);
+    unsigned int nr_threads;
+    atomic_size_t next;
+};
+
+struct build_work {
+    struct thread_pool_work pool;
+    const struct finder_file *files;
+    const uint32_t *todo;
+    size_t nr_todo;
+    uint32_t *flags;
+    struct pairs *pairs;
+    bool failed;
+};
+
+struct build_thread {
+    uint8_t *seen;
+    uint32_t *touched;
+    size_t nr_touched, touched_capacity;
+    bool binary;
+    bool failed;
+};
+
+struct search_work {
+    struct thread_pool_work pool;
+    const struct finder_file *files;
+    const uint32_t *candidates;
+    size_t nr_candidates;
+    const char *needle;
+    size_t needle_len;
+    atomic_ulong lines;
+};
+
+struct thread_pool_start {
+    struct thread_pool_work *work;
+    unsigned int thread;
+};
+
+static void *pool_thread(void *arg)
+{
+    struct thread_pool_start *start = arg;
+
+    start->work->fn(start->work, start->thread);
+    return NULL;
+}
+
+/**
+ * Runs @param work->fn on @param work->nr_threads threads including the caller, each taking items
+ * off @param work->next until they run out
+ */
+static void thread_pool_run(struct thread_pool_work *work)
+{
+    struct thread_pool_start start[work->nr_threads];
+    pthread_t threads[work->nr_threads];
+    unsigned int i, started;
+
+    atomic_init(&work->next, 0);
+    for (started = 1; started < work->nr_threads; started++) {
+        start[started].work = work;
+        start[started].thread = started;
+        if (pthread_create(&threads[started], NULL, pool_thread, &start[started]) != 0) {
+            break;
+        }
+    }
+    work->fn(work, 0);
+    for (i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static bool pairs_push(struct pairs *pairs, uint32_t trigram, uint32_t file)
+{
+    uint64_t *grown;
+
+    if (pairs->nr == pairs->capacity) {
+        pairs->capacity = pairs->capacity ? 2 * pairs->capacity : 4096;
+        grown = realloc(pairs->pairs, pairs->capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return false;
+        }
+        pairs->pairs = grown;
+    }
+    pairs->pairs[pairs->nr++] = (uint64_t)trigram << 32 | file;
+    return true;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int compare_trigram(const void *key, const void *entry)
+{
+    uint32_t x = *(const uint32_t *)key, y = ((const struct index_trigram *)entry)->trigram;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Decodes the postings of @param trigram into @param files.
+ * @return false if they are not increasing file numbers ending where the next trigram's start
+ */
+static bool index_postings(const struct index_map *map, const struct index_trigram *trigram, uint32_t *files)
+{
+    const uint8_t *p = map->postings + trigram->offset, *end = map->postings_end;
+    uint64_t value, file = 0;
+    uint32_t n;
+    int shift;
+
+    if (trigram->offset > (size_t)(map->postings_end - map->postings)) {
+        return false;
+    }
+    if (trigram + 1 < map->trigrams + map->header->nr_trigrams) {
+        if (trigram[1].offset < trigram->offset || trigram[1].offset > (size_t)(end - map->postings)) {
+            return false;
+        }
+        end = map->postings + trigram[1].offset;
+    }
+    for (n = 0; n < trigram->count; n++) {
+        value = 0;
+        shift = 0;
+        do {
+            if (p == end || shift > 35) {
+                return false;
+            }
+            value |= (uint64_t)(*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+        if (n > 0 && value == 0) {
+            return false;
+        }
+        file += value;
+        if (file >= map->header->nr_files) {
+            return false;
+        }
+        files[n] = file;
+    }
+    return p == end;
+}
+
+static void index_close(struct index_map *map)
+{
+    if (map->base != NULL) {
+        munmap((void *)map->base, map->size);
+        map->base = NULL;
+    }
+}
+
+/**
+ * Maps the index at @param path into @param map and checks that it is consistent.
+ * @return 0 on success, -1 if there is no usable index
+ */
+static int index_open(const char *path, struct index_map *map)
+{
+    const struct index_header *header;
+    struct stat st;
+    uint32_t n;
+    int fd;
+
+    memset(map, 0, sizeof(*map));
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*header)) {
+        close(fd);
+        return -1;
+    }
+    map->base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map->base == MAP_FAILED) {
+        map->base = NULL;
+        return -1;
+    }
+    map->size = st.st_size;
+
+    header = (const struct index_header *)map->base;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 || header->size != map->size ||
+            header->paths_offset != sizeof(*header) + (uint64_t)header->nr_files * sizeof(struct index_file) ||
+            header->trigrams_offset < header->paths_offset || header->trigrams_offset % 8 != 0 ||
+            header->postings_offset != header->trigrams_offset +
+                (uint64_t)header->nr_trigrams * sizeof(struct index_trigram) ||
+            header->postings_offset > map->size) {
+        goto invalid;
+    }
+    map->header = header;
+    map->files = (const struct index_file *)(map->base + sizeof(*header));
+    map->paths = map->base + header->paths_offset;
+    map->trigrams = (const struct index_trigram *)(map->base + header->trigrams_offset);
+    map->postings = (const uint8_t *)map->base + header->postings_offset;
+    map->postings_end = (const uint8_t *)map->base + map->size;
+
+    for (n = 0; n < header->nr_files; n++) {
+        if (map->files[n].path_offset + map->files[n].path_len >= header->trigrams_offset - header->paths_offset ||
+                map->paths[map->files[n].path_offset + map->files[n].path_len] != '\0') {
+            goto invalid;
+        }
+    }
+    return 0;
+
+invalid:
+    fprintf(stderr, "Ignoring invalid index %s\n", path);
+    index_close(map);
+    return -1;
+}
+
+static void add_trigrams(const char *data, size_t size, void *arg)
+{
+    struct build_thread *thread = arg;
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t trigram, *grown;
+    size_t i;
+
+    if (finder_has_nul(data, size)) {
+        thread->binary = true;
+        return;
+    }
+    for (i = 0; i + 3 <= size; i++) {
+        if (p[i] == '\n' || p[i + 1] == '\n' || p[i + 2] == '\n') {
+            continue;
+        }
+        trigram = (uint32_t)p[i] << 16 | p[i + 1] << 8 | p[i + 2];
+        if (thread->seen[trigram / 8] & (1 << trigram % 8)) {
+            continue;
+        }
+        if (thread->nr_touched == thread->touched_capacity) {
+            thread->touched_capacity = thread->touched_capacity ? 2 * thread->touched_capacity : 4096;
+            grown = realloc(thread->touched, thread->touched_capacity * sizeof(*grown));
+            if (grown == NULL) {
+                thread->failed = true;
+                return;
+            }
+            thread->touched = grown;
+        }
+        thread->seen[trigram / 8] |= 1 << trigram % 8;
+        thread->touched[thread->nr_touched++] = trigram;
+    }
+}
+
+/**
+ * Reads the new and modified files and adds their trigrams to the pairs of the thread
+ */
+static void build_files(struct thread_pool_work *pool, unsigned int n)
+{
+    struct build_work *work = (struct build_work *)pool;
+    struct build_thread thread = {};
+    char *buffer = malloc(FINDER_READ_MAX);
+    size_t item, i;
+    uint32_t file;
+
+    thread.seen = calloc(NR_TRIGRAMS / 8, 1);
+    if (buffer == NULL || thread.seen == NULL) {
+        work->failed = true;
+        goto out;
+    }
+    while ((item = atomic_fetch_add(&pool->next, 1)) < work->nr_todo) {
+        file = work->todo[item];
+        thread.binary = false;
+        thread.nr_touched = 0;
+        if (finder_with_file(work->files[file].path, buffer, add_trigrams, &thread) != 0) {
+            // Unreadable files are indexed without trigrams and never searched
+            work->flags[file] |= INDEX_FILE_BINARY;
+        }
+        if (thread.binary) {
+            work->flags[file] |= INDEX_FILE_BINARY;
+        }
+        for (i = 0; i < thread.nr_touched; i++) {
+            thread.seen[thread.touched[i] / 8] = 0;
+            if (!thread.failed && !pairs_push(&work->pairs[n], thread.touched[i], file)) {
+                thread.failed = true;
+            }
+        }
+        if (thread.failed) {
+            work->failed = true;
+            break;
+        }
+    }
+
+out:
+    free(thread.touched);
+    free(thread.seen);
+    free(buffer);
+}
+
+static void put_varint(uint8_t *out, size_t *len, uint64_t value)
+{
+    while (value >= 0x80) {
+        out[(*len)++] = value | 0x80;
+        value >>= 7;
+    }
+    out[(*len)++] = value;
+}
+
+static bool write_all(FILE *out, const void *data, size_t size)
+{
+    return size == 0 || fwrite(data, size, 1, out) == 1;
+}
+
+/**
+ * Writes the index for @param files, given the sorted trigram and file number pairs of all of them,
+ * to @param path through a temporary file renamed over it
+ */
+static int index_write(const char *path, const struct finder_file *files, size_t nr_files, const uint32_t *flags,
+            const uint64_t *pairs, size_t nr_pairs)
+{
+    struct index_header header = {};
+    struct index_trigram *trigrams = NULL;
+    struct index_file entry;
+    uint8_t *postings = NULL;
+    size_t nr_trigrams = 0, postings_len = 0, paths_len = 0, i, len;
+    static const char padding[8];
+    uint32_t trigram, previous = 0;
+    char *tmp_path = NULL;
+    FILE *out = NULL;
+    int rc = -1;
+
+    for (i = 0; i < nr_pairs; i++) {
+        if (i == 0 || pairs[i] >> 32 != pairs[i - 1] >> 32) {
+            nr_trigrams++;
+        }
+    }
+    trigrams = malloc((nr_trigrams ? nr_trigrams : 1) * sizeof(*trigrams));
+    // A LEB128 value of a 32 bit number takes at most 5 bytes
+    postings = malloc(nr_pairs ? 5 * nr_pairs : 1);
+    if (trigrams == NULL || postings == NULL) {
+        fprintf(stderr, "Out of memory writing index\n");
+        goto out;
+    }
+    for (i = 0, nr_trigrams = 0; i < nr_pairs; i++) {
+        trigram = pairs[i] >> 32;
+        if (i == 0 || trigram != pairs[i - 1] >> 32) {
+            trigrams[nr_trigrams++] = (struct index_trigram){ .trigram = trigram, .offset = postings_len };
+            previous = 0;
+        }
+        trigrams[nr_trigrams - 1].count++;
+        put_varint(postings, &postings_len, (uint32_t)pairs[i] - previous);
+        previous = (uint32_t)pairs[i];
+    }
+
+    for (i = 0; i < nr_files; i++) {
+        paths_len += strlen(files[i].path) + 1;
+    }
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.nr_files = nr_files;
+    header.nr_trigrams = nr_trigrams;
+    header.paths_offset = sizeof(header) + nr_files * sizeof(struct index_file);
+    header.trigrams_offset = (header.paths_offset + paths_len + 7) & ~7ull;
+    header.postings_offset = header.trigrams_offset + nr_trigrams * sizeof(struct index_trigram);
+    header.size = header.postings_offset + postings_len;
+
+    if (asprintf(&tmp_path, "%s.tmp", path) == -1) {
+        tmp_path = NULL;
+        goto out;
+    }
+    out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error creating %s: %s\n", tmp_path, strerror(errno));
+        goto out;
+    }
+    if (!write_all(out, &header, sizeof(header))) {
+        goto out_write;
+    }
+    for (i = 0, paths_len = 0; i < nr_files; i++) {
+        len = strlen(files[i].path);
+        entry = (struct index_file){
+            .mtime_ns = files[i].mtime_ns,
+            .size = files[i].size,
+            .path_offset = paths_len,
+            .path_len = len,
+            .flags = flags[i],
+        };
+        if (!write_all(out, &entry, sizeof(entry))) {
+            goto out_write;
+        }
+        paths_len += len + 1;
+    }
+    for (i = 0; i < nr_files; i++) {
+        if (!write_all(out, files[i].path, strlen(files[i].path) + 1)) {
+            goto out_write;
+        }
+    }
+    if (!write_all(out, padding, header.trigrams_offset - header.paths_offset - paths_len) ||
+            !write_all(out, trigrams, nr_trigrams * sizeof(*trigrams)) ||
+            !write_all(out, postings, postings_len) || fflush(out) != 0) {
+        goto out_write;
+    }
+    if (fclose(out) != 0) {
+        out = NULL;
+        goto out_write;
+    }
+    out = NULL;
+    if (rename(tmp_path, path) == -1) {
+        fprintf(stderr, "Error renaming %s to %s: %s\n", tmp_path, path, strerror(errno));
+        unlink(tmp_path);
+        goto out;
+    }
+    rc = 0;
+    goto out;
+
+out_write:
+    fprintf(stderr, "Error writing %s: %s\n", tmp_path, strerror(errno));
+    unlink(tmp_path);
+out:
+    if (out != NULL) {
+        fclose(out);
+    }
+    free(tmp_path);
+    free(postings);
+    free(trigrams);
+    return rc;
+}
+
+/**
+ * Brings the index at @param path up to date with @param files, sorted by path, and maps it
+ * into @param map.  Only new and modified files are read.
+ * @return 0 on success, -1 on failure
+ */
+static int index_update(const char *path, const struct finder_file *files, size_t nr_files,
+            unsigned int nr_threads, struct index_map *map)
+{
+    struct index_map old;
+    struct build_work work = { .pool = { .fn = build_files, .nr_threads = nr_threads }, .files = files };
+    uint32_t *old_to_new = NULL, *todo = NULL, *postings = NULL, *flags = NULL, old_nr_files = 0;
+    struct pairs all = {};
+    size_t i, j, n, nr_todo = 0;
+    unsigned int t;
+    int cmp, rc = -1;
+
+    if (index_open(path, &old) == 0) {
+        old_nr_files = old.header->nr_files;
+    }
+    old_to_new = malloc((old_nr_files ? old_nr_files : 1) * sizeof(*old_to_new));
+    todo = malloc((nr_files ? nr_files : 1) * sizeof(*todo));
+    flags = calloc(nr_files ? nr_files : 1, sizeof(*flags));
+    work.pairs = calloc(nr_threads, sizeof(*work.pairs));
+    if (old_to_new == NULL || todo == NULL || flags == NULL || work.pairs == NULL) {
+        fprintf(stderr, "Out of memory updating index\n");
+        goto out;
+    }
+
+    // Both lists are sorted by path, so unchanged files are found in one merge
+    for (i = 0, j = 0; i < nr_files || j < old_nr_files;) {
+        cmp = i == nr_files ? 1 : j == old_nr_files ? -1 :
+            strcmp(files[i].path, old.paths + old.files[j].path_offset);
+        if (cmp > 0) {
+            old_to_new[j++] = NO_FILE;
+        } else if (cmp < 0) {
+            todo[nr_todo++] = i++;
+        } else if (files[i].mtime_ns != old.files[j].mtime_ns || files[i].size != old.files[j].size) {
+            old_to_new[j++] = NO_FILE;
+            todo[nr_todo++] = i++;
+        } else {
+            flags[i] = old.files[j].flags;
+            old_to_new[j++] = i++;
+        }
+    }
+    if (nr_todo == 0 && nr_files == old_nr_files) {
+        *map = old;
+        old.base = NULL;
+        rc = 0;
+        goto out;
+    }
+
+    // Postings of unchanged files carry over with their new numbers, which keep their order
+    if (old_nr_files > 0) {
+        postings = malloc(old_nr_files * sizeof(*postings));
+        if (postings == NULL) {
+            fprintf(stderr, "Out of memory updating index\n");
+            goto out;
+        }
+        for (i = 0; i < old.header->nr_trigrams; i++) {
+            if (old.trigrams[i].count > old_nr_files || !index_postings(&old, &old.trigrams[i], postings)) {
+                // Reusing the rest would miss files, so index everything again
+                fprintf(stderr, "Rebuilding index %s with corrupt postings\n", path);
+                work.pairs[0].nr = 0;
+                for (nr_todo = 0; nr_todo < nr_files; nr_todo++) {
+                    todo[nr_todo] = nr_todo;
+                    flags[nr_todo] = 0;
+                }
+                break;
+            }
+            for (n = 0; n < old.trigrams[i].count; n++) {
+                if (old_to_new[postings[n]] != NO_FILE &&
+                        !pairs_push(&work.pairs[0], old.trigrams[i].trigram, old_to_new[postings[n]])) {
+                    fprintf(stderr, "Out of memory updating index\n");
+                    goto out;
+                }
+            }
+        }
+    }
+
+    work.todo = todo;
+    work.nr_todo = nr_todo;
+    work.flags = flags;
+    thread_pool_run(&work.pool);
+    if (work.failed) {
+        fprintf(stderr, "Out of memory indexing files\n");
+        goto out;
+    }
+
+    for (t = 0; t < nr_threads; t++) {
+        for (n = 0; n < work.pairs[t].nr; n++) {
+            if (!pairs_push(&all, work.pairs[t].pairs[n] >> 32, (uint32_t)work.pairs[t].pairs[n])) {
+                fprintf(stderr, "Out of memory updating index\n");
+                goto out;
+            }
+        }
+        free(work.pairs[t].pairs);
+        work.pairs[t] = (struct pairs){};
+    }
+    qsort(all.pairs, all.nr, sizeof(*all.pairs), compare_u64);
+
+    index_close(&old);
+    if (index_write(path, files, nr_files, flags, all.pairs, all.nr) != 0 || index_open(path, map) != 0) {
+        goto out;
+    }
+    rc = 0;
+
+out:
+    if (work.pairs != NULL) {
+        for (t = 0; t < nr_threads; t++) {
+            free(work.pairs[t].pairs);
+        }
+    }
+    free(work.pairs);
+    free(all.pairs);
+    free(postings);
+    free(flags);
+    free(todo);
+    free(old_to_new);
+    index_close(&old);
+    return rc;
+}
+
+static void count_candidate_lines(const char *data, size_t size, void *arg)
+{
+    struct search_work *work = arg;
+
+    atomic_fetch_add(&work->lines, finder_count_lines(data, size, work->needle, work->needle_len));
+}
+
+static void search_candidates(struct thread_pool_work *pool, unsigned int thread)
+{
+    struct search_work *work = (struct search_work *)pool;
+    char *buffer = malloc(FINDER_READ_MAX);
+    size_t item;
+
+    // Candidates are shared through pool->next, no thread has a part of its own
+    (void)thread;
+    if (buffer == NULL) {
+        return;
+    }
+    while ((item = atomic_fetch_add(&pool->next, 1)) < work->nr_candidates) {
+        finder_with_file(work->files[work->candidates[item]].path, buffer, count_candidate_lines, work);
+    }
+    free(buffer);
+}
+
+/**
+ * Stores in @param candidates the files holding every trigram of @param needle.
+ * @return the number of candidates
+ */
+static size_t index_candidates(const struct index_map *map, const char *needle, size_t needle_len,
+            uint32_t *candidates)
+{
+    const struct index_trigram *trigram, *rarest = NULL;
+    uint32_t key, *postings = NULL, nr_files = map->header->nr_files;
+    size_t nr_candidates = 0, i, j, k, n;
+
+    if (needle_len < 3) {
+        goto all_files;
+    }
+
+    // Start from the rarest trigram and narrow it down with the others
+    for (i = 0; i + 3 <= needle_len; i++) {
+        key = (uint32_t)(uint8_t)needle[i] << 16 | (uint8_t)needle[i + 1] << 8 | (uint8_t)needle[i + 2];
+        trigram = bsearch(&key, map->trigrams, map->header->nr_trigrams, sizeof(*trigram), compare_trigram);
+        if (trigram == NULL || trigram->count > nr_files) {
+            return 0;
+        }
+        if (rarest == NULL || trigram->count < rarest->count) {
+            rarest = trigram;
+        }
+    }
+    if (!index_postings(map, rarest, candidates)) {
+        goto all_files;
+    }
+    nr_candidates = rarest->count;
+
+    postings = malloc((nr_files ? nr_files : 1) * sizeof(*postings));
+    if (postings == NULL) {
+        fprintf(stderr, "Out of memory searching index\n");
+        return 0;
+    }
+    for (i = 0; i + 3 <= needle_len && nr_candidates > 0; i++) {
+        key = (uint32_t)(uint8_t)needle[i] << 16 | (uint8_t)needle[i + 1] << 8 | (uint8_t)needle[i + 2];
+        trigram = bsearch(&key, map->trigrams, map->header->nr_trigrams, sizeof(*trigram), compare_trigram);
+        if (trigram == rarest || !index_postings(map, trigram, postings)) {
+            continue;
+        }
+        for (j = 0, k = 0, n = 0; j < nr_candidates && k < trigram->count;) {
+            if (candidates[j] < postings[k]) {
+                j++;
+            } else if (candidates[j] > postings[k]) {
+                k++;
+            } else {
+                candidates[n++] = candidates[j++];
+                k++;
+            }
+        }
+        nr_candidates = n;
+    }
+    free(postings);
+    return nr_candidates;
+
+all_files:
+    // Short texts and corrupt postings leave only the binary files out
+    for (i = 0, nr_candidates = 0; i < nr_files; i++) {
+        if (!(map->files[i].flags & INDEX_FILE_BINARY)) {
+            candidates[nr_candidates++] = i;
+        }
+    }
+    return nr_candidates;
+}
+
+/**
+ * Counts the lines containing @param needle in @param files, sorted by path, through the index at
+ * @param index_path, which is created or updated first as needed.
+ * @return 0 on success with the count in @param lines, -1 on failure
+ */
+int finder_index_search(const char *index_path, const struct finder_file *files, size_t nr_files,
+            const char *needle, unsigned int nr_threads, unsigned long *lines)
+{
+    struct search_work work = {
+        .pool = { .fn = search_candidates, .nr_threads = nr_threads },
+        .files = files,
+        .needle = needle,
+        .needle_len = strlen(needle),
+    };
+    struct index_map map;
+    uint32_t *candidates;
+
+    if (index_update(index_path, files, nr_files, nr_threads, &map) != 0) {
+        return -1;
+    }
+    candidates = malloc((nr_files ? nr_files : 1) * sizeof(*candidates));
+    if (candidates == NULL) {
+        fprintf(stderr, "Out of memory searching index\n");
+        index_close(&map);
+        return -1;
+    }
+    work.candidates = candidates;
+    work.nr_candidates = index_candidates(&map, needle, work.needle_len, candidates);
+    atomic_init(&work.lines, 0);
+    thread_pool_run(&work.pool);
+
+    *lines = atomic_load(&work.lines);
+    free(candidates);
+    index_close(&map);
+    return 0;
+}
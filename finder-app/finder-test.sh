@@ -53,10 +53,15 @@ fi
 #make clean
 #make
 
+# One writer creates every file from a manifest of path<TAB>content lines,
+# with backslashes, newlines and tabs in the content escaped as writer expects.
+# The trailing x keeps $( ) from dropping trailing newlines.
+ESCAPEDSTR=$(printf '%sx' "$WRITESTR" | sed ':a;$!N;$!ba;s/\\/\\\\/g;s/\n/\\n/g;s/\t/\\t/g')
+ESCAPEDSTR=${ESCAPEDSTR%x}
 for i in $( seq 1 $NUMFILES)
 do
-	writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\t%s\n' "$WRITEDIR/${username}$i.txt" "$ESCAPEDSTR"
+done | writer -m -
 
 OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
 
@@ -0,0 +1,555 @@
+/**
+ * @file finder.c
+ * @brief Native replacement for finder.sh
+ *
+ * Counts the regular files under a directory, following symlinks like
+ * find -L, and the lines in them containing a string, and prints the same
+ * summary line as finder.sh.  Directories are walked by a pool of threads,
+ * each owning a deque of pending directories and files that it works on
+ * newest first while idle threads steal the oldest entries of the others.
+ * Small files are read into a per-thread buffer, larger ones mmap()ed, and
+ * lines are found with glibc's vectorised memmem() and memchr().
+ *
+ * Unlike the grep in finder.sh the text is matched literally, not as a
+ * regular expression.
+ *
+ * With -i the walk only stats the files and the search goes through a
+ * trigram index kept in the given file, see finder-index.c.
+ *
+ * Usage: finder [-j threads] [-i index] <directory> <text to search for>
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "finder.h"
+
+#define DEQUE_INITIAL 256
+
+/**
+ * A directory being walked, kept until the end so its descendants can check
+ * their ancestors for symlink loops
+ */
+struct dir_node {
+    struct dir_node *parent;
+    dev_t dev;
+    ino_t ino;
+    struct dir_node *all_next;
+};
+
+struct work_item {
+    char *path;
+    struct dir_node *parent;
+    // d_type from readdir(), DT_UNKNOWN when stat() has to tell
+    unsigned char type;
+};
+
+/**
+ * The owner pushes and pops at the tail, thieves take from the head
+ */
+struct deque {
+    pthread_mutex_t lock;
+    struct work_item *items;
+    size_t head, tail, capacity;
+};
+
+struct finder;
+
+struct worker {
+    struct deque queue;
+    struct finder *finder;
+    pthread_t thread;
+    char *buffer;
+    unsigned int seed;
+    unsigned long files;
+    unsigned long lines;
+    // Files found in index mode, searched through the index after the walk
+    struct finder_file *found;
+    size_t nr_found, found_capacity;
+};
+
+struct finder {
+    const char *needle;
+    size_t needle_len;
+    // Set to collect the files for the index instead of searching them
+    bool collect;
+    unsigned int nr_workers;
+    struct worker *workers;
+    // Items pushed and not yet processed, the walk is over at 0
+    atomic_long pending;
+    pthread_mutex_t dirs_lock;
+    struct dir_node *all_dirs;
+};
+
+static bool deque_push(struct deque *queue, struct work_item *item)
+{
+    struct work_item *grown;
+    size_t count, i;
+
+    pthread_mutex_lock(&queue->lock);
+    count = queue->tail - queue->head;
+    if (count == queue->capacity) {
+        grown = malloc(2 * queue->capacity * sizeof(*grown));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&queue->lock);
+            return false;
+        }
+        for (i = 0; i < count; i++) {
+            grown[i] = queue->items[(queue->head + i) % queue->capacity];
+        }
+        free(queue->items);
+        queue->items = grown;
+        queue->head = 0;
+        queue->tail = count;
+        queue->capacity *= 2;
+    }
+    queue->items[queue->tail % queue->capacity] = *item;
+    queue->tail++;
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+static bool deque_pop(struct deque *queue, struct work_item *item)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail != queue->head) {
+        queue->tail--;
+        *item = queue->items[queue->tail % queue->capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+static bool deque_steal(struct deque *queue, struct work_item *item)
+{
+    bool found = false;
+
+    // Not worth waiting for a busy victim, there are others
+    if (pthread_mutex_trylock(&queue->lock) != 0) {
+        return false;
+    }
+    if (queue->tail != queue->head) {
+        *item = queue->items[queue->head % queue->capacity];
+        queue->head++;
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+/**
+ * @return the number of lines in @param data containing @param needle.  Data with a NUL byte
+ * counts none, as grep only reports on stderr that a binary file matches.
+ */
+unsigned long finder_count_lines(const char *data, size_t size, const char *needle, size_t needle_len)
+{
+    const char *p = data, *end = data + size, *match, *eol;
+    unsigned long lines = 0;
+
+    while (p < end) {
+        match = needle_len ? memmem(p, end - p, needle, needle_len) : p;
+        if (match == NULL) {
+            break;
+        }
+        lines++;
+        eol = memchr(match, '\n', end - match);
+        if (eol == NULL) {
+            break;
+        }
+        p = eol + 1;
+    }
+    if (lines > 0 && finder_has_nul(data, size)) {
+        lines = 0;
+    }
+    return lines;
+}
+
+/**
+ * @return true if @param data would make grep treat the file as binary
+ */
+bool finder_has_nul(const char *data, size_t size)
+{
+    return memchr(data, '\0', size) != NULL;
+}
+
+/**
+ * Calls @param fn with the contents of @param path, read into @param buffer of FINDER_READ_MAX
+ * bytes if they fit and mmap()ed otherwise.  Empty files are skipped.
+ * @return 0 on success, -1 if the file could not be read
+ */
+int finder_with_file(const char *path, char *buffer, finder_file_fn fn, void *arg)
+{
+    struct stat st;
+    const char *data;
+    ssize_t nread;
+    size_t size = 0;
+    int fd, rc = -1;
+
+    fd = open(path, O_RDONLY | O_NOCTTY);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        goto out;
+    }
+    if (st.st_size == 0) {
+        rc = 0;
+        goto out;
+    }
+
+    if (st.st_size <= FINDER_READ_MAX) {
+        while (size < (size_t)st.st_size) {
+            nread = read(fd, buffer + size, st.st_size - size);
+            if (nread == -1 && errno == EINTR) {
+                continue;
+            } else if (nread <= 0) {
+                break;
+            }
+            size += nread;
+        }
+        fn(buffer, size, arg);
+        rc = 0;
+        goto out;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error mapping %s: %s\n", path, strerror(errno));
+        goto out;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+    fn(data, st.st_size, arg);
+    munmap((void *)data, st.st_size);
+    rc = 0;
+
+out:
+    close(fd);
+    return rc;
+}
+
+static void count_file_lines(const char *data, size_t size, void *arg)
+{
+    struct worker *worker = arg;
+
+    worker->lines += finder_count_lines(data, size, worker->finder->needle, worker->finder->needle_len);
+}
+
+static void collect_file(struct worker *worker, char *path, const struct stat *st)
+{
+    struct finder_file *grown;
+
+    if (worker->nr_found == worker->found_capacity) {
+        worker->found_capacity = worker->found_capacity ? 2 * worker->found_capacity : DEQUE_INITIAL;
+        grown = realloc(worker->found, worker->found_capacity * sizeof(*grown));
+        if (grown == NULL) {
+            fprintf(stderr, "Out of memory collecting %s\n", path);
+            free(path);
+            return;
+        }
+        worker->found = grown;
+    }
+    worker->found[worker->nr_found++] = (struct finder_file){
+        .path = path,
+        .mtime_ns = st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec,
+        .size = st->st_size,
+    };
+}
+
+static void push_item(struct worker *worker, char *path, struct dir_node *parent, unsigned char type)
+{
+    struct work_item item = { .path = path, .parent = parent, .type = type };
+
+    atomic_fetch_add(&worker->finder->pending, 1);
+    if (!deque_push(&worker->queue, &item)) {
+        fprintf(stderr, "Out of memory queueing %s\n", path);
+        atomic_fetch_sub(&worker->finder->pending, 1);
+        free(path);
+    }
+}
+
+static void walk_dir(struct worker *worker, const char *path, struct dir_node *parent)
+{
+    struct finder *finder = worker->finder;
+    struct dir_node *node, *ancestor;
+    struct dirent *dirent;
+    struct stat st;
+    size_t path_len = strlen(path), name_len;
+    char *child;
+    DIR *dir;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return;
+    }
+    for (ancestor = parent; ancestor != NULL; ancestor = ancestor->parent) {
+        if (ancestor->dev == st.st_dev && ancestor->ino == st.st_ino) {
+            fprintf(stderr, "File system loop detected; %s is part of the same file system loop\n", path);
+            close(fd);
+            return;
+        }
+    }
+    dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        return;
+    }
+
+    node = malloc(sizeof(*node));
+    if (node == NULL) {
+        closedir(dir);
+        return;
+    }
+    node->parent = parent;
+    node->dev = st.st_dev;
+    node->ino = st.st_ino;
+    pthread_mutex_lock(&finder->dirs_lock);
+    node->all_next = finder->all_dirs;
+    finder->all_dirs = node;
+    pthread_mutex_unlock(&finder->dirs_lock);
+
+    while ((dirent = readdir(dir)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+        name_len = strlen(dirent->d_name);
+        child = malloc(path_len + name_len + 2);
+        if (child == NULL) {
+            fprintf(stderr, "Out of memory walking %s\n", path);
+            break;
+        }
+        memcpy(child, path, path_len);
+        child[path_len] = '/';
+        memcpy(child + path_len + 1, dirent->d_name, name_len + 1);
+        push_item(worker, child, node, dirent->d_type);
+    }
+    closedir(dir);
+}
+
+static void process_item(struct worker *worker, struct work_item *item)
+{
+    struct stat st;
+    unsigned char type = item->type;
+
+    // Symlinks are followed like find -L, so only a stat() of the target tells.
+    // The index also needs the mtime and size of every file.
+    if (type != DT_DIR && (type != DT_REG || worker->finder->collect)) {
+        if (stat(item->path, &st) == -1) {
+            type = DT_UNKNOWN;
+        } else if (S_ISDIR(st.st_mode)) {
+            type = DT_DIR;
+        } else if (S_ISREG(st.st_mode)) {
+            type = DT_REG;
+        } else {
+            type = DT_UNKNOWN;
+        }
+    }
+
+    if (type == DT_DIR) {
+        walk_dir(worker, item->path, item->parent);
+    } else if (type == DT_REG && worker->finder->collect) {
+        worker->files++;
+        // The path now belongs to the collected file
+        collect_file(worker, item->path, &st);
+        return;
+    } else if (type == DT_REG) {
+        worker->files++;
+        finder_with_file(item->path, worker->buffer, count_file_lines, worker);
+    }
+    free(item->path);
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *worker = arg;
+    struct finder *finder = worker->finder;
+    struct work_item item;
+    unsigned int victim, i;
+    bool found;
+
+    for (;;) {
+        found = deque_pop(&worker->queue, &item);
+        for (i = 0; !found && i < finder->nr_workers; i++) {
+            victim = (rand_r(&worker->seed) + i) % finder->nr_workers;
+            if (&finder->workers[victim] != worker) {
+                found = deque_steal(&finder->workers[victim].queue, &item);
+            }
+        }
+        if (found) {
+            process_item(worker, &item);
+            atomic_fetch_sub(&finder->pending, 1);
+        } else if (atomic_load(&finder->pending) == 0) {
+            return NULL;
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+static int compare_files(const void *a, const void *b)
+{
+    return strcmp(((const struct finder_file *)a)->path, ((const struct finder_file *)b)->path);
+}
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr, "Wrong usage of script.\n");
+    fprintf(stderr, "Correct usage: %s [-j threads] [-i index] <directory> <text to search for>\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct finder finder = {};
+    struct finder_file *found = NULL;
+    struct dir_node *node;
+    unsigned long files = 0, lines = 0;
+    unsigned int i, started;
+    size_t nr_found = 0, n;
+    const char *index_path = NULL;
+    struct stat st;
+    long nr_cpus;
+    int opt, rc = 1;
+    char *root;
+
+    nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    finder.nr_workers = nr_cpus > 0 ? nr_cpus : 1;
+    while ((opt = getopt(argc, argv, "j:i:")) != -1) {
+        switch (opt) {
+            case 'j':
+                finder.nr_workers = strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                index_path = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2 || finder.nr_workers == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (stat(argv[optind], &st) == -1 || !S_ISDIR(st.st_mode)) {
+        printf("Directory %s does not exist\n", argv[optind]);
+        return 1;
+    }
+    finder.needle = argv[optind + 1];
+    finder.needle_len = strlen(finder.needle);
+    finder.collect = index_path != NULL;
+    pthread_mutex_init(&finder.dirs_lock, NULL);
+    atomic_init(&finder.pending, 0);
+
+    finder.workers = calloc(finder.nr_workers, sizeof(*finder.workers));
+    if (finder.workers == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < finder.nr_workers; i++) {
+        struct worker *worker = &finder.workers[i];
+
+        worker->finder = &finder;
+        worker->seed = i;
+        worker->buffer = malloc(FINDER_READ_MAX);
+        worker->queue.items = malloc(DEQUE_INITIAL * sizeof(*worker->queue.items));
+        worker->queue.capacity = DEQUE_INITIAL;
+        pthread_mutex_init(&worker->queue.lock, NULL);
+        if (worker->buffer == NULL || worker->queue.items == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            goto out;
+        }
+    }
+
+    root = strdup(argv[optind]);
+    if (root == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        goto out;
+    }
+    push_item(&finder.workers[0], root, NULL, DT_DIR);
+
+    // Workers that fail to start just leave an empty deque behind
+    for (started = 1; started < finder.nr_workers; started++) {
+        if (pthread_create(&finder.workers[started].thread, NULL, worker_thread, &finder.workers[started]) != 0) {
+            fprintf(stderr, "Error creating worker thread, continuing with %u\n", started);
+            break;
+        }
+    }
+    worker_thread(&finder.workers[0]);
+    for (i = 1; i < started; i++) {
+        pthread_join(finder.workers[i].thread, NULL);
+    }
+    for (i = 0; i < finder.nr_workers; i++) {
+        files += finder.workers[i].files;
+        lines += finder.workers[i].lines;
+        nr_found += finder.workers[i].nr_found;
+    }
+
+    if (finder.collect) {
+        found = malloc((nr_found ? nr_found : 1) * sizeof(*found));
+        if (found == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            goto out;
+        }
+        for (i = 0, n = 0; i < finder.nr_workers; i++) {
+            memcpy(found + n, finder.workers[i].found, finder.workers[i].nr_found * sizeof(*found));
+            n += finder.workers[i].nr_found;
+        }
+        qsort(found, nr_found, sizeof(*found), compare_files);
+        if (finder_index_search(index_path, found, nr_found, finder.needle, finder.nr_workers, &lines) != 0) {
+            goto out;
+        }
+    }
+
+    printf("The number of files are %lu and the number of matching lines are %lu\n", files, lines);
+    rc = 0;
+
+out:
+    while ((node = finder.all_dirs) != NULL) {
+        finder.all_dirs = node->all_next;
+        free(node);
+    }
+    if (found != NULL) {
+        for (n = 0; n < nr_found; n++) {
+            free(found[n].path);
+        }
+        free(found);
+    } else {
+        for (i = 0; i < finder.nr_workers; i++) {
+            for (n = 0; n < finder.workers[i].nr_found; n++) {
+                free(finder.workers[i].found[n].path);
+            }
+        }
+    }
+    for (i = 0; i < finder.nr_workers; i++) {
+        free(finder.workers[i].found);
+        free(finder.workers[i].buffer);
+        free(finder.workers[i].queue.items);
+        pthread_mutex_destroy(&finder.workers[i].queue.lock);
+    }
+    free(finder.workers);
+    pthread_mutex_destroy(&finder.dirs_lock);
+    return rc;
+}
@@ -0,0 +1,36 @@
+/**
+ * @file finder.h
+ * @brief Pieces of the native finder shared with its trigram index
+ */
+
+#ifndef FINDER_H
+#define FINDER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Files up to this size are read() rather than mmap()ed
+#define FINDER_READ_MAX (64 * 1024)
+
+/**
+ * A regular file found by the walk
+ */
+struct finder_file {
+    char *path;
+    uint64_t mtime_ns;
+    uint64_t size;
+};
+
+typedef void (*finder_file_fn)(const char *data, size_t size, void *arg);
+
+extern unsigned long finder_count_lines(const char *data, size_t size, const char *needle, size_t needle_len);
+
+extern bool finder_has_nul(const char *data, size_t size);
+
+extern int finder_with_file(const char *path, char *buffer, finder_file_fn fn, void *arg);
+
+extern int finder_index_search(const char *index_path, const struct finder_file *files, size_t nr_files,
+            const char *needle, unsigned int nr_threads, unsigned long *lines);
+
+#endif /* FINDER_H */
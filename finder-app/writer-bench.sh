@@ -0,0 +1,66 @@
+#!/bin/sh
+# Compares creating files with one writer process per file, the way
+# finder-test.sh used to, with one writer reading a manifest
+# Usage: writer-bench.sh [numfiles] [benchdir]
+
+set -e
+set -u
+
+NUMFILES=${1:-10000}
+BENCHDIR=${2:-/tmp/aeld-writer-bench}
+WRITESTR=AELD_IS_FUN
+WRITER=$(dirname "$0")/writer
+
+if [ ! -x "${WRITER}" ]
+then
+	echo "Build writer first with make -C $(dirname "$0")"
+	exit 1
+fi
+
+now() {
+	date +%s.%N
+}
+
+report() {
+	awk -v name="$1" -v n="${NUMFILES}" -v s="$2" -v e="$3" \
+		'BEGIN { printf "%-24s %10.3f s %12.0f files/s\n", name, e - s, n / (e - s) }'
+}
+
+fresh_dir() {
+	rm -rf "${BENCHDIR}"
+	mkdir -p "${BENCHDIR}"
+	sync
+}
+
+manifest() {
+	for i in $(seq 1 "${NUMFILES}")
+	do
+		printf '%s\t%s\n' "${BENCHDIR}/file$i.txt" "${WRITESTR}"
+	done
+}
+
+echo "Writing ${NUMFILES} files to ${BENCHDIR}"
+
+fresh_dir
+start=$(now)
+for i in $(seq 1 "${NUMFILES}")
+do
+	"${WRITER}" "${BENCHDIR}/file$i.txt" "${WRITESTR}"
+done
+report "writer per file" "${start}" "$(now)"
+
+manifest > "${BENCHDIR}.manifest"
+for threads in 1 4
+do
+	fresh_dir
+	start=$(now)
+	"${WRITER}" -j ${threads} -m "${BENCHDIR}.manifest"
+	report "writer -m, ${threads} threads" "${start}" "$(now)"
+done
+
+fresh_dir
+start=$(now)
+"${WRITER}" -s -m "${BENCHDIR}.manifest"
+report "writer -m -s" "${start}" "$(now)"
+
+rm -rf "${BENCHDIR}" "${BENCHDIR}.manifest"
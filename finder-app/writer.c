@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <fcntl.h>
 #include <syslog.h>
 #include <stdio.h>
@@ -7,50 +9,386 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 
-int main(int argc, char* argv[]) {
-    openlog(NULL, 0, LOG_USER);
+/*
+ * Usage: writer <file> <string>
+ *        writer [-s] <file> <string>
+ *        writer [-j threads] [-s] -m <manifest|->
+ *
+ * A manifest holds one "path<TAB>content" line per file, with \n, \t and \\
+ * in the content standing for a newline, a tab and a backslash.  All files
+ * are created by one process on a pool of threads.  With -s the files are
+ * made durable before writer returns, with one syncfs() per file system
+ * after all of them are written rather than one fsync() per file.
+ * Two arguments are always a file and its string, even if they start with
+ * a '-'.
+ */
 
-    if (argc != 3) {
-        syslog(LOG_ERR, "Wrong number of arguments passed: %d. Expected 2", argc - 1);
-        closelog();
-        exit(1);     // referred from https://stackoverflow.com/questions/2425167/use-of-exit-function
-    }
+// Manifest entries a thread takes at a time
+#define BATCH_SIZE 64
+// Upper bound of -j
+#define MAX_THREADS 256
+
+struct manifest_entry {
+    const char *path;
+    const char *content;
+    size_t len;
+};
 
+struct manifest {
+    struct manifest_entry *entries;
+    size_t nr_entries;
+    atomic_size_t next;
+    atomic_ulong failed;
+    bool sync;
+    // One fd on each file system written to, for syncfs()
+    pthread_mutex_t sync_lock;
+    int *sync_fds;
+    dev_t *sync_devs;
+    size_t nr_sync;
+};
+
+static int write_file(const char *path, const char *content, size_t len, int *fd_rtn) {
     int fd;
-    fd = creat(argv[1], S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);    // Assuming parent directory already exists
+    ssize_t nr;
+
+    fd = creat(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);    // Assuming parent directory already exists
 
     if (fd == -1) {
         int err1 = errno;
-        syslog(LOG_ERR, "Error while creating or opening file: %s", strerror(err1));
-        closelog();
+        syslog(LOG_ERR, "Error while creating or opening file %s: %s", path, strerror(err1));
+        return -1;
+    }
+
+    while (len > 0) {
+        nr = write(fd, content, len);
+        if (nr == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nr == -1) {
+            int err2 = errno;
+            syslog(LOG_ERR, "Error while writing to file %s: %s", path, strerror(err2));
+            close(fd);
+            return -1;
+        }
+        if (nr == 0) {
+            syslog(LOG_ERR, "Could not write entire input to file %s", path);
+            close(fd);
+            return -1;
+        }
+        content += nr;
+        len -= nr;
+    }
+
+    if (fd_rtn != NULL) {
+        *fd_rtn = fd;
+        return 0;
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * Keeps @param fd open for syncfs() if it is the first file written on its file system
+ */
+static void remember_file_system(struct manifest *manifest, int fd) {
+    struct stat st;
+    size_t i;
+
+    if (fstat(fd, &st) == -1) {
         close(fd);
-        exit(1);
+        return;
+    }
+    pthread_mutex_lock(&manifest->sync_lock);
+    for (i = 0; i < manifest->nr_sync; i++) {
+        if (manifest->sync_devs[i] == st.st_dev) {
+            break;
+        }
     }
+    if (i == manifest->nr_sync) {
+        int *fds = realloc(manifest->sync_fds, (i + 1) * sizeof(*fds));
+        dev_t *devs = fds ? realloc(manifest->sync_devs, (i + 1) * sizeof(*devs)) : NULL;
 
-    int lenToWrite = strlen(argv[2]);    // Reference: https://www.man7.org/linux/man-pages/man3/strlen.3.html
+        if (fds != NULL) {
+            manifest->sync_fds = fds;
+        }
+        if (devs != NULL) {
+            manifest->sync_devs = devs;
+            manifest->sync_fds[i] = fd;
+            manifest->sync_devs[i] = st.st_dev;
+            manifest->nr_sync++;
+            fd = -1;
+        } else {
+            // Without a slot the file can only be made durable by itself
+            syslog(LOG_ERR, "Out of memory tracking file systems, syncing file on its own");
+            if (fsync(fd) == -1) {
+                atomic_fetch_add(&manifest->failed, 1);
+            }
+        }
+    }
+    pthread_mutex_unlock(&manifest->sync_lock);
+    if (fd != -1) {
+        close(fd);
+    }
+}
 
-    syslog(LOG_DEBUG, "Writing %s to file %s", argv[2], argv[1]);
-    int nr = write(fd, argv[2], lenToWrite);
+static void *manifest_thread(void *arg) {
+    struct manifest *manifest = arg;
+    struct manifest_entry *entry;
+    size_t first, i;
+    int fd;
 
-    if (nr == -1) {
-        int err2 = errno;
-        syslog(LOG_ERR, "Error while writing to file %s", strerror(err2));
-        closelog();
+    while ((first = atomic_fetch_add(&manifest->next, BATCH_SIZE)) < manifest->nr_entries) {
+        for (i = first; i < first + BATCH_SIZE && i < manifest->nr_entries; i++) {
+            entry = &manifest->entries[i];
+            if (write_file(entry->path, entry->content, entry->len, manifest->sync ? &fd : NULL) != 0) {
+                atomic_fetch_add(&manifest->failed, 1);
+            } else if (manifest->sync) {
+                remember_file_system(manifest, fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Unescapes @param content of @param len bytes in place
+ * @return the new length
+ */
+static size_t unescape(char *content, size_t len) {
+    size_t in, out;
+
+    for (in = 0, out = 0; in < len; in++, out++) {
+        if (content[in] == '\\' && in + 1 < len) {
+            switch (content[in + 1]) {
+                case 'n':
+                    content[out] = '\n';
+                    in++;
+                    continue;
+                case 't':
+                    content[out] = '\t';
+                    in++;
+                    continue;
+                case '\\':
+                    content[out] = '\\';
+                    in++;
+                    continue;
+            }
+        }
+        content[out] = content[in];
+    }
+    return out;
+}
+
+/**
+ * Reads the manifest at @param path, or stdin for "-", into @param data and splits it into
+ * @param manifest entries pointing into it
+ */
+static int read_manifest(const char *path, char **data, struct manifest *manifest) {
+    size_t len = 0, capacity = 1 << 16, nr_lines = 0, i;
+    char *buf, *grown, *line, *end, *tab, *eol;
+    ssize_t nr;
+    int fd;
+
+    fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Error opening manifest %s: %s", path, strerror(errno));
+        return -1;
+    }
+    buf = malloc(capacity);
+    while (buf != NULL) {
+        if (len == capacity) {
+            capacity *= 2;
+            grown = realloc(buf, capacity);
+            if (grown == NULL) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+        }
+        nr = read(fd, buf + len, capacity - len);
+        if (nr == -1 && errno == EINTR) {
+            continue;
+        } else if (nr == -1) {
+            syslog(LOG_ERR, "Error reading manifest %s: %s", path, strerror(errno));
+            free(buf);
+            buf = NULL;
+        } else if (nr == 0) {
+            break;
+        }
+        len += nr;
+    }
+    if (fd != STDIN_FILENO) {
         close(fd);
-        exit(1);
+    }
+    if (buf == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < len; i++) {
+        nr_lines += buf[i] == '\n';
+    }
+    manifest->entries = malloc((nr_lines + 1) * sizeof(*manifest->entries));
+    if (manifest->entries == NULL) {
+        syslog(LOG_ERR, "Out of memory reading manifest");
+        free(buf);
+        return -1;
+    }
+
+    for (line = buf, end = buf + len; line < end; line = eol + 1) {
+        eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+        if (eol == line) {
+            continue;
+        }
+        *eol = '\0';
+        tab = memchr(line, '\t', eol - line);
+        if (tab == NULL) {
+            syslog(LOG_ERR, "Manifest line without a tab: %s", line);
+            atomic_fetch_add(&manifest->failed, 1);
+            continue;
+        }
+        *tab = '\0';
+        manifest->entries[manifest->nr_entries++] = (struct manifest_entry){
+            .path = line,
+            .content = tab + 1,
+            .len = unescape(tab + 1, eol - tab - 1),
+        };
+    }
+    *data = buf;
+    return 0;
+}
+
+static int write_manifest(const char *path, unsigned int nr_threads, bool sync) {
+    struct manifest manifest = { .sync = sync };
+    pthread_t *threads;
+    unsigned int i, started;
+    char *data = NULL;
+    size_t n;
+
+    threads = calloc(nr_threads, sizeof(*threads));
+    if (threads == NULL) {
+        syslog(LOG_ERR, "Malloc error for %u writer threads", nr_threads);
+        return -1;
+    }
+    atomic_init(&manifest.next, 0);
+    atomic_init(&manifest.failed, 0);
+    pthread_mutex_init(&manifest.sync_lock, NULL);
+    if (read_manifest(path, &data, &manifest) != 0) {
+        pthread_mutex_destroy(&manifest.sync_lock);
+        free(threads);
+        return -1;
+    }
+
+    for (started = 0; started < nr_threads; started++) {
+        if (pthread_create(&threads[started], NULL, manifest_thread, &manifest) != 0) {
+            syslog(LOG_ERR, "Error creating writer thread, continuing with %u", started);
+            break;
+        }
+    }
+    if (started == 0) {
+        manifest_thread(&manifest);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    for (n = 0; n < manifest.nr_sync; n++) {
+        if (syncfs(manifest.sync_fds[n]) == -1) {
+            syslog(LOG_ERR, "Error syncing file system: %s", strerror(errno));
+            atomic_fetch_add(&manifest.failed, 1);
+        }
+        close(manifest.sync_fds[n]);
+    }
+
+    syslog(LOG_DEBUG, "Wrote %zu files from manifest %s, %lu failed", manifest.nr_entries, path,
+            atomic_load(&manifest.failed));
+    n = atomic_load(&manifest.failed);
+    free(manifest.sync_fds);
+    free(manifest.sync_devs);
+    free(manifest.entries);
+    free(data);
+    pthread_mutex_destroy(&manifest.sync_lock);
+    return n == 0 ? 0 : -1;
+}
+
+int main(int argc, char* argv[]) {
+    openlog(NULL, 0, LOG_USER);
+
+    const char *manifest_path = NULL;
+    unsigned int nr_threads = 4;
+    bool sync = false;
+    char *end;
+    long value;
+    int opt, rc, fd = -1;
+
+    // Keep the original two argument form as it was, whatever the string is
+    if (argc == 3 && strcmp(argv[1], "-m") != 0) {
+        optind = 1;
+        goto write_one;
+    }
+    // Options only come first, so that <file> <string> can still start with a '-'
+    while ((opt = getopt(argc, argv, "+j:m:s")) != -1) {
+        switch (opt) {
+            case 'j':
+                errno = 0;
+                value = strtol(optarg, &end, 0);
+                if (errno != 0 || *end != '\0' || value < 1 || value > MAX_THREADS) {
+                    syslog(LOG_ERR, "Threads must be between 1 and %d: %s", MAX_THREADS, optarg);
+                    closelog();
+                    exit(1);
+                }
+                nr_threads = value;
+                break;
+            case 'm':
+                manifest_path = optarg;
+                break;
+            case 's':
+                sync = true;
+                break;
+            default:
+                syslog(LOG_ERR, "Usage: %s <file> <string> or %s [-j threads] [-s] -m <manifest|->", argv[0], argv[0]);
+                closelog();
+                exit(1);
+        }
     }
 
-    if (nr != lenToWrite) {
-        int err3 = errno;
-        syslog(LOG_ERR, "Could not write entire input to file");
+    if (manifest_path != NULL) {
+        if (optind != argc) {
+            syslog(LOG_ERR, "Wrong arguments for manifest mode");
+            closelog();
+            exit(1);
+        }
+        rc = write_manifest(manifest_path, nr_threads, sync);
         closelog();
+        return rc == 0 ? 0 : 1;
+    }
+
+    if (argc - optind != 2) {
+        syslog(LOG_ERR, "Wrong number of arguments passed: %d. Expected 2", argc - optind);
+        closelog();
+        exit(1);     // referred from https://stackoverflow.com/questions/2425167/use-of-exit-function
+    }
+
+write_one:
+    syslog(LOG_DEBUG, "Writing %s to file %s", argv[optind + 1], argv[optind]);
+    rc = write_file(argv[optind], argv[optind + 1], strlen(argv[optind + 1]), sync ? &fd : NULL);
+    if (rc == 0 && fd != -1) {
+        if (fsync(fd) == -1) {
+            syslog(LOG_ERR, "Error syncing file %s: %s", argv[optind], strerror(errno));
+            rc = -1;
+        }
         close(fd);
-        exit(1);
     }
 
     closelog();
-    close(fd);
 
-    return 0;
-}
\ No newline at end of file
+    return rc == 0 ? 0 : 1;
+}
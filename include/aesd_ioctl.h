@@ -33,14 +33,155 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Layout of the first page of an mmap() of the aesd char device.
+ *
+ * The mapping starts with this header page, followed by the data window of
+ * @capacity bytes holding the most recently committed bytes, mapped twice back
+ * to back so any range of up to @capacity bytes is contiguous.  The byte at
+ * logical offset L is found at mapping offset data_offset + (L % capacity).
+ * Logical offsets only grow over the life of the device.
+ *
+ * The writer makes @seq odd while it updates the window.  A reader samples
+ * @seq (retrying while odd), reads the offsets and data, then re-reads @seq
+ * and retries if it changed.  Readers that only need their own range to be
+ * intact may instead re-check that @head is still at or below the start of
+ * the range after copying it.
+ */
+struct aesd_mmap_header {
+    /**
+     * AESD_MMAP_MAGIC, zero if the header has not been initialized
+     */
+    uint32_t magic;
+    /**
+     * Generation counter, odd while the writer is updating the window
+     */
+    uint32_t seq;
+    /**
+     * Offset of the data window from the start of the mapping
+     */
+    uint64_t data_offset;
+    /**
+     * Size of the data window in bytes
+     */
+    uint64_t capacity;
+    /**
+     * Logical offset of the oldest byte still present in the data window
+     */
+    uint64_t head;
+    /**
+     * Logical offset one past the newest committed byte
+     */
+    uint64_t tail;
+    /**
+     * Logical offset of the oldest entry still retained by the driver, which
+     * is where file offset 0 of read() currently starts
+     */
+    uint64_t history_start;
+};
+
+#define AESD_MMAP_MAGIC 0x61657364
+
+/**
+ * Maximum number of entries returned by AESDCHAR_IOCSNAPSHOT, the number of
+ * write commands retained by the driver
+ */
+#define AESD_SNAPSHOT_MAX_ENTRIES 10
+
+/**
+ * One retained write command in a struct aesd_snapshot
+ */
+struct aesd_snapshot_entry {
+    /**
+     * File offset of the first byte of the command, as used by read() and lseek()
+     */
+    uint64_t offset;
+    /**
+     * Size of the command in bytes, including its terminating newline
+     */
+    uint64_t size;
+};
+
+/**
+ * A structure passed by IOCTL to take a consistent snapshot of the retained
+ * write commands.  The entry table always describes the same ring state as
+ * the data, if any was copied.
+ */
+struct aesd_snapshot {
+    /**
+     * In: user buffer receiving the concatenated commands, or 0 for the entry table only
+     */
+    uint64_t data;
+    /**
+     * In: size of the @data buffer in bytes
+     */
+    uint64_t data_len;
+    /**
+     * Out: total size of the retained commands.  Data was copied only if
+     * @data was set and @size is at most @data_len
+     */
+    uint64_t size;
+    /**
+     * Out: logical offset of file offset 0, comparable with the offsets
+     * in struct aesd_mmap_header
+     */
+    uint64_t base;
+    /**
+     * Out: number of valid entries in @entries, oldest first
+     */
+    uint32_t entry_count;
+    uint32_t reserved;
+    struct aesd_snapshot_entry entries[AESD_SNAPSHOT_MAX_ENTRIES];
+};
+
+#define AESD_SEEKTIME_MONOTONIC 0
+#define AESD_SEEKTIME_REALTIME 1
+
+/**
+ * A structure passed by IOCTL to position the file at the first retained
+ * write command committed at or after a given time.  Commands are stamped
+ * when committed, and realtime stamps never go backwards in ring order even
+ * if the clock is stepped back, so the lookup is a binary search.
+ */
+struct aesd_seektime {
+    /**
+     * In: time to search for, in nanoseconds on the clock named by @clock
+     */
+    uint64_t time_ns;
+    /**
+     * In: AESD_SEEKTIME_MONOTONIC or AESD_SEEKTIME_REALTIME
+     */
+    uint32_t clock;
+    /**
+     * Out: zero referenced write command found, or the number of retained
+     * commands when all of them are older than @time_ns
+     */
+    uint32_t write_cmd;
+    /**
+     * Out: new file offset, the end of the data when no command matched
+     */
+    uint64_t offset;
+    /**
+     * Out: commit time of the command found on @clock, 0 when none matched
+     */
+    uint64_t found_ns;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Enable (non zero) or disable tail mode on an open file: reads at the end of data block
+// until the next packet is committed instead of returning 0, or fail with EAGAIN under O_NONBLOCK
+#define AESDCHAR_IOCTAIL _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// Copy out the entry table, and optionally the data, of the retained commands in one call
+#define AESDCHAR_IOCSNAPSHOT _IOWR(AESD_IOC_MAGIC, 3, struct aesd_snapshot)
+// Seek to the first command committed at or after a monotonic or realtime timestamp
+#define AESDCHAR_IOCSEEKTIME _IOWR(AESD_IOC_MAGIC, 4, struct aesd_seektime)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 4
 
 #endif /* AESD_IOCTL_H */
@@ -0,0 +1,187 @@
+/**
+ * @file aesdsocket-echo.c
+ * @brief Shared history reads for the file and /dev/aesdchar backends
+ *
+ * Every connection echoes the whole history back once its packet is
+ * written.  Rather than each of them reading the history on its own, the
+ * first one to ask reads it into a reference counted snapshot and every
+ * connection whose packet that read already covers sends from the same
+ * snapshot.  Only one read runs at a time, the connections a running read
+ * is too old for all wait for the single read that starts after it.  A
+ * burst of clients thus costs a couple of reads of the history, and the
+ * sends happen in parallel without file_mutex.
+ *
+ * Whether a snapshot covers a packet is decided with a generation count
+ * bumped under file_mutex after every write, read by the snapshot's reader
+ * under the same mutex just before it reads the history.
+ */
+
+#include "aesdsocket.h"
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+// Initial buffer of a snapshot of the device, whose size is not known up front
+#define SNAPSHOT_MIN_SIZE 4096
+// A snapshot whose reader has not taken file_mutex yet covers every write before it does
+#define GENERATION_UNKNOWN UINT64_MAX
+
+void echo_coalescer_init(struct echo_coalescer *echoes)
+{
+    pthread_mutex_init(&echoes->lock, NULL);
+    pthread_cond_init(&echoes->ready_cond, NULL);
+    echoes->current = NULL;
+    echoes->next = NULL;
+    atomic_init(&echoes->written, 0);
+}
+
+void echo_coalescer_destroy(struct echo_coalescer *echoes)
+{
+    if (echoes->current != NULL) {
+        echo_coalescer_put(echoes, echoes->current);
+        echoes->current = NULL;
+    }
+    pthread_cond_destroy(&echoes->ready_cond);
+    pthread_mutex_destroy(&echoes->lock);
+}
+
+uint64_t echo_coalescer_written(struct echo_coalescer *echoes)
+{
+    return atomic_fetch_add(&echoes->written, 1) + 1;
+}
+
+/**
+ * Reads the history from @param readfd into @param snapshot. Called with file_mutex held.
+ */
+static int read_history(struct history_snapshot *snapshot, int readfd)
+{
+    size_t capacity = SNAPSHOT_MIN_SIZE;
+    struct stat st;
+    ssize_t nr;
+    char *grown;
+
+    // Regular files tell their size, the device has to be read until it ends
+    if (fstat(readfd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size >= capacity) {
+        capacity = st.st_size + 1;
+    }
+    snapshot->data = malloc(capacity);
+    if (snapshot->data == NULL) {
+        syslog(LOG_ERR, "Malloc error for history snapshot: %s", strerror(errno));
+        return -1;
+    }
+    while (true) {
+        if (snapshot->size == capacity) {
+            capacity *= 2;
+            grown = realloc(snapshot->data, capacity);
+            if (grown == NULL) {
+                syslog(LOG_ERR, "Realloc error for history snapshot: %s", strerror(errno));
+                return -1;
+            }
+            snapshot->data = grown;
+        }
+        nr = read(readfd, snapshot->data + snapshot->size, capacity - snapshot->size);
+        if (nr == -1 && errno == EINTR) {
+            continue;
+        } else if (nr == -1) {
+            syslog(LOG_ERR, "read() error: %s", strerror(errno));
+            return -1;
+        } else if (nr == 0) {
+            return 0;
+        }
+        snapshot->size += nr;
+    }
+}
+
+struct history_snapshot *echo_coalescer_get(struct echo_coalescer *echoes, pthread_mutex_t *file_mutex,
+        int readfd, uint64_t needed)
+{
+    struct history_snapshot *snapshot, *replaced;
+    uint64_t generation;
+    int cancel_state;
+    bool failed;
+
+    // A reader cancelled half way would leave every waiter of its snapshot stuck
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    pthread_mutex_lock(&echoes->lock);
+    snapshot = echoes->current;
+    if (snapshot != NULL && !snapshot->failed &&
+            (snapshot->generation == GENERATION_UNKNOWN || snapshot->generation >= needed)) {
+        snapshot->refs++;
+        while (!snapshot->ready) {
+            pthread_cond_wait(&echoes->ready_cond, &echoes->lock);
+        }
+        pthread_mutex_unlock(&echoes->lock);
+        goto out;
+    }
+
+    // Too old for this connection, the next read is shared by everyone who arrives until it starts
+    snapshot = echoes->next;
+    if (snapshot != NULL) {
+        snapshot->refs++;
+        while (!snapshot->ready) {
+            pthread_cond_wait(&echoes->ready_cond, &echoes->lock);
+        }
+        pthread_mutex_unlock(&echoes->lock);
+        goto out;
+    }
+    snapshot = calloc(1, sizeof(*snapshot));
+    if (snapshot == NULL) {
+        syslog(LOG_ERR, "Malloc error for history snapshot: %s", strerror(errno));
+        pthread_mutex_unlock(&echoes->lock);
+        goto out;
+    }
+    snapshot->generation = GENERATION_UNKNOWN;
+    // One reference for the caller, one for being current
+    snapshot->refs = 2;
+    // Only one read runs at a time, this one starts when the current one is done
+    echoes->next = snapshot;
+    while (echoes->current != NULL && !echoes->current->ready) {
+        pthread_cond_wait(&echoes->ready_cond, &echoes->lock);
+    }
+    replaced = echoes->current;
+    echoes->current = snapshot;
+    echoes->next = NULL;
+    pthread_mutex_unlock(&echoes->lock);
+    if (replaced != NULL) {
+        echo_coalescer_put(echoes, replaced);
+    }
+
+    pthread_mutex_lock(file_mutex);
+    generation = atomic_load(&echoes->written);
+    pthread_mutex_lock(&echoes->lock);
+    snapshot->generation = generation;
+    pthread_mutex_unlock(&echoes->lock);
+    // Other connections already check failed under echoes->lock, only set it there
+    failed = read_history(snapshot, readfd) != 0;
+    pthread_mutex_unlock(file_mutex);
+
+    pthread_mutex_lock(&echoes->lock);
+    snapshot->failed = failed;
+    snapshot->ready = true;
+    pthread_cond_broadcast(&echoes->ready_cond);
+    pthread_mutex_unlock(&echoes->lock);
+
+out:
+    pthread_setcancelstate(cancel_state, NULL);
+    if (snapshot != NULL && snapshot->failed) {
+        echo_coalescer_put(echoes, snapshot);
+        snapshot = NULL;
+    }
+    return snapshot;
+}
+
+void echo_coalescer_put(struct echo_coalescer *echoes, struct history_snapshot *snapshot)
+{
+    bool last;
+
+    pthread_mutex_lock(&echoes->lock);
+    last = --snapshot->refs == 0;
+    pthread_mutex_unlock(&echoes->lock);
+    if (last) {
+        free(snapshot->data);
+        free(snapshot);
+    }
+}
@@ -0,0 +1,482 @@
+/**
+ * @file aesdsocket-history.c
+ * @brief In-memory history backend for aesdsocket
+ *
+ * Packets are kept in an aesd_circular_buffer guarded by a rwlock, so
+ * appending costs no syscall and echoing is a single writev() straight from
+ * the stored entries.  Packets are reference counted, an echo takes a
+ * reference on each one it sends and drops the lock before writev(), so a
+ * slow client never holds up appends.  Bytes after the last newline stay
+ * pending and are joined to the next packet, so packet numbers match the
+ * driver, while echoes still end with them like the file backend.  With a
+ * spill file a background thread appends every committed packet to it,
+ * including packets evicted before it got to them, without ever doing disk
+ * I/O under the history lock.
+ */
+
+#define _GNU_SOURCE
+
+#include "aesdsocket.h"
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+/**
+ * Header of every stored packet, whose buffptr points at data
+ */
+struct mem_packet {
+    atomic_uint refs;
+    char data[];
+};
+
+static inline struct mem_packet *mem_packet_of(const char *data)
+{
+    return (struct mem_packet *)(data - offsetof(struct mem_packet, data));
+}
+
+/**
+ * @return the data of a new packet of @param size bytes holding one reference, or NULL
+ */
+static char *mem_packet_alloc(size_t size)
+{
+    struct mem_packet *packet = malloc(sizeof(*packet) + size);
+
+    if (packet == NULL) {
+        return NULL;
+    }
+    atomic_init(&packet->refs, 1);
+    return packet->data;
+}
+
+static void mem_packet_get(const char *data)
+{
+    atomic_fetch_add_explicit(&mem_packet_of(data)->refs, 1, memory_order_relaxed);
+}
+
+static void mem_packet_put(const char *data)
+{
+    if (atomic_fetch_sub_explicit(&mem_packet_of(data)->refs, 1, memory_order_acq_rel) == 1) {
+        free(mem_packet_of(data));
+    }
+}
+
+/**
+ * Releases @param entry, which was just removed as packet number @param index.
+ * Packets the spill thread has not written out yet are queued for it instead.
+ * Called with the history lock held for writing.
+ */
+static void mem_history_evict(struct mem_history *history, struct aesd_buffer_entry *entry, uint64_t index)
+{
+    struct spill_entry *spill;
+
+    history->bytes -= entry->size;
+    if (history->spill_fd != -1 && index >= history->spilled) {
+        spill = malloc(sizeof(*spill));
+        if (spill != NULL) {
+            spill->data = (char*)entry->buffptr;
+            spill->size = entry->size;
+            STAILQ_INSERT_TAIL(&history->evicted, spill, entries);
+            return;
+        }
+        syslog(LOG_ERR, "Malloc error for spill entry, packet %llu not spilled", (unsigned long long)index);
+    }
+    mem_packet_put(entry->buffptr);
+}
+
+static int write_full(int fd, const char *data, size_t size)
+{
+    ssize_t written;
+
+    while (size > 0) {
+        written = write(fd, data, size);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        } else if (written == -1) {
+            return -1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/**
+ * Writes every packet not spilled yet to the spill file.  The lock is only
+ * held to take the evicted queue and copy the packets still in memory.
+ */
+static void mem_history_spill(struct mem_history *history)
+{
+    struct spillhead batch = STAILQ_HEAD_INITIALIZER(batch);
+    struct spill_entry *spill;
+    struct aesd_buffer_entry *entry;
+    uint64_t index, oldest;
+    size_t copy_size = 0, offset;
+    char *copy = NULL;
+    uint8_t count, n;
+
+    pthread_rwlock_wrlock(&history->lock);
+    STAILQ_CONCAT(&batch, &history->evicted);
+    count = aesd_circular_buffer_count(&history->buffer);
+    oldest = history->committed - count;
+    index = history->spilled > oldest ? history->spilled : oldest;
+    for (n = index - oldest; n < count; n++) {
+        entry = &history->buffer.entry[(history->buffer.out_offs + n) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        copy_size += entry->size;
+    }
+    if (copy_size > 0 && (copy = malloc(copy_size)) == NULL) {
+        syslog(LOG_ERR, "Malloc error for spill copy, retrying later");
+        pthread_rwlock_unlock(&history->lock);
+    } else {
+        for (n = index - oldest, offset = 0; n < count; n++) {
+            entry = &history->buffer.entry[(history->buffer.out_offs + n) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+            memcpy(copy + offset, entry->buffptr, entry->size);
+            offset += entry->size;
+        }
+        history->spilled = history->committed;
+        pthread_rwlock_unlock(&history->lock);
+    }
+
+    while ((spill = STAILQ_FIRST(&batch)) != NULL) {
+        STAILQ_REMOVE_HEAD(&batch, entries);
+        if (write_full(history->spill_fd, spill->data, spill->size) != 0) {
+            syslog(LOG_ERR, "Error writing to spill file: %s", strerror(errno));
+        }
+        mem_packet_put(spill->data);
+        free(spill);
+    }
+    if (copy != NULL) {
+        if (write_full(history->spill_fd, copy, copy_size) != 0) {
+            syslog(LOG_ERR, "Error writing to spill file: %s", strerror(errno));
+        }
+        free(copy);
+    }
+}
+
+static void *mem_history_spill_thread(void *arg)
+{
+    struct mem_history *history = arg;
+    bool stop;
+
+    pthread_mutex_lock(&history->spill_mutex);
+    for (;;) {
+        while (!history->spill_pending && !history->spill_stop) {
+            pthread_cond_wait(&history->spill_cond, &history->spill_mutex);
+        }
+        history->spill_pending = false;
+        stop = history->spill_stop;
+        pthread_mutex_unlock(&history->spill_mutex);
+
+        mem_history_spill(history);
+        if (stop) {
+            return NULL;
+        }
+        pthread_mutex_lock(&history->spill_mutex);
+    }
+}
+
+/**
+ * Initializes @param history to an empty history limited to @param max_bytes, or only by the
+ * entry count if 0.  If @param spill_path is not NULL every packet is also appended to it.
+ * @return 0 on success, -1 on failure
+ */
+int mem_history_init(struct mem_history *history, size_t max_bytes, const char *spill_path)
+{
+    memset(history, 0, sizeof(*history));
+    aesd_circular_buffer_init(&history->buffer);
+    history->max_bytes = max_bytes;
+    history->spill_fd = -1;
+    STAILQ_INIT(&history->evicted);
+
+    if (pthread_rwlock_init(&history->lock, NULL) != 0) {
+        syslog(LOG_ERR, "Error initializing history lock");
+        return -1;
+    }
+    if (spill_path == NULL) {
+        return 0;
+    }
+
+    history->spill_fd = open(spill_path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (history->spill_fd == -1) {
+        syslog(LOG_ERR, "open() error for spill file %s: %s", spill_path, strerror(errno));
+        goto out_lock;
+    }
+    if (pthread_mutex_init(&history->spill_mutex, NULL) != 0) {
+        syslog(LOG_ERR, "Error initializing spill mutex");
+        goto out_fd;
+    }
+    if (pthread_cond_init(&history->spill_cond, NULL) != 0) {
+        syslog(LOG_ERR, "Error initializing spill condition");
+        goto out_mutex;
+    }
+    if (pthread_create(&history->spill_thread, NULL, mem_history_spill_thread, history) != 0) {
+        syslog(LOG_ERR, "Error creating spill thread");
+        goto out_cond;
+    }
+    return 0;
+
+out_cond:
+    pthread_cond_destroy(&history->spill_cond);
+out_mutex:
+    pthread_mutex_destroy(&history->spill_mutex);
+out_fd:
+    close(history->spill_fd);
+out_lock:
+    pthread_rwlock_destroy(&history->lock);
+    return -1;
+}
+
+/**
+ * Spills whatever is still pending, including an unterminated fragment, and frees every packet.
+ * No connection may use @param history any more.
+ */
+void mem_history_destroy(struct mem_history *history)
+{
+    struct aesd_buffer_entry entry;
+
+    if (history->spill_fd != -1) {
+        pthread_mutex_lock(&history->spill_mutex);
+        history->spill_stop = true;
+        pthread_cond_signal(&history->spill_cond);
+        pthread_mutex_unlock(&history->spill_mutex);
+        pthread_join(history->spill_thread, NULL);
+        pthread_cond_destroy(&history->spill_cond);
+        pthread_mutex_destroy(&history->spill_mutex);
+        if (history->pending != NULL &&
+                write_full(history->spill_fd, history->pending, history->pending_size) != 0) {
+            syslog(LOG_ERR, "Error writing to spill file: %s", strerror(errno));
+        }
+        close(history->spill_fd);
+    }
+
+    while ((entry = aesd_circular_buffer_remove_entry(&history->buffer)).buffptr != NULL) {
+        mem_packet_put(entry.buffptr);
+    }
+    if (history->pending != NULL) {
+        mem_packet_put(history->pending);
+    }
+    pthread_rwlock_destroy(&history->lock);
+}
+
+/**
+ * Appends @param size bytes of @param data to @param history, one entry per newline terminated
+ * packet.  A pending fragment is joined to the first one, and bytes after the last newline become
+ * the new pending fragment.  Packets are copied before taking the lock, only a join copies under it,
+ * and the oldest ones are evicted beyond the entry count or max_bytes, always keeping the newest.
+ * Evicted packets still reach the spill file.
+ * @return 0 on success, -1 if memory for the packets could not be allocated
+ */
+int mem_history_append(struct mem_history *history, const char *data, size_t size)
+{
+    struct aesd_buffer_entry *packets, evicted;
+    const char *end = data + size, *newline, *released = NULL;
+    bool terminated = size == 0 || end[-1] == '\n';
+    size_t n, nr_packets = 0;
+    char *joined;
+    uint8_t count;
+
+    for (newline = data; newline < end; nr_packets++) {
+        newline = memchr(newline, '\n', end - newline);
+        newline = newline ? newline + 1 : end;
+    }
+    packets = calloc(nr_packets, sizeof(*packets));
+    if (packets == NULL && nr_packets > 0) {
+        syslog(LOG_ERR, "Malloc error for history packets: %s", strerror(errno));
+        return -1;
+    }
+    for (n = 0; n < nr_packets; n++) {
+        newline = memchr(data, '\n', end - data);
+        size = newline ? newline + 1 - data : (size_t)(end - data);
+        packets[n].buffptr = mem_packet_alloc(size);
+        if (packets[n].buffptr == NULL) {
+            syslog(LOG_ERR, "Malloc error for history packet: %s", strerror(errno));
+            goto out;
+        }
+        memcpy((char*)packets[n].buffptr, data, size);
+        packets[n].size = size;
+        data += size;
+    }
+
+    pthread_rwlock_wrlock(&history->lock);
+    if (history->pending != NULL && nr_packets > 0) {
+        joined = mem_packet_alloc(history->pending_size + packets[0].size);
+        if (joined == NULL) {
+            pthread_rwlock_unlock(&history->lock);
+            syslog(LOG_ERR, "Malloc error for history packet: %s", strerror(errno));
+            goto out;
+        }
+        memcpy(joined, history->pending, history->pending_size);
+        memcpy(joined + history->pending_size, packets[0].buffptr, packets[0].size);
+        mem_packet_put(packets[0].buffptr);
+        packets[0].buffptr = joined;
+        packets[0].size += history->pending_size;
+        released = history->pending;
+        history->pending = NULL;
+    }
+    if (!terminated) {
+        nr_packets--;
+        history->pending = packets[nr_packets].buffptr;
+        history->pending_size = packets[nr_packets].size;
+    }
+    for (n = 0; n < nr_packets; n++) {
+        count = aesd_circular_buffer_count(&history->buffer);
+        evicted = aesd_circular_buffer_add_entry(&history->buffer, &packets[n]);
+        if (evicted.buffptr != NULL) {
+            mem_history_evict(history, &evicted, history->committed - count);
+        }
+        history->bytes += packets[n].size;
+        history->committed++;
+    }
+    while (history->max_bytes > 0 && history->bytes > history->max_bytes &&
+            (count = aesd_circular_buffer_count(&history->buffer)) > 1) {
+        evicted = aesd_circular_buffer_remove_entry(&history->buffer);
+        mem_history_evict(history, &evicted, history->committed - count);
+    }
+    pthread_rwlock_unlock(&history->lock);
+
+    // An echo may still hold the old fragment
+    if (released != NULL) {
+        mem_packet_put(released);
+    }
+    if (history->spill_fd != -1 && nr_packets > 0) {
+        pthread_mutex_lock(&history->spill_mutex);
+        history->spill_pending = true;
+        pthread_cond_signal(&history->spill_cond);
+        pthread_mutex_unlock(&history->spill_mutex);
+    }
+    free(packets);
+    return 0;
+
+out:
+    while (n-- > 0) {
+        mem_packet_put(packets[n].buffptr);
+    }
+    free(packets);
+    return -1;
+}
+
+/**
+ * Memory backend counterpart of AESDCHAR_IOCSEEKTO: stores in @param pos the history position
+ * of byte @param write_cmd_offset of packet @param write_cmd, counted from the oldest one.
+ * @return 0 on success, -1 with errno set to EINVAL if there is no such byte
+ */
+int mem_history_seekto(struct mem_history *history, uint32_t write_cmd, uint32_t write_cmd_offset, size_t *pos)
+{
+    struct aesd_buffer_entry *entry;
+    size_t offset = 0;
+    uint32_t n;
+    int rc = -1;
+
+    pthread_rwlock_rdlock(&history->lock);
+    if (write_cmd >= aesd_circular_buffer_count(&history->buffer)) {
+        goto out;
+    }
+    for (n = 0; n < write_cmd; n++) {
+        offset += history->buffer.entry[(history->buffer.out_offs + n) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size;
+    }
+    entry = &history->buffer.entry[(history->buffer.out_offs + write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    if (write_cmd_offset >= entry->size) {
+        goto out;
+    }
+    *pos = offset + write_cmd_offset;
+    rc = 0;
+
+out:
+    pthread_rwlock_unlock(&history->lock);
+    if (rc != 0) {
+        errno = EINVAL;
+    }
+    return rc;
+}
+
+/**
+ * Packets an echo holds a reference on, the last one may be the pending fragment
+ */
+struct mem_history_held {
+    const char *packets[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1];
+    int count;
+};
+
+static void mem_history_release(void *arg)
+{
+    struct mem_history_held *held = arg;
+
+    while (held->count > 0) {
+        mem_packet_put(held->packets[--held->count]);
+    }
+}
+
+/**
+ * Sends the history from position @param pos to @param fd with writev() straight from the stored
+ * packets, ending with the pending fragment as the file backend would.  The lock is only held to take a reference on each packet, so neither a slow client nor
+ * a steady stream of echoes holds up appends.
+ * @return the number of bytes sent, or -1 on error
+ */
+ssize_t mem_history_send(struct mem_history *history, int fd, size_t pos)
+{
+    struct iovec iov[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1], *next = iov;
+    struct mem_history_held held = { .count = 0 };
+    struct aesd_buffer_entry *entry;
+    ssize_t sent, total = 0;
+    size_t offset;
+    int iovcnt = 0;
+    uint8_t index;
+
+    pthread_rwlock_rdlock(&history->lock);
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&history->buffer, pos, &offset);
+    if (entry != NULL) {
+        index = entry - history->buffer.entry;
+        do {
+            entry = &history->buffer.entry[index];
+            mem_packet_get(entry->buffptr);
+            held.packets[held.count++] = entry->buffptr;
+            iov[iovcnt].iov_base = (char*)entry->buffptr + offset;
+            iov[iovcnt].iov_len = entry->size - offset;
+            iovcnt++;
+            offset = 0;
+            index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        } while (index != history->buffer.in_offs);
+    } else {
+        // Past every stored packet, so pos can only point into the pending fragment
+        offset = pos - history->bytes;
+    }
+    if (history->pending != NULL && offset < history->pending_size) {
+        mem_packet_get(history->pending);
+        held.packets[held.count++] = history->pending;
+        iov[iovcnt].iov_base = (char*)history->pending + offset;
+        iov[iovcnt].iov_len = history->pending_size - offset;
+        iovcnt++;
+    }
+    pthread_rwlock_unlock(&history->lock);
+
+    // writev() is a cancellation point, and close_connections() cancels threads
+    pthread_cleanup_push(mem_history_release, &held);
+
+    while (iovcnt > 0) {
+        sent = writev(fd, next, iovcnt);
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        } else if (sent == -1) {
+            total = -1;
+            break;
+        }
+        total += sent;
+        // Skip what a short write already sent
+        while (iovcnt > 0 && (size_t)sent >= next->iov_len) {
+            sent -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            next->iov_base = (char*)next->iov_base + sent;
+            next->iov_len -= sent;
+        }
+    }
+
+    pthread_cleanup_pop(1);
+    return total;
+}
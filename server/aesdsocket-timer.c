@@ -0,0 +1,132 @@
+/**
+ * @file aesdsocket-timer.c
+ * @brief Hierarchical timer wheel for aesdsocket's connection deadlines
+ *
+ * TIMER_WHEEL_LEVELS wheels of TIMER_WHEEL_SLOTS slots each, where a slot of
+ * level l spans TIMER_WHEEL_SLOTS^l ticks.  A timer is put in the finest
+ * level whose range covers it, arming and cancelling is a list insert or
+ * remove.  Whenever a level wraps, the next slot of the level above it is
+ * cascaded down, so every timer is moved at most TIMER_WHEEL_LEVELS - 1
+ * times before it expires.
+ */
+
+#include "aesdsocket.h"
+#include <time.h>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+// Ticks covered by all levels, later deadlines are clamped to the end
+#define TIMER_WHEEL_RANGE (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+static uint64_t elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/**
+ * Puts @param timer in the slot for its expiry. Called with the wheel lock held.
+ */
+static void timer_wheel_place(struct timer_wheel *wheel, struct wheel_timer *timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+    unsigned int level = 0;
+
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    LIST_INSERT_HEAD(&wheel->slots[level][(timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK],
+            timer, entries);
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, unsigned int tick_ms)
+{
+    unsigned int level, slot;
+
+    pthread_mutex_init(&wheel->lock, NULL);
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            LIST_INIT(&wheel->slots[level][slot]);
+        }
+    }
+    wheel->now = 0;
+    wheel->tick_ms = tick_ms;
+    clock_gettime(CLOCK_MONOTONIC, &wheel->start);
+}
+
+void timer_wheel_destroy(struct timer_wheel *wheel)
+{
+    pthread_mutex_destroy(&wheel->lock);
+}
+
+void timer_wheel_arm(struct timer_wheel *wheel, struct wheel_timer *timer, unsigned int timeout_ms)
+{
+    uint64_t ticks = (timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+
+    if (ticks == 0) {
+        ticks = 1;
+    } else if (ticks >= TIMER_WHEEL_RANGE) {
+        ticks = TIMER_WHEEL_RANGE - 1;
+    }
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->pending) {
+        LIST_REMOVE(timer, entries);
+    }
+    timer->expires = wheel->now + ticks;
+    timer->pending = true;
+    timer->fired = false;
+    timer_wheel_place(wheel, timer);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+bool timer_wheel_cancel(struct timer_wheel *wheel, struct wheel_timer *timer)
+{
+    bool fired;
+
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->pending) {
+        LIST_REMOVE(timer, entries);
+        timer->pending = false;
+    }
+    fired = timer->fired;
+    pthread_mutex_unlock(&wheel->lock);
+    return !fired;
+}
+
+void timer_wheel_advance(struct timer_wheel *wheel)
+{
+    uint64_t target = elapsed_ms(&wheel->start) / wheel->tick_ms;
+    struct wheel_slot cascade;
+    struct wheel_timer *timer;
+    unsigned int level, index;
+
+    pthread_mutex_lock(&wheel->lock);
+    while (wheel->now < target) {
+        wheel->now++;
+        // Each level that wrapped pulls the next slot of the level above it down
+        for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((wheel->now & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            index = (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+            LIST_INIT(&cascade);
+            while ((timer = LIST_FIRST(&wheel->slots[level][index])) != NULL) {
+                LIST_REMOVE(timer, entries);
+                LIST_INSERT_HEAD(&cascade, timer, entries);
+            }
+            while ((timer = LIST_FIRST(&cascade)) != NULL) {
+                LIST_REMOVE(timer, entries);
+                timer_wheel_place(wheel, timer);
+            }
+        }
+        index = wheel->now & TIMER_WHEEL_MASK;
+        while ((timer = LIST_FIRST(&wheel->slots[0][index])) != NULL) {
+            LIST_REMOVE(timer, entries);
+            timer->pending = false;
+            timer->fired = true;
+            timer->fn(timer);
+        }
+    }
+    pthread_mutex_unlock(&wheel->lock);
+}
@@ -3,6 +3,7 @@
 #include "aesdsocket.h"
 #include "aesd_ioctl.h"
 #include <sys/time.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <arpa/inet.h>
@@ -16,6 +17,7 @@
 #include <signal.h>
 #include <poll.h>
 #include <time.h>
+#include <stddef.h>
 
 #ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
@@ -29,19 +31,40 @@
 #define SOCKFILE "/var/tmp/aesdsocketdata"
 #endif
 #define BUFFER_SIZE 2048
+#define SENDFILE_CHUNK (1 << 20)
+// Granularity of connection deadlines, also the longest the server loop sleeps
+#define TIMER_TICK_MS 100
+#define DEFAULT_TIMEOUT_S 30
 
 int sockfd, filefd_for_time;
 pthread_mutex_t file_mutex;
 bool terminate = false;
+// Set by -m to keep the history in process memory instead of SOCKFILE
+bool use_memory = false, history_initialized = false;
+struct mem_history history;
+// Deadlines of the connections, advanced by the server loop
+struct timer_wheel wheel;
+// Shares history reads between the connections of the file and device backends
+struct echo_coalescer echoes;
+// Set by -r and -w, 0 disables the deadline
+unsigned int read_timeout_ms = DEFAULT_TIMEOUT_S * 1000, write_timeout_ms = DEFAULT_TIMEOUT_S * 1000;
+unsigned long timed_out_connections = 0;
 
 static void cleanup() {
     shutdown(sockfd, SHUT_RDWR);
     close(sockfd);
 #if !USE_AESD_CHAR_DEVICE
-    close(filefd_for_time);
-    unlink(SOCKFILE);
+    if (!use_memory) {
+        close(filefd_for_time);
+        unlink(SOCKFILE);
+    }
 #endif
+    if (history_initialized) {
+        mem_history_destroy(&history);
+    }
     pthread_mutex_destroy(&file_mutex);
+    timer_wheel_destroy(&wheel);
+    echo_coalescer_destroy(&echoes);
 }
 
 static void print_time() {
@@ -80,6 +103,8 @@ static void print_time() {
 
     if (write(filefd_for_time, writebuf, strlen(writebuf)) == -1) {
         syslog(LOG_ERR, "Error writing time to file: %s", strerror(errno));
+    } else {
+        echo_coalescer_written(&echoes);
     }
     
     rc = pthread_mutex_unlock(&file_mutex);
@@ -106,14 +131,183 @@ void *get_in_addr(struct sockaddr *sa)
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+/**
+ * Parses an "AESDCHAR_IOCSEEKTO:X,Y" command in @param readbuf into @param seekto
+ * @return false if the command has no write command to seek to
+ */
+static bool parse_seekto(const char *readbuf, struct aesd_seekto *seekto) {
+    char *comma, *colon;
+
+    syslog(LOG_INFO, "AESDCHAR_IOCSEEKTO ioctl ccommand received, %s", readbuf);
+    memset(seekto, 0, sizeof(*seekto));
+    if ((colon = strchr(readbuf, ':')) == NULL) {
+        syslog(LOG_ERR, "Colon not found in AESDCHAR_IOCSEEKTO ioctl string");
+        return false;
+    }
+    seekto->write_cmd = (uint32_t)strtoul(colon + 1, NULL, 0);
+    if ((comma = strchr(readbuf, ',')) == NULL) {
+        syslog(LOG_ERR, "Comma not found in AESDCHAR_IOCSEEKTO ioctl string");
+    } else {
+        seekto->write_cmd_offset = (uint32_t)strtoul(comma + 1, NULL, 0);
+    }
+    return true;
+}
+
+/**
+ * Called by the server loop when a connection misses its deadline. Shutting the
+ * socket down wakes its thread out of recv() or send() and lets it finish.
+ */
+static void deadline_passed(struct wheel_timer *timer) {
+    struct thread_conn_data *conn_params = (struct thread_conn_data*)((char*)timer - offsetof(struct thread_conn_data, deadline));
+
+    syslog(LOG_INFO, "Deadline passed for connection on fd %d, closing it", conn_params->connfd);
+    shutdown(conn_params->connfd, SHUT_RDWR);
+    timed_out_connections++;
+}
+
+static void arm_deadline(struct thread_conn_data *conn_params, unsigned int timeout_ms) {
+    if (timeout_ms != 0) {
+        timer_wheel_arm(&wheel, &conn_params->deadline, timeout_ms);
+    }
+}
+
+/**
+ * @return false if the deadline of @param conn_params passed before it was cancelled
+ */
+static bool cancel_deadline(struct thread_conn_data *conn_params) {
+    return timer_wheel_cancel(&wheel, &conn_params->deadline);
+}
+
+static void free_packet(void *packet) {
+    free(*(char**)packet);
+}
+
+/**
+ * Appends @param size bytes at @param data to the growable @param packet
+ */
+static int append_packet(char **packet, size_t *packet_len, size_t *packet_cap, const char *data, size_t size) {
+    size_t cap = *packet_cap;
+    char *grown;
+
+    if (*packet_len + size > cap) {
+        cap = cap ? 2 * cap : BUFFER_SIZE;
+        while (cap < *packet_len + size) {
+            cap *= 2;
+        }
+        grown = realloc(*packet, cap);
+        if (grown == NULL) {
+            syslog(LOG_ERR, "Realloc error for packet: %s", strerror(errno));
+            return -1;
+        }
+        *packet = grown;
+        *packet_cap = cap;
+    }
+    memcpy(*packet + *packet_len, data, size);
+    *packet_len += size;
+    return 0;
+}
+
+/**
+ * Echoes the history by reading it from the connection's own fd under the mutex
+ */
+static bool send_history_file(struct thread_conn_data *conn_params) {
+    char *writebuf = conn_params->write_buffer;
+    ssize_t read_bytes, send_bytes;
+    bool file_content_sent = true, use_sendfile = true;
+    int read_pos = 0, rc;
+
+    rc = pthread_mutex_lock(conn_params->mutex);
+    if (rc != 0) {
+        syslog(LOG_ERR, "Error acquiring mutex");
+        return false;
+    }
+    // A client that does not read its echo holds the mutex until the write deadline at most
+    arm_deadline(conn_params, write_timeout_ms);
+    while (true) {
+        // Move the history from the file to the socket in kernel space where supported
+        if (use_sendfile) {
+            send_bytes = sendfile(conn_params->connfd, conn_params->readfd, NULL, SENDFILE_CHUNK);
+            if (send_bytes == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                syslog(LOG_DEBUG, "sendfile() not supported, falling back to read() and send()");
+                use_sendfile = false;
+                continue;
+            } else if (send_bytes == -1) {
+                syslog(LOG_ERR, "sendfile() error: %s", strerror(errno));
+                file_content_sent = false;
+                break;
+            } else if (send_bytes == 0) {
+                syslog(LOG_DEBUG, "No more bytes to read from file");
+                break;
+            }
+            read_pos += send_bytes;
+            syslog(LOG_INFO, "Sent %ld bytes to %s", send_bytes, conn_params->conn_ip);
+            continue;
+        }
+        read_bytes = read(conn_params->readfd, writebuf, BUFFER_SIZE);
+        if (read_bytes == -1) {
+            syslog(LOG_ERR, "read() error: %s", strerror(errno));
+            file_content_sent = false;
+            break;
+        } else if (read_bytes == 0) {
+            syslog(LOG_DEBUG, "No more bytes to read from file");
+            break;
+        }
+        read_pos += read_bytes;
+        send_bytes = send(conn_params->connfd, writebuf, read_bytes, 0);
+        if (send_bytes == -1) {
+            syslog(LOG_ERR, "send() error: %s", strerror(errno));
+            file_content_sent = false;
+            break;
+        } else {
+            syslog(LOG_INFO, "Sent %ld bytes to %s", send_bytes, conn_params->conn_ip);
+        }
+    }
+    if (!cancel_deadline(conn_params)) {
+        syslog(LOG_INFO, "Write deadline passed for %s", conn_params->conn_ip);
+        file_content_sent = false;
+    }
+    rc = pthread_mutex_unlock(conn_params->mutex);
+    if (rc != 0) {
+        syslog(LOG_ERR, "Error unlocking mutex");
+        return false;
+    }
+    return file_content_sent;
+}
+
+static void put_snapshot(void *snapshot) {
+    echo_coalescer_put(&echoes, snapshot);
+}
+
+/**
+ * Echoes the history from @param snapshot, without holding the mutex
+ */
+static bool send_snapshot(struct thread_conn_data *conn_params, struct history_snapshot *snapshot) {
+    size_t sent = 0;
+    ssize_t send_bytes;
+
+    while (sent < snapshot->size) {
+        send_bytes = send(conn_params->connfd, snapshot->data + sent, snapshot->size - sent, 0);
+        if (send_bytes == -1 && errno == EINTR) {
+            continue;
+        } else if (send_bytes == -1) {
+            syslog(LOG_ERR, "send() error: %s", strerror(errno));
+            return false;
+        }
+        sent += send_bytes;
+    }
+    syslog(LOG_INFO, "Sent %zu bytes to %s", sent, conn_params->conn_ip);
+    return true;
+}
+
 static void *thread_handle_conn(void *thread_params) {
     struct thread_conn_data *conn_params = (struct thread_conn_data*)thread_params;
     char *readbuf = conn_params->read_buffer;
-    char *writebuf = conn_params->write_buffer;
     int rc;
 
-    ssize_t recv_bytes, written_bytes, read_bytes, send_bytes;
-    bool packet_received = false;
+    ssize_t recv_bytes, written_bytes;
+    bool packet_received = false, seeked = false;
+    // Writes an echo has to include, this connection's packet once written
+    uint64_t needed = atomic_load(&echoes.written);
 
     
     syslog(LOG_INFO, "Accepted connection from %s", conn_params->conn_ip);
@@ -124,13 +318,11 @@ static void *thread_handle_conn(void *thread_params) {
         return thread_params;
     }
 
-    rc = pthread_mutex_lock(conn_params->mutex);
-    if (rc != 0) {
-        syslog(LOG_ERR, "Error acquiring mutex");
-        conn_params->thread_complete_success = false;
-        return thread_params;
-    }
+    // The packet is collected before taking the mutex, so a slow client only holds up itself
+    char *packet = NULL;
+    size_t packet_len = 0, packet_cap = 0;
     bool packet_written = true;
+    pthread_cleanup_push(free_packet, &packet);
     while (!packet_received) {
         recv_bytes = recv(conn_params->connfd, readbuf, BUFFER_SIZE - 1, 0);
         if (recv_bytes == -1) {
@@ -149,87 +341,172 @@ static void *thread_handle_conn(void *thread_params) {
         // Handle ioctl command
         if (strncmp(readbuf, "AESDCHAR_IOCSEEKTO", 18) == 0) {
             struct aesd_seekto seekto;
-            char *comma, *colon;
-            syslog(LOG_INFO, "AESDCHAR_IOCSEEKTO ioctl ccommand received, %s", readbuf);
-            if ((colon = strchr(readbuf, ':')) == NULL) {
-                syslog(LOG_ERR, "Colon not found in AESDCHAR_IOCSEEKTO ioctl string");
+            if (!parse_seekto(readbuf, &seekto)) {
                 continue;
-            } else {
-                seekto.write_cmd = (uint32_t)strtoul(colon + 1, NULL, 0);
-            }
-            if ((comma = strchr(readbuf, ',')) == NULL) {
-                syslog(LOG_ERR, "Comma not found in AESDCHAR_IOCSEEKTO ioctl string");
-            } else {
-                seekto.write_cmd_offset = (uint32_t)strtoul(comma + 1, NULL, 0);
             }
             syslog(LOG_INFO, "Sending AESDCHAR_IOCSEEKTO ioctl with args %u and %u", seekto.write_cmd, seekto.write_cmd_offset);
             if (ioctl(conn_params->readfd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
                 syslog(LOG_ERR, "ioctl error: %s", strerror(errno));
             }
+            seeked = true;
             continue;
         }
 
-        written_bytes = write(conn_params->writefd, readbuf, recv_bytes);
-        if (written_bytes == -1) {
-            syslog(LOG_ERR, "write() error: %s", strerror(errno));
+        if (append_packet(&packet, &packet_len, &packet_cap, readbuf, recv_bytes) != 0) {
             packet_written = false;
             break;
-        } else if (written_bytes < recv_bytes) {
-            syslog(LOG_ERR, "Could not write %ld bytes, written bytes: %ld", recv_bytes, written_bytes);
+        }
+    }
+    if (!cancel_deadline(conn_params)) {
+        // Whatever arrived of the packet is dropped
+        syslog(LOG_INFO, "Read deadline passed for %s", conn_params->conn_ip);
+        packet_written = false;
+    }
+
+    if (packet_written && packet_len > 0) {
+        rc = pthread_mutex_lock(conn_params->mutex);
+        if (rc != 0) {
+            syslog(LOG_ERR, "Error acquiring mutex");
+            packet_written = false;
         } else {
-            syslog(LOG_INFO, "Written %ld bytes: %s", written_bytes, readbuf);
+            written_bytes = write(conn_params->writefd, packet, packet_len);
+            if (written_bytes == -1) {
+                syslog(LOG_ERR, "write() error: %s", strerror(errno));
+                packet_written = false;
+            } else if ((size_t)written_bytes < packet_len) {
+                syslog(LOG_ERR, "Could not write %zu bytes, written bytes: %ld", packet_len, written_bytes);
+            } else {
+                syslog(LOG_INFO, "Written %ld bytes: %.*s", written_bytes, (int)packet_len, packet);
+            }
+            if (written_bytes > 0) {
+                needed = echo_coalescer_written(&echoes);
+            }
+            rc = pthread_mutex_unlock(conn_params->mutex);
+            if (rc != 0) {
+                syslog(LOG_ERR, "Error unlocking mutex");
+                packet_written = false;
+            }
         }
     }
-    rc = pthread_mutex_unlock(conn_params->mutex);
-    if (rc != 0) {
-        syslog(LOG_ERR, "Error unlocking mutex");
+    pthread_cleanup_pop(1);
+    if (!packet_written) {
         conn_params->thread_complete_success = false;
         return thread_params;
     }
-    if (!packet_written) {
+    // Connections that seeked read from their own position, the rest share one read
+    struct history_snapshot *snapshot = NULL;
+    bool file_content_sent;
+    if (!seeked) {
+        snapshot = echo_coalescer_get(&echoes, conn_params->mutex, conn_params->readfd, needed);
+    }
+    if (snapshot != NULL) {
+        pthread_cleanup_push(put_snapshot, snapshot);
+        arm_deadline(conn_params, write_timeout_ms);
+        file_content_sent = send_snapshot(conn_params, snapshot);
+        if (!cancel_deadline(conn_params)) {
+            syslog(LOG_INFO, "Write deadline passed for %s", conn_params->conn_ip);
+            file_content_sent = false;
+        }
+        pthread_cleanup_pop(1);
+    } else {
+        if (!seeked) {
+            // The read may have failed half way through this connection's fd
+            lseek(conn_params->readfd, 0, SEEK_SET);
+        }
+        file_content_sent = send_history_file(conn_params);
+    }
+    if (!file_content_sent) {
         conn_params->thread_complete_success = false;
         return thread_params;
     }
-    bool file_content_sent = true;
-    int read_pos = 0;
-    rc = pthread_mutex_lock(conn_params->mutex);
-    if (rc != 0) {
-        syslog(LOG_ERR, "Error acquiring mutex");
+
+    conn_params->thread_complete_success = true;
+    return thread_params;
+}
+
+/**
+ * Connection handler for the memory backend.  The packet is collected without
+ * holding any lock, committed in one step and the history echoed back with
+ * writev() straight from memory.
+ */
+static void *thread_handle_mem_conn(void *thread_params) {
+    struct thread_conn_data *conn_params = (struct thread_conn_data*)thread_params;
+    struct mem_history *history = conn_params->history;
+    char *readbuf = conn_params->read_buffer;
+    char *packet = NULL;
+    size_t packet_len = 0, packet_cap = 0, pos = 0;
+    ssize_t recv_bytes, send_bytes;
+    bool packet_received = false, success = true;
+
+    syslog(LOG_INFO, "Accepted connection from %s", conn_params->conn_ip);
+
+    if (pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL) != 0) {
+        syslog(LOG_ERR, "Error setting thread cancel state");
         conn_params->thread_complete_success = false;
         return thread_params;
     }
-    while (true) {
-        read_bytes = read(conn_params->readfd, writebuf, BUFFER_SIZE);
-        if (read_bytes == -1) {
-            syslog(LOG_ERR, "read() error: %s", strerror(errno));
-            file_content_sent = false;
+
+    pthread_cleanup_push(free_packet, &packet);
+    while (!packet_received) {
+        recv_bytes = recv(conn_params->connfd, readbuf, BUFFER_SIZE - 1, 0);
+        if (recv_bytes == -1) {
+            syslog(LOG_ERR, "recv() error: %s", strerror(errno));
+            success = false;
             break;
-        } else if (read_bytes == 0) {
-            syslog(LOG_DEBUG, "No more bytes to read from file");
+        } else if (recv_bytes == 0) {
+            syslog(LOG_DEBUG, "No more bytes to read from client");
             break;
         }
-        read_pos += read_bytes;
-        send_bytes = send(conn_params->connfd, writebuf, read_bytes, 0);
-        if (send_bytes == -1) {
-            syslog(LOG_ERR, "send() error: %s", strerror(errno));
-            file_content_sent = false;
+        readbuf[recv_bytes] = '\0';
+        if (readbuf[recv_bytes - 1] == '\n') {
+            packet_received = true;
+        }
+
+        if (strncmp(readbuf, "AESDCHAR_IOCSEEKTO", 18) == 0) {
+            struct aesd_seekto seekto;
+            if (!parse_seekto(readbuf, &seekto)) {
+                continue;
+            }
+            if (mem_history_seekto(history, seekto.write_cmd, seekto.write_cmd_offset, &pos) != 0) {
+                syslog(LOG_ERR, "Seek to %u,%u error: %s", seekto.write_cmd, seekto.write_cmd_offset, strerror(errno));
+            }
+            continue;
+        }
+
+        if (append_packet(&packet, &packet_len, &packet_cap, readbuf, recv_bytes) != 0) {
+            success = false;
             break;
-        } else {
-            syslog(LOG_INFO, "Sent %ld bytes to %s", send_bytes, conn_params->conn_ip);
         }
     }
-    rc = pthread_mutex_unlock(conn_params->mutex);
-    if (rc != 0) {
-        syslog(LOG_ERR, "Error unlocking mutex");
-        conn_params->thread_complete_success = false;
-        return thread_params;
+    if (!cancel_deadline(conn_params)) {
+        syslog(LOG_INFO, "Read deadline passed for %s", conn_params->conn_ip);
+        success = false;
     }
-    if (!file_content_sent) {
-        conn_params->thread_complete_success = false;
-        return thread_params;
+    if (success && packet_len > 0) {
+        if (mem_history_append(history, packet, packet_len) != 0) {
+            success = false;
+        } else {
+            syslog(LOG_INFO, "Written %zu bytes", packet_len);
+        }
     }
+    pthread_cleanup_pop(1);
 
-    conn_params->thread_complete_success = true;
+    if (success) {
+        arm_deadline(conn_params, write_timeout_ms);
+        send_bytes = mem_history_send(history, conn_params->connfd, pos);
+        if (send_bytes == -1) {
+            syslog(LOG_ERR, "writev() error: %s", strerror(errno));
+            success = false;
+        } else {
+            syslog(LOG_INFO, "Sent %ld bytes to %s", send_bytes, conn_params->conn_ip);
+        }
+        if (!cancel_deadline(conn_params)) {
+            syslog(LOG_INFO, "Write deadline passed for %s", conn_params->conn_ip);
+            success = false;
+        }
+    }
+
+    conn_params->thread_complete_success = success;
     return thread_params;
 }
 
@@ -243,6 +520,7 @@ static void cleanup_thread_list(struct slisthead *head) {
         tryjoin_rtn = pthread_tryjoin_np(node->thread_id, &thread_rtn);
         next_node = SLIST_NEXT(node, entries);
         if (tryjoin_rtn == 0) {
+            cancel_deadline(node->conn_data);
             free(node->conn_data->read_buffer);
             free(node->conn_data->write_buffer);
             syslog(LOG_INFO, "Closed connection from %s", node->conn_data->conn_ip);
@@ -265,6 +543,8 @@ static void close_connections(struct slisthead *head) {
     while (node != NULL) {
         next_node = SLIST_NEXT(node, entries);
         pthread_cancel(node->thread_id);
+        pthread_join(node->thread_id, NULL);
+        cancel_deadline(node->conn_data);
         free(node->conn_data->read_buffer);
         free(node->conn_data->write_buffer);
         syslog(LOG_INFO, "Closed connection from %s", node->conn_data->conn_ip);
@@ -332,14 +612,38 @@ int main(int argc, char* argv[]) {
     }
 
     bool iffork = false, fork_success = true;
-    if (argc == 2) {
-        if (strncmp(argv[1], "-d", 2) == 0) {
-            iffork = true;
-        } else {
-            syslog(LOG_ERR, "Wrong parameters");
-            fork_success = false;
+    size_t history_max_bytes = 0;
+    const char *spill_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "dml:s:r:w:")) != -1) {
+        switch (opt) {
+            case 'd':
+                iffork = true;
+                break;
+            case 'm':
+                use_memory = true;
+                break;
+            case 'l':
+                history_max_bytes = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                spill_path = optarg;
+                break;
+            case 'r':
+                read_timeout_ms = strtoul(optarg, NULL, 0) * 1000;
+                break;
+            case 'w':
+                write_timeout_ms = strtoul(optarg, NULL, 0) * 1000;
+                break;
+            default:
+                syslog(LOG_ERR, "Wrong parameters, usage: %s [-d] [-r read_timeout_s] [-w write_timeout_s] [-m [-l max_bytes] [-s spill_file]]", argv[0]);
+                fork_success = false;
         }
     }
+    if (!use_memory && (history_max_bytes != 0 || spill_path != NULL)) {
+        syslog(LOG_ERR, "-l and -s only apply to the memory backend selected with -m");
+        fork_success = false;
+    }
 
     if (iffork) {
         pid_t pid = fork();
@@ -402,28 +706,47 @@ int main(int argc, char* argv[]) {
 		syslog(LOG_ERR, "Error %d (%s) registering for SIGALRM\n", errno, strerror(errno));
         success = false;
 	}
+    // A connection shut down at its deadline must fail send(), not kill the server
+    new_action.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &new_action, NULL) != 0) {
+        syslog(LOG_ERR, "Error %d (%s) ignoring SIGPIPE\n", errno, strerror(errno));
+        success = false;
+    }
 
     if (pthread_mutex_init(&file_mutex, NULL) != 0) {
         syslog(LOG_ERR, "Error initializing file mutex");
         success = false;
     }
+    timer_wheel_init(&wheel, TIMER_TICK_MS);
+    echo_coalescer_init(&echoes);
 
-#if !USE_AESD_CHAR_DEVICE
-    filefd_for_time = open(SOCKFILE, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if (filefd_for_time == -1) {
-        syslog(LOG_ERR, "open() error: %s", strerror(errno));
-        success = false;
+    if (use_memory) {
+        if (mem_history_init(&history, history_max_bytes, spill_path) != 0) {
+            success = false;
+        } else {
+            history_initialized = true;
+        }
     }
 
-    struct itimerval delay;
-    delay.it_value.tv_sec = 10;
-    delay.it_value.tv_usec = 0;
-    delay.it_interval.tv_sec = 10;
-    delay.it_interval.tv_usec = 0;
+#if !USE_AESD_CHAR_DEVICE
+    // The memory backend keeps packets only, like /dev/aesdchar
+    if (!use_memory) {
+        filefd_for_time = open(SOCKFILE, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (filefd_for_time == -1) {
+            syslog(LOG_ERR, "open() error: %s", strerror(errno));
+            success = false;
+        }
+
+        struct itimerval delay;
+        delay.it_value.tv_sec = 10;
+        delay.it_value.tv_usec = 0;
+        delay.it_interval.tv_sec = 10;
+        delay.it_interval.tv_usec = 0;
 
-    if (setitimer(ITIMER_REAL, &delay, NULL) != 0) {
-        syslog(LOG_ERR, "setitimer() error: %s", strerror(errno));
-        success = false;
+        if (setitimer(ITIMER_REAL, &delay, NULL) != 0) {
+            syslog(LOG_ERR, "setitimer() error: %s", strerror(errno));
+            success = false;
+        }
     }
 #endif
 
@@ -436,11 +759,15 @@ int main(int argc, char* argv[]) {
 
     poll_data.fd = sockfd;
     poll_data.events = POLLIN;
+    bool use_deadlines = read_timeout_ms != 0 || write_timeout_ms != 0;
 
     SLIST_INIT(&head);
 
     while (!terminate) {
-        poll_rtn = poll(&poll_data, 1, -1);
+        poll_rtn = poll(&poll_data, 1, use_deadlines ? TIMER_TICK_MS : -1);
+        if (use_deadlines) {
+            timer_wheel_advance(&wheel);
+        }
 
         if (poll_rtn == -1) {
             syslog(LOG_ERR, "poll() error: %s", strerror(errno));
@@ -455,16 +782,19 @@ int main(int argc, char* argv[]) {
             memset(s, 0, INET6_ADDRSTRLEN);
             inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr*)&their_addr), s, sizeof(s));
             
-            readfd = open(SOCKFILE, O_RDONLY);
-            if (readfd == -1) {
-                syslog(LOG_ERR, "open() error: %s", strerror(errno));
-                continue;
-            }
-            
-            writefd = open(SOCKFILE, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-            if (writefd == -1) {
-                syslog(LOG_ERR, "open() error: %s", strerror(errno));
-                continue;
+            readfd = writefd = -1;
+            if (!use_memory) {
+                readfd = open(SOCKFILE, O_RDONLY);
+                if (readfd == -1) {
+                    syslog(LOG_ERR, "open() error: %s", strerror(errno));
+                    continue;
+                }
+
+                writefd = open(SOCKFILE, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+                if (writefd == -1) {
+                    syslog(LOG_ERR, "open() error: %s", strerror(errno));
+                    continue;
+                }
             }
             
             char *readbuf = (char*)malloc(BUFFER_SIZE * sizeof(char));
@@ -495,9 +825,13 @@ int main(int argc, char* argv[]) {
             thread_data->read_buffer = readbuf;
             thread_data->write_buffer = writebuf;
             thread_data->mutex = &file_mutex;
+            thread_data->history = use_memory ? &history : NULL;
+            memset(&thread_data->deadline, 0, sizeof(thread_data->deadline));
+            thread_data->deadline.fn = deadline_passed;
             thread_data->thread_complete_success = false;
+            arm_deadline(thread_data, read_timeout_ms);
 
-            pthread_create(&conn_thread, NULL, thread_handle_conn, thread_data);
+            pthread_create(&conn_thread, NULL, use_memory ? thread_handle_mem_conn : thread_handle_conn, thread_data);
 
             n = (struct list_entry*)malloc(sizeof(struct list_entry));
             if (n == NULL) {
@@ -515,6 +849,7 @@ int main(int argc, char* argv[]) {
     }
     
     syslog(LOG_INFO, "Caught signal, exiting");
+    syslog(LOG_INFO, "%lu connections closed at their deadline", timed_out_connections);
     printf("Caught signal, exiting\n");
     close_connections(&head);
     cleanup();
@@ -1,7 +1,41 @@
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+struct mem_history;
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+/**
+ * A deadline in a timer_wheel, fn is called from timer_wheel_advance() with
+ * the wheel lock held once it passes
+ */
+struct wheel_timer {
+    LIST_ENTRY(wheel_timer) entries;
+    uint64_t expires;
+    bool pending;
+    bool fired;
+    void (*fn)(struct wheel_timer *timer);
+};
+
+LIST_HEAD(wheel_slot, wheel_timer);
+
+struct timer_wheel {
+    pthread_mutex_t lock;
+    struct wheel_slot slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    // Last tick processed, ticks count from start
+    uint64_t now;
+    unsigned int tick_ms;
+    struct timespec start;
+};
 
 struct thread_conn_data {
     int connfd;
@@ -11,6 +45,10 @@ struct thread_conn_data {
     char *read_buffer;
     char *write_buffer;
     pthread_mutex_t *mutex;
+    // Set instead of the fds and mutex when running with the memory backend
+    struct mem_history *history;
+    // Read deadline while the packet is received, write deadline while echoing
+    struct wheel_timer deadline;
     bool thread_complete_success;
 };
 
@@ -22,4 +60,94 @@ struct list_entry {
 
 SLIST_HEAD(slisthead, list_entry);
 
+/**
+ * A packet evicted from memory before the spill thread wrote it out
+ */
+struct spill_entry {
+    char *data;
+    size_t size;
+    STAILQ_ENTRY(spill_entry) entries;
+};
+
+STAILQ_HEAD(spillhead, spill_entry);
+
+/**
+ * History kept in process memory, selected with -m instead of the file or
+ * /dev/aesdchar backend.  Like the driver it keeps the most recent packets
+ * in an aesd_circular_buffer, one entry per newline terminated packet.
+ */
+struct mem_history {
+    struct aesd_circular_buffer buffer;
+    // Held for reading while echoing, for writing while adding or evicting
+    pthread_rwlock_t lock;
+    // Bytes held by the entries in buffer
+    size_t bytes;
+    // Oldest packets are evicted beyond this many bytes, 0 for no limit
+    size_t max_bytes;
+    // Packets committed since start, the newest entry is number committed - 1
+    uint64_t committed;
+    // Bytes after the last newline, joined to the next packet like the driver's cur_cmd
+    const char *pending;
+    size_t pending_size;
+
+    // Spill file every packet is appended to in the background, -1 for none
+    int spill_fd;
+    // Packets before this number are written out or queued in evicted
+    uint64_t spilled;
+    struct spillhead evicted;
+    pthread_t spill_thread;
+    pthread_mutex_t spill_mutex;
+    pthread_cond_t spill_cond;
+    bool spill_pending;
+    bool spill_stop;
+};
+
+int mem_history_init(struct mem_history *history, size_t max_bytes, const char *spill_path);
+void mem_history_destroy(struct mem_history *history);
+int mem_history_append(struct mem_history *history, const char *data, size_t size);
+int mem_history_seekto(struct mem_history *history, uint32_t write_cmd, uint32_t write_cmd_offset, size_t *pos);
+ssize_t mem_history_send(struct mem_history *history, int fd, size_t pos);
+
+/**
+ * The history as one read saw it, shared by every connection it covers
+ */
+struct history_snapshot {
+    char *data;
+    size_t size;
+    // Writes covered, as counted by echo_coalescer_written()
+    uint64_t generation;
+    // Guarded by the echo_coalescer lock
+    unsigned int refs;
+    bool ready;
+    bool failed;
+};
+
+/**
+ * Coalesces the history reads of the file and device backends, see aesdsocket-echo.c
+ */
+struct echo_coalescer {
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;
+    // Latest snapshot, being read or ready
+    struct history_snapshot *current;
+    // Snapshot waiting for the read of current to finish before it starts its own
+    struct history_snapshot *next;
+    // Writes to the history so far, bumped under file_mutex
+    atomic_ullong written;
+};
+
+void echo_coalescer_init(struct echo_coalescer *echoes);
+void echo_coalescer_destroy(struct echo_coalescer *echoes);
+// Called under file_mutex after each write, returns the generation a snapshot needs to cover it
+uint64_t echo_coalescer_written(struct echo_coalescer *echoes);
+// Returns NULL if the history could not be read into memory
+struct history_snapshot *echo_coalescer_get(struct echo_coalescer *echoes, pthread_mutex_t *file_mutex,
+        int readfd, uint64_t needed);
+void echo_coalescer_put(struct echo_coalescer *echoes, struct history_snapshot *snapshot);
 
+void timer_wheel_init(struct timer_wheel *wheel, unsigned int tick_ms);
+void timer_wheel_destroy(struct timer_wheel *wheel);
+void timer_wheel_arm(struct timer_wheel *wheel, struct wheel_timer *timer, unsigned int timeout_ms);
+// Returns false if the timer had already fired
+bool timer_wheel_cancel(struct timer_wheel *wheel, struct wheel_timer *timer);
+void timer_wheel_advance(struct timer_wheel *wheel);
@@ -0,0 +1,220 @@
+#include "unity.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+#include "../../aesd-char-driver/aesd-circular-buffer-spmc.h"
+
+#define STRESS_ENTRIES 200000
+#define STRESS_READERS 3
+#define STRESS_PAYLOAD 24
+
+struct stress_state {
+    struct aesd_circular_buffer_spmc buffer;
+    atomic_bool done;
+    atomic_ulong validated;
+    atomic_ulong torn;
+    atomic_uchar *seen;
+};
+
+/**
+* Fills @param buf with a payload naming entry @param index, so a reader can tell which
+* entry the bytes it copied came from
+*/
+static void fill_payload(char *buf, uint64_t index)
+{
+    snprintf(buf, STRESS_PAYLOAD, "%020llu\n", (unsigned long long)index);
+}
+
+/**
+* The single threaded behaviour matches aesd_circular_buffer, including
+* overwriting the oldest entry once full
+*/
+void test_spmc_matches_circular_buffer()
+{
+    static const char *strings[] = { "a\n", "bb\n", "ccc\n", "dddd\n", "eeeee\n", "ffffff\n", "g\n",
+        "hh\n", "iii\n", "jjjj\n", "kkkkk\n", "llllll\n", "m\n" };
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_spmc spmc;
+    struct aesd_buffer_entry entry = {}, spmc_entry, evicted, spmc_evicted, *found;
+    size_t offset, spmc_offset, total = 0, pos;
+    uint64_t index;
+    unsigned int i;
+
+    aesd_circular_buffer_init(&buffer);
+    aesd_circular_buffer_spmc_init(&spmc);
+    for (i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+        entry.buffptr = strings[i];
+        entry.size = strlen(strings[i]);
+        evicted = aesd_circular_buffer_add_entry(&buffer, &entry);
+        spmc_evicted = aesd_circular_buffer_spmc_add_entry(&spmc, &entry);
+        TEST_ASSERT_EQUAL_PTR(evicted.buffptr, spmc_evicted.buffptr);
+        TEST_ASSERT_EQUAL_UINT8(aesd_circular_buffer_count(&buffer), aesd_circular_buffer_spmc_count(&spmc));
+    }
+
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        total += strlen(strings[sizeof(strings) / sizeof(strings[0]) - 1 - i]);
+    }
+    for (pos = 0; pos <= total; pos++) {
+        found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, pos, &offset);
+        if (found == NULL) {
+            TEST_ASSERT_FALSE(aesd_circular_buffer_spmc_find_entry_offset_for_fpos(&spmc, pos, &spmc_entry,
+                        &spmc_offset, &index));
+            continue;
+        }
+        TEST_ASSERT_TRUE(aesd_circular_buffer_spmc_find_entry_offset_for_fpos(&spmc, pos, &spmc_entry,
+                    &spmc_offset, &index));
+        TEST_ASSERT_EQUAL_PTR(found->buffptr, spmc_entry.buffptr);
+        TEST_ASSERT_EQUAL(offset, spmc_offset);
+        TEST_ASSERT_TRUE(aesd_circular_buffer_spmc_validate(&spmc, index));
+    }
+}
+
+/**
+* Removing returns entries oldest first, and an overwritten entry is no longer found
+*/
+void test_spmc_remove_entry()
+{
+    static char data[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3][STRESS_PAYLOAD];
+    struct aesd_circular_buffer_spmc spmc;
+    struct aesd_buffer_entry entry = {}, removed;
+    unsigned int i;
+
+    aesd_circular_buffer_spmc_init(&spmc);
+    TEST_ASSERT_FALSE(aesd_circular_buffer_spmc_remove_entry(&spmc, &removed));
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3; i++) {
+        entry.buffptr = data[i];
+        entry.size = STRESS_PAYLOAD;
+        aesd_circular_buffer_spmc_add_entry(&spmc, &entry);
+    }
+    TEST_ASSERT_FALSE(aesd_circular_buffer_spmc_get_entry(&spmc, 2, &removed));
+    TEST_ASSERT_TRUE(aesd_circular_buffer_spmc_get_entry(&spmc, 3, &removed));
+    for (i = 3; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3; i++) {
+        TEST_ASSERT_TRUE(aesd_circular_buffer_spmc_remove_entry(&spmc, &removed));
+        TEST_ASSERT_EQUAL_PTR(data[i], removed.buffptr);
+    }
+    TEST_ASSERT_EQUAL_UINT8(0, aesd_circular_buffer_spmc_count(&spmc));
+    TEST_ASSERT_FALSE(aesd_circular_buffer_spmc_remove_entry(&spmc, &removed));
+}
+
+static void *stress_reader(void *arg)
+{
+    struct stress_state *state = arg;
+    struct aesd_buffer_entry entry;
+    char copy[STRESS_PAYLOAD], expected[STRESS_PAYLOAD];
+    size_t offset;
+    uint64_t index;
+
+    while (!atomic_load(&state->done)) {
+        if (!aesd_circular_buffer_spmc_find_entry_offset_for_fpos(&state->buffer, 0, &entry, &offset, &index)) {
+            continue;
+        }
+        memcpy(copy, entry.buffptr, sizeof(copy));
+        if (!aesd_circular_buffer_spmc_validate(&state->buffer, index)) {
+            continue;
+        }
+        fill_payload(expected, index);
+        if (entry.mono_ns != index || memcmp(copy, expected, sizeof(copy)) != 0) {
+            atomic_fetch_add(&state->torn, 1);
+        }
+        atomic_fetch_add(&state->validated, 1);
+    }
+    return NULL;
+}
+
+/**
+* Readers racing a producer that keeps reusing overwritten buffers never
+* accept data from an entry other than the one they looked up
+*/
+void test_spmc_stress_overwrite_detection()
+{
+    static char data[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1][STRESS_PAYLOAD];
+    static struct stress_state state;
+    struct aesd_buffer_entry entry = {}, evicted;
+    pthread_t readers[STRESS_READERS];
+    char *spare = data[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint64_t i;
+    int n;
+
+    aesd_circular_buffer_spmc_init(&state.buffer);
+    atomic_init(&state.done, false);
+    atomic_init(&state.validated, 0);
+    atomic_init(&state.torn, 0);
+    for (n = 0; n < STRESS_READERS; n++) {
+        TEST_ASSERT_EQUAL(0, pthread_create(&readers[n], NULL, stress_reader, &state));
+    }
+    for (i = 0; i < STRESS_ENTRIES; i++) {
+        // Until the buffer is full every entry gets its own buffer, then the
+        // one just overwritten is filled in for the next entry
+        entry.buffptr = i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ? data[i] : spare;
+        fill_payload((char *)entry.buffptr, i);
+        entry.size = STRESS_PAYLOAD;
+        entry.mono_ns = i;
+        evicted = aesd_circular_buffer_spmc_add_entry(&state.buffer, &entry);
+        if (evicted.buffptr) {
+            spare = (char *)evicted.buffptr;
+        }
+    }
+    atomic_store(&state.done, true);
+    for (n = 0; n < STRESS_READERS; n++) {
+        pthread_join(readers[n], NULL);
+    }
+    TEST_ASSERT_EQUAL_UINT64(0, atomic_load(&state.torn));
+    TEST_ASSERT_TRUE(atomic_load(&state.validated) > 0);
+}
+
+static void *stress_consumer(void *arg)
+{
+    struct stress_state *state = arg;
+    struct aesd_buffer_entry entry;
+    bool done;
+
+    for (;;) {
+        // Sample done first, so entries added just before it was set are drained
+        done = atomic_load(&state->done);
+        if (aesd_circular_buffer_spmc_remove_entry(&state->buffer, &entry)) {
+            atomic_fetch_add(&state->seen[entry.mono_ns], 1);
+        } else if (done) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+* Every entry is handed out exactly once, either to one of the consumers
+* removing entries or back to the producer when it overwrites it
+*/
+void test_spmc_stress_consumers()
+{
+    static struct stress_state state;
+    struct aesd_buffer_entry entry = { .buffptr = "x\n", .size = 2 }, evicted;
+    pthread_t consumers[STRESS_READERS];
+    uint64_t i;
+    int n;
+
+    aesd_circular_buffer_spmc_init(&state.buffer);
+    atomic_init(&state.done, false);
+    state.seen = calloc(STRESS_ENTRIES, sizeof(*state.seen));
+    TEST_ASSERT_NOT_NULL(state.seen);
+    for (n = 0; n < STRESS_READERS; n++) {
+        TEST_ASSERT_EQUAL(0, pthread_create(&consumers[n], NULL, stress_consumer, &state));
+    }
+    for (i = 0; i < STRESS_ENTRIES; i++) {
+        entry.mono_ns = i;
+        evicted = aesd_circular_buffer_spmc_add_entry(&state.buffer, &entry);
+        if (evicted.buffptr) {
+            atomic_fetch_add(&state.seen[evicted.mono_ns], 1);
+        }
+    }
+    atomic_store(&state.done, true);
+    for (n = 0; n < STRESS_READERS; n++) {
+        pthread_join(consumers[n], NULL);
+    }
+    for (i = 0; i < STRESS_ENTRIES; i++) {
+        TEST_ASSERT_EQUAL_UINT8_MESSAGE(1, atomic_load(&state.seen[i]), "entry not handed out exactly once");
+    }
+    free(state.seen);
+}